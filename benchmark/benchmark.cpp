@@ -0,0 +1,340 @@
+#include "InTeX/ast.hpp"
+#include "InTeX/lexer.hpp"
+#include "InTeX/parser.hpp"
+#include "InTeX/evaluator.hpp"
+#include "geometry.hpp"
+#include "singularities.hpp"
+#include "bufferpool.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/*
+    Benchmarks the explicit surface pipeline outside the application: lexing,
+    parsing, evaluating the expression over the grid and meshing it with
+    Geometry. Prints one JSON object per case on stdout so runs can be diffed
+    or loaded into a spreadsheet, and a readable table on stderr.
+
+    Options:
+        --resolutions 100,500,1000,2000   mesh resolutions (samples per row)
+        --threads 1,2,4                   concurrent mesh jobs
+        --clip on,off                     clip settings
+        --filter name                     only corpus entries whose name contains name
+        --repeat n                        runs per case, the median is reported
+        --range r                         half width of the view window
+        --trace file                      write the Geometry stages of every case as a Chrome trace
+        --metrics file                    write stage histograms and sample counters in the Prometheus format
+*/
+
+struct Expression {
+    const char* name_;
+    const char* latex_;
+};
+
+// Fixed corpus, changing it invalidates comparisons with earlier runs
+static const Expression corpus[] = {
+    {"trig", "\\sin(x)\\cos(y)"},
+    {"trig_nested", "\\sin(x + \\cos(y \\sin(x)))"},
+    {"poles", "\\tan(x) + \\frac{1}{y}"},
+    {"poles_radial", "\\frac{1}{x^2 + y^2 - 25}"},
+    {"logs", "\\ln(x^2 + y^2)"},
+    {"logs_base", "\\log_{2}(\\left| x y \\right| + 1)"},
+    {"polynomial", "x^3 - 3 x y^2"},
+    {"polynomial_high", "0.001 (x^6 - y^5 + x^2 y^3 - 4 x y + 7)"},
+    {"fractions", "\\frac{1}{1 + \\frac{1}{1 + \\frac{x}{y}}}"},
+    {"fractions_deep", "\\frac{x}{1 + \\frac{y}{1 + \\frac{x}{1 + \\frac{y}{1 + x^2}}}}"},
+};
+
+struct Options {
+    std::vector<int> resolutions_ = {100, 250, 500, 1000, 2000};
+    std::vector<int> threads_ = {1};
+    std::vector<bool> clips_ = {true, false};
+    std::string filter_;
+    std::string trace_;
+    std::string metrics_;
+    int repeat_ = 3;
+    int range_ = 10;
+};
+
+struct Result {
+    double lex_us_ = 0.0;
+    double parse_us_ = 0.0;
+    double evaluate_ms_ = 0.0;
+    double mesh_ms_ = 0.0;
+    // Stages of mesh_ms_ per job, see stageMs
+    double sample_ms_ = 0.0;
+    double triangulate_ms_ = 0.0;
+    double normals_ms_ = 0.0;
+    // Grid the mesh samples, the resolution is only a request, see Geometry::layout
+    int rows_ = 0;
+    int cols_ = 0;
+    long long samples_ = 0;
+    long long triangles_ = 0;
+    long long peak_kb_ = 0;
+};
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed(Clock::time_point start, double unit) {
+    return std::chrono::duration<double>(Clock::now() - start).count() * unit;
+}
+
+static double median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+static std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+// A field of /proc/self/status in KB, -1 where there is none
+static long long statusField(const char* field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    size_t length = std::strlen(field);
+    while (std::getline(status, line)) {
+        if (line.compare(0, length, field) == 0) return std::atoll(line.c_str() + length);
+    }
+    return -1;
+}
+
+/*
+    Linux resets the peak resident set size to the current one when 5 is
+    written to clear_refs. Heap that earlier cases freed is handed back to the
+    system first, where the allocator allows it, and a case reports how far
+    its peak rose above the resident size it started at. Elsewhere the peak of
+    the whole process is reported, which only grows. Returns the base to pass
+    to peakMemory.
+*/
+static long long resetPeakMemory() {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    std::ofstream clear("/proc/self/clear_refs");
+    if (clear) clear << "5";
+    return std::max(0LL, statusField("VmRSS:"));
+}
+
+static long long peakMemory(long long base) {
+    long long peak = statusField("VmHWM:");
+    if (peak >= 0) return std::max(0LL, peak - base);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Total time of a Geometry stage so far, from the histogram its TraceSpan records into
+static double stageMs(const char* name) {
+    return Metrics::stage(name).sum() / 1e3;
+}
+
+// Sum of the evaluation loop, volatile so the loop is not optimised away
+static volatile double sink;
+
+static Expr* parse(const std::string& latex) {
+    Lexer lexer(latex);
+    std::vector<std::string> tokens = lexer.lex();
+    Parser parser(tokens);
+    return parser.parse()->copy();
+}
+
+/*
+    Lexing and parsing take microseconds, so they are timed over many
+    iterations. Evaluation walks the tree once per sample of the grid the mesh
+    samples, meshing runs threads Geometry jobs at once with their own
+    evaluator like the application does for several equations. Meshing is
+    wall time including the Geometry's own sampling, its stages are the
+    averages per job of sampling the tiles and the signs of singular sets,
+    triangulating and clipping, and computing normals.
+*/
+static Result runCase(const Expression& expression, int resolution, bool clip, int threads, const Options& options, long long job) {
+    const int iterations = 1000;
+    std::vector<double> lex, parsing, evaluate, mesh, sample, triangulate, normals;
+    Result result;
+    // Every case starts with an empty pool, its repeats reuse buffers like a slider drag does
+    BufferPool::clear();
+    long long base = resetPeakMemory();
+    std::vector<double> xs, ys;
+    Geometry::axes(resolution, options.range_, 0.0, 0.0, false, xs, ys);
+    result.rows_ = static_cast<int>(ys.size());
+    result.cols_ = static_cast<int>(xs.size());
+
+    for (int r = 0; r < options.repeat_; r++) {
+        Clock::time_point start = Clock::now();
+        std::vector<std::string> tokens;
+        for (int i = 0; i < iterations; i++) {
+            Lexer lexer(expression.latex_);
+            tokens = lexer.lex();
+        }
+        lex.push_back(elapsed(start, 1e6) / iterations);
+
+        start = Clock::now();
+        for (int i = 0; i < iterations; i++) {
+            // The parser owns the tree it returns
+            Parser parser(tokens);
+            parser.parse();
+        }
+        parsing.push_back(elapsed(start, 1e6) / iterations);
+
+        std::unique_ptr<Evaluator> evaluator(new Evaluator(parse(expression.latex_), {}));
+        start = Clock::now();
+        double sum = 0.0;
+        for (double y : ys) {
+            evaluator->vars_["y"] = static_cast<float>(y);
+            for (double x : xs) {
+                evaluator->vars_["x"] = static_cast<float>(x);
+                sum += evaluator->evaluate();
+            }
+        }
+        evaluate.push_back(elapsed(start, 1e3));
+        // Stored where the compiler cannot see it unused, so the loop is kept
+        sink = sum;
+
+        Singularities singularities(evaluator->ast_);
+        std::vector<std::unique_ptr<Geometry>> geometries(threads);
+        std::vector<std::thread> workers;
+        double sampled = stageMs("generateVertices") + stageMs("sampleSigns");
+        double triangulated = stageMs("clipTriangles");
+        double normalized = stageMs("normals");
+        start = Clock::now();
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                TraceJob trace(expression.name_, job);
+                geometries[t].reset(new Geometry(evaluator.get(), nullptr, resolution, options.range_, 0.0, 0.0, clip, false,
+                                                 nullptr, false, 0, false, false, &singularities));
+            });
+        }
+        for (std::thread& worker : workers) worker.join();
+        mesh.push_back(elapsed(start, 1e3));
+        sample.push_back((stageMs("generateVertices") + stageMs("sampleSigns") - sampled) / threads);
+        triangulate.push_back((stageMs("clipTriangles") - triangulated) / threads);
+        normals.push_back((stageMs("normals") - normalized) / threads);
+
+        // Every job meshes the same surface, totals count all of them
+        const Geometry& geometry = *geometries[0];
+        result.samples_ = threads * (long long)geometry.samples();
+        result.triangles_ = threads * (long long)geometry.mesh_.vertices_.size() / 9;
+    }
+    result.lex_us_ = median(lex);
+    result.parse_us_ = median(parsing);
+    result.evaluate_ms_ = median(evaluate);
+    result.mesh_ms_ = median(mesh);
+    result.sample_ms_ = median(sample);
+    result.triangulate_ms_ = median(triangulate);
+    result.normals_ms_ = median(normals);
+    result.peak_kb_ = peakMemory(base);
+    return result;
+}
+
+static void usage(const char* program) {
+    std::fprintf(stderr, "usage: %s [--resolutions 100,500] [--threads 1,4] [--clip on,off] "
+                         "[--filter name] [--repeat n] [--range r] [--trace file] [--metrics file]\n", program);
+}
+
+static bool parseOptions(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string flag = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        if (flag == "--resolutions") {
+            options.resolutions_.clear();
+            for (const std::string& item : split(value)) options.resolutions_.push_back(std::max(2, std::atoi(item.c_str())));
+        } else if (flag == "--threads") {
+            options.threads_.clear();
+            for (const std::string& item : split(value)) options.threads_.push_back(std::max(1, std::atoi(item.c_str())));
+        } else if (flag == "--clip") {
+            options.clips_.clear();
+            for (const std::string& item : split(value)) options.clips_.push_back(item == "on");
+        } else if (flag == "--filter") {
+            options.filter_ = value;
+        } else if (flag == "--repeat") {
+            options.repeat_ = std::max(1, std::atoi(value.c_str()));
+        } else if (flag == "--trace") {
+            options.trace_ = value;
+        } else if (flag == "--metrics") {
+            options.metrics_ = value;
+        } else if (flag == "--range") {
+            options.range_ = std::max(1, std::atoi(value.c_str()));
+        } else {
+            return false;
+        }
+    }
+    return !options.resolutions_.empty() && !options.threads_.empty() && !options.clips_.empty();
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return 1;
+    }
+    // Each case is one job in the trace, named after its expression
+    Trace::setEnabled(!options.trace_.empty());
+    long long job = 0;
+
+    std::fprintf(stderr, "%-16s %6s %11s %4s %3s %9s %9s %11s %10s %9s %9s %9s %12s %12s %9s\n", "expression", "res",
+                 "grid", "clip", "thr", "lex us", "parse us", "evaluate ms", "mesh ms", "sample", "triangle", "normals", "samples/s",
+                 "triangles/s", "peak MB");
+    for (const Expression& expression : corpus) {
+        if (!options.filter_.empty() && std::strstr(expression.name_, options.filter_.c_str()) == nullptr) continue;
+        for (int resolution : options.resolutions_) {
+            for (bool clip : options.clips_) {
+                for (int threads : options.threads_) {
+                    Result result;
+                    try {
+                        result = runCase(expression, resolution, clip, threads, options, ++job);
+                    } catch (const std::exception& e) {
+                        std::fprintf(stderr, "%s: %s\n", expression.name_, e.what());
+                        return 1;
+                    }
+                    double samples_per_s = result.samples_ / (result.mesh_ms_ / 1e3);
+                    double triangles_per_s = result.triangles_ / (result.mesh_ms_ / 1e3);
+                    std::printf("{\"expression\":\"%s\",\"resolution\":%d,\"rows\":%d,\"cols\":%d,\"clip\":%s,\"threads\":%d,"
+                                "\"lex_us\":%.3f,\"parse_us\":%.3f,\"evaluate_ms\":%.3f,\"mesh_ms\":%.3f,"
+                                "\"sample_ms\":%.3f,\"triangulate_ms\":%.3f,\"normals_ms\":%.3f,\"samples\":%lld,\"triangles\":%lld,\"samples_per_s\":%.0f,\"triangles_per_s\":%.0f,"
+                                "\"peak_kb\":%lld}\n",
+                                expression.name_, resolution, result.rows_, result.cols_, clip ? "true" : "false", threads,
+                                result.lex_us_, result.parse_us_, result.evaluate_ms_, result.mesh_ms_,
+                                result.sample_ms_, result.triangulate_ms_, result.normals_ms_, result.samples_, result.triangles_, samples_per_s, triangles_per_s, result.peak_kb_);
+                    std::fflush(stdout);
+                    char grid[32];
+                    std::snprintf(grid, sizeof(grid), "%dx%d", result.cols_, result.rows_);
+                    std::fprintf(stderr, "%-16s %6d %11s %4s %3d %9.2f %9.2f %11.1f %10.1f %9.1f %9.1f %9.1f %12.3g %12.3g %9.1f\n",
+                                 expression.name_, resolution, grid, clip ? "on" : "off", threads, result.lex_us_,
+                                 result.parse_us_, result.evaluate_ms_, result.mesh_ms_, result.sample_ms_,
+                                 result.triangulate_ms_, result.normals_ms_, samples_per_s, triangles_per_s,
+                                 result.peak_kb_ / 1024.0);
+                }
+            }
+        }
+    }
+    if (!options.trace_.empty() && !Trace::save(options.trace_)) {
+        std::fprintf(stderr, "could not write %s\n", options.trace_.c_str());
+        return 1;
+    }
+    if (!options.metrics_.empty() && !Metrics::save(options.metrics_)) {
+        std::fprintf(stderr, "could not write %s\n", options.metrics_.c_str());
+        return 1;
+    }
+    return 0;
+}
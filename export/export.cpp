@@ -0,0 +1,130 @@
+#include "InTeX/ast.hpp"
+#include "InTeX/lexer.hpp"
+#include "InTeX/parser.hpp"
+#include "InTeX/compiler.hpp"
+#include "exporter.hpp"
+#include "singularities.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+    Writes an explicit surface z = f(x, y) to STL, PLY, OBJ or GLB at any
+    resolution. The mesh is streamed to the file band by band, so a resolution
+    whose mesh would not fit in memory still exports.
+
+    Usage: graphtex_export [options] latex file
+
+    Options:
+        --resolution n        samples per row, 1000 by default
+        --range r             half width of the view window
+        --center x,y          center of the view window
+        --clip on|off         clip triangles at the view box, on by default
+        --nested              use the application's nested grids
+        --var name=value      value of a variable other than x and y, may repeat
+*/
+
+struct Options {
+    int resolution_ = 1000;
+    int range_ = 10;
+    double center_x_ = 0.0;
+    double center_y_ = 0.0;
+    bool clip_ = true;
+    bool nested_ = false;
+    std::vector<std::string> names_;
+    std::vector<float> values_;
+    std::string latex_;
+    std::string path_;
+};
+
+static void usage(const char* program) {
+    std::fprintf(stderr, "usage: %s [--resolution n] [--range r] [--center x,y] [--clip on|off] [--nested] "
+                         "[--var name=value] latex file.{stl,ply,obj,glb}\n", program);
+}
+
+static bool parseOptions(int argc, char* argv[], Options& options) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string flag = argv[i];
+        if (flag == "--nested") {
+            options.nested_ = true;
+            continue;
+        }
+        if (flag.compare(0, 2, "--") != 0) {
+            positional.push_back(flag);
+            continue;
+        }
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        if (flag == "--resolution") {
+            options.resolution_ = std::max(2, std::atoi(value.c_str()));
+        } else if (flag == "--range") {
+            options.range_ = std::max(1, std::atoi(value.c_str()));
+        } else if (flag == "--center") {
+            size_t comma = value.find(',');
+            if (comma == std::string::npos) return false;
+            options.center_x_ = std::atof(value.substr(0, comma).c_str());
+            options.center_y_ = std::atof(value.substr(comma + 1).c_str());
+        } else if (flag == "--clip") {
+            options.clip_ = value == "on";
+        } else if (flag == "--var") {
+            size_t equals = value.find('=');
+            if (equals == std::string::npos) return false;
+            options.names_.push_back(value.substr(0, equals));
+            options.values_.push_back(static_cast<float>(std::atof(value.substr(equals + 1).c_str())));
+        } else {
+            return false;
+        }
+    }
+    if (positional.size() != 2) return false;
+    options.latex_ = positional[0];
+    options.path_ = positional[1];
+    return true;
+}
+
+static bool isZ(const Expr* expr) {
+    return expr->type_ == Type::VAR && ((const Var*)expr)->value_ == "z";
+}
+
+// The f of f(x, y) or z = f(x, y), like the application reads explicit surfaces
+static Expr* parseExplicit(const std::string& latex) {
+    Lexer lexer(latex);
+    std::vector<std::string> tokens = lexer.lex();
+    Parser parser(tokens);
+    if (std::find(tokens.begin(), tokens.end(), "=") == tokens.end()) {
+        return parser.parse()->copy();
+    }
+    std::unique_ptr<Implicit> eq((Implicit*)parser.parseEquation());
+    if (isZ(eq->e1_)) return ((Expr*)eq->e2_)->copy();
+    if (isZ(eq->e2_)) return ((Expr*)eq->e1_)->copy();
+    throw std::runtime_error("export error: only explicit surfaces z = f(x, y) can be exported");
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return 1;
+    }
+    try {
+        std::unique_ptr<Expr> expr(parseExplicit(options.latex_));
+        Program program = Program({expr.get()}, {"x", "y"}, options.names_).bind(options.values_);
+        Singularities singularities = Singularities(expr.get(), options.names_).bind(options.values_);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ExportStats stats = exportSurface(&program, options.resolution_, options.range_, options.center_x_,
+                                          options.center_y_, options.clip_, options.nested_, options.path_, nullptr,
+                                          &singularities);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::fprintf(stderr, "%s: %llu triangles, %.1f MB in %.2f s\n", options.path_.c_str(),
+                     static_cast<unsigned long long>(stats.triangles_), stats.bytes_ / 1048576.0, seconds);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -114,6 +114,13 @@ Trig::~Trig() {
     delete (this->e_);
 }
 
+Implicit::~Implicit() {
+    delete(this->e1_);
+    delete(this->e2_);
+}
 
-
-
+Parametric::~Parametric() {
+    delete(this->x_);
+    delete(this->y_);
+    delete(this->z_);
+}
@@ -55,6 +55,7 @@ struct Equation {
 	const Type type_;
 
 	explicit Equation(const Type type) : type_(type) {}
+	virtual ~Equation() {}
 }  ;
 
 struct Num : public Expr {
@@ -147,6 +148,7 @@ struct Implicit : public Equation {
 	const Expr* e2_;
 
     explicit Implicit(const Expr* e1, const Expr* e2) : Equation(Type::IMPL), e1_(e1), e2_(e2) {}
+    ~Implicit() override;
 };
 
 struct Parametric : public Equation {
@@ -156,4 +158,5 @@ struct Parametric : public Equation {
 
     explicit Parametric(const Expr* x, const Expr* y, const Expr* z) :
 	Equation(Type::PARA), x_(x), y_(y), z_(z) {}
+    ~Parametric() override;
 };
\ No newline at end of file
@@ -0,0 +1,251 @@
+#include "compiler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+static const std::map<std::string, OpCode> trig_ops = {
+    {"sin", OpCode::SIN}, {"cos", OpCode::COS}, {"tan", OpCode::TAN},
+    {"csc", OpCode::CSC}, {"sec", OpCode::SEC}, {"cot", OpCode::COT},
+    {"arcsin", OpCode::ASIN}, {"arccos", OpCode::ACOS}, {"arctan", OpCode::ATAN},
+    {"arccsc", OpCode::ACSC}, {"arcsec", OpCode::ASEC}, {"arccot", OpCode::ACOT},
+    {"sinh", OpCode::SINH}, {"cosh", OpCode::COSH}, {"tanh", OpCode::TANH}
+};
+
+Program::Program(const std::vector<const Expr*>& outputs, const std::vector<std::string>& inputs,
+                 const std::vector<std::string>& parameters) : inputs_(inputs), parameters_(parameters) {
+    for (const Expr* expr : outputs) {
+        outputs_.push_back(compile(expr));
+    }
+}
+
+// Instructions come after their operands, so one forward pass folds every constant chain
+Program Program::bind(const std::vector<float>& values) const {
+    if (values.size() != parameters_.size()) {
+        throw std::runtime_error ("evaluating error: wrong number of program parameters");
+    }
+    Program bound(*this);
+    // Keys no longer match the folded instructions
+    bound.registers_.clear();
+    for (Instruction& ins : bound.code_) {
+        if (ins.op_ == OpCode::PARAM) {
+            ins = Instruction{OpCode::CONST, -1, -1, values[ins.a_]};
+        } else if (ins.op_ != OpCode::CONST && ins.op_ != OpCode::INPUT && bound.code_[ins.a_].op_ == OpCode::CONST &&
+                   (ins.b_ < 0 || bound.code_[ins.b_].op_ == OpCode::CONST)) {
+            float result;
+            apply(ins, &bound.code_[ins.a_].value_, ins.b_ < 0 ? nullptr : &bound.code_[ins.b_].value_, &result, 1);
+            ins = Instruction{OpCode::CONST, -1, -1, result};
+        }
+    }
+    return bound;
+}
+
+bool Program::parameterized() const {
+    return std::any_of(code_.begin(), code_.end(), [](const Instruction& ins) { return ins.op_ == OpCode::PARAM; });
+}
+
+// Reuses the register of an identical instruction, folding it if every operand is constant
+int Program::append(OpCode op, int a, int b, float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    std::tuple<int, int, int, uint32_t> key(static_cast<int>(op), a, b, bits);
+    auto it = registers_.find(key);
+    if (it != registers_.end()) return it->second;
+
+    Instruction ins{op, a, b, value};
+    if (op != OpCode::CONST && op != OpCode::INPUT && op != OpCode::PARAM &&
+        code_[a].op_ == OpCode::CONST && (b < 0 || code_[b].op_ == OpCode::CONST)) {
+        float result;
+        apply(ins, &code_[a].value_, b < 0 ? nullptr : &code_[b].value_, &result, 1);
+        return append(OpCode::CONST, -1, -1, result);
+    }
+    code_.push_back(ins);
+    registers_[key] = code_.size() - 1;
+    return code_.size() - 1;
+}
+
+// Mirrors Evaluator::evaluateHelper
+int Program::compile(const Expr* expr) {
+    switch (expr->type_) {
+        case Type::NUM:
+            return append(OpCode::CONST, -1, -1, ((Num*)expr)->value_);
+        case Type::VAR: {
+            Var* var = (Var*)expr;
+            auto it = std::find(inputs_.begin(), inputs_.end(), var->value_);
+            if (it != inputs_.end()) {
+                return append(OpCode::INPUT, it - inputs_.begin(), -1, 0.0f);
+            }
+            auto param = std::find(parameters_.begin(), parameters_.end(), var->value_);
+            if (param == parameters_.end()) {
+                throw std::runtime_error ("undefined variable");
+            }
+            return append(OpCode::PARAM, param - parameters_.begin(), -1, 0.0f);
+        }
+        case Type::OP: {
+            Op* op = (Op*)expr;
+            int a = compile(op->e1_);
+            int b = compile(op->e2_);
+            switch (op->op_) {
+                case '+': return append(OpCode::ADD, a, b, 0.0f);
+                case '-': return append(OpCode::SUB, a, b, 0.0f);
+                case '*': return append(OpCode::MUL, a, b, 0.0f);
+                case '/': return append(OpCode::DIV, a, b, 0.0f);
+                case '^': return append(OpCode::POW, a, b, 0.0f);
+            }
+            throw std::runtime_error ("compiling error: invalid operator");
+        }
+        case Type::FRAC: {
+            Frac* frac = (Frac*)expr;
+            return append(OpCode::DIV, compile(frac->numerator_), compile(frac->denominator_), 0.0f);
+        }
+        case Type::SQRT: {
+            Sqrt* sqrt = (Sqrt*)expr;
+            return append(OpCode::ROOT, compile(sqrt->e_), compile(sqrt->root_), 0.0f);
+        }
+        case Type::LOG: {
+            Log* log = (Log*)expr;
+            return append(OpCode::LOG, compile(log->e_), compile(log->base_), 0.0f);
+        }
+        case Type::LN:
+            return append(OpCode::LN, compile(((Ln*)expr)->e_), -1, 0.0f);
+        case Type::LG:
+            return append(OpCode::LG, compile(((Lg*)expr)->e_), -1, 0.0f);
+        case Type::ABS:
+            return append(OpCode::ABS, compile(((Abs*)expr)->e_), -1, 0.0f);
+        case Type::TRIG: {
+            Trig* trig = (Trig*)expr;
+            auto it = trig_ops.find(trig->func_);
+            if (it == trig_ops.end()) {
+                throw std::runtime_error ("compiling error: invalid function " + trig->func_);
+            }
+            return append(it->second, compile(trig->e_), -1, 0.0f);
+        }
+        default:
+            throw std::runtime_error ("compiling error: invalid expression");
+    }
+}
+
+/*
+    One instruction over a batch. Guards match the tree walking evaluator: values
+    within 1e-6 of zero are treated as zero for divisions and logarithms, and the
+    transcendental functions are computed in double precision like the evaluator's
+    calls to the C math library.
+*/
+void Program::apply(const Instruction& ins, const float* a, const float* b, float* out, size_t count) {
+    const float zero = 1e-6;
+    switch (ins.op_) {
+        case OpCode::CONST:
+        case OpCode::INPUT:
+        case OpCode::PARAM:
+            break;
+        case OpCode::ADD:
+            for (size_t i = 0; i < count; i++) out[i] = a[i] + b[i];
+            break;
+        case OpCode::SUB:
+            for (size_t i = 0; i < count; i++) out[i] = a[i] - b[i];
+            break;
+        case OpCode::MUL:
+            for (size_t i = 0; i < count; i++) out[i] = a[i] * b[i];
+            break;
+        case OpCode::DIV:
+            for (size_t i = 0; i < count; i++) out[i] = std::abs(b[i]) > zero ? a[i] / b[i] : NAN;
+            break;
+        case OpCode::POW:
+            for (size_t i = 0; i < count; i++) out[i] = std::pow((double)a[i], (double)b[i]);
+            break;
+        case OpCode::ROOT:
+            for (size_t i = 0; i < count; i++) out[i] = std::abs(b[i]) > zero ? std::pow((double)a[i], 1.0 / b[i]) : NAN;
+            break;
+        case OpCode::LOG:
+            for (size_t i = 0; i < count; i++) {
+                float denom = std::abs(b[i]) > zero ? std::log((double)b[i]) : 0.0f;
+                out[i] = std::abs(denom) > zero && std::abs(a[i]) > zero ? std::log((double)a[i]) / denom : NAN;
+            }
+            break;
+        case OpCode::LN:
+            for (size_t i = 0; i < count; i++) out[i] = std::abs(a[i]) > zero ? std::log((double)a[i]) : NAN;
+            break;
+        case OpCode::LG:
+            for (size_t i = 0; i < count; i++) out[i] = std::abs(a[i]) > zero ? std::log2((double)a[i]) : NAN;
+            break;
+        case OpCode::ABS:
+            for (size_t i = 0; i < count; i++) out[i] = std::abs(a[i]);
+            break;
+        case OpCode::SIN:
+            for (size_t i = 0; i < count; i++) out[i] = std::sin((double)a[i]);
+            break;
+        case OpCode::COS:
+            for (size_t i = 0; i < count; i++) out[i] = std::cos((double)a[i]);
+            break;
+        case OpCode::TAN:
+            for (size_t i = 0; i < count; i++) {
+                float denom = std::cos((double)a[i]);
+                out[i] = std::abs(denom) > zero ? std::sin((double)a[i]) / denom : NAN;
+            }
+            break;
+        case OpCode::CSC:
+            for (size_t i = 0; i < count; i++) out[i] = std::abs(a[i]) > zero ? 1.0 / std::sin((double)a[i]) : NAN;
+            break;
+        case OpCode::SEC:
+            for (size_t i = 0; i < count; i++) out[i] = std::abs(a[i]) > zero ? 1.0 / std::cos((double)a[i]) : NAN;
+            break;
+        case OpCode::COT:
+            for (size_t i = 0; i < count; i++) {
+                float denom = std::sin((double)a[i]);
+                out[i] = std::abs(denom) > zero ? std::cos((double)a[i]) / denom : NAN;
+            }
+            break;
+        case OpCode::ASIN:
+            for (size_t i = 0; i < count; i++) out[i] = std::asin((double)a[i]);
+            break;
+        case OpCode::ACOS:
+            for (size_t i = 0; i < count; i++) out[i] = std::acos((double)a[i]);
+            break;
+        case OpCode::ATAN:
+            for (size_t i = 0; i < count; i++) out[i] = std::atan((double)a[i]);
+            break;
+        case OpCode::ACSC:
+            for (size_t i = 0; i < count; i++) out[i] = std::abs(a[i]) > zero ? std::asin(1.0 / a[i]) : NAN;
+            break;
+        case OpCode::ASEC:
+            for (size_t i = 0; i < count; i++) out[i] = std::abs(a[i]) > 0 ? std::acos(1.0 / a[i]) : NAN;
+            break;
+        case OpCode::ACOT:
+            for (size_t i = 0; i < count; i++) out[i] = std::abs(a[i]) > 0 ? std::atan(1.0 / a[i]) : NAN;
+            break;
+        case OpCode::SINH:
+            for (size_t i = 0; i < count; i++) out[i] = std::sinh((double)a[i]);
+            break;
+        case OpCode::COSH:
+            for (size_t i = 0; i < count; i++) out[i] = std::cosh((double)a[i]);
+            break;
+        case OpCode::TANH:
+            for (size_t i = 0; i < count; i++) out[i] = std::tanh((double)a[i]);
+            break;
+    }
+}
+
+void Program::run(const std::vector<const float*>& inputs, const std::vector<float*>& outputs,
+                  size_t count, std::vector<float>& scratch) const {
+    if (inputs.size() != inputs_.size() || outputs.size() != outputs_.size()) {
+        throw std::runtime_error ("evaluating error: wrong number of program inputs or outputs");
+    }
+    // One batch wide register per instruction
+    scratch.resize(code_.size() * count);
+    for (size_t r = 0; r < code_.size(); r++) {
+        const Instruction& ins = code_[r];
+        float* out = scratch.data() + r * count;
+        if (ins.op_ == OpCode::CONST || ins.op_ == OpCode::PARAM) {
+            std::fill(out, out + count, ins.value_);
+        } else if (ins.op_ == OpCode::INPUT) {
+            std::memcpy(out, inputs[ins.a_], count * sizeof(float));
+        } else {
+            const float* a = scratch.data() + ins.a_ * count;
+            const float* b = ins.b_ < 0 ? nullptr : scratch.data() + ins.b_ * count;
+            apply(ins, a, b, out, count);
+        }
+    }
+    for (size_t o = 0; o < outputs_.size(); o++) {
+        std::memcpy(outputs[o], scratch.data() + outputs_[o] * count, count * sizeof(float));
+    }
+}
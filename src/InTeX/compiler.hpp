@@ -0,0 +1,62 @@
+#pragma once
+#include "ast.hpp"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+enum class OpCode {
+    CONST, INPUT, PARAM, ADD, SUB, MUL, DIV, POW, ROOT, LOG, LN, LG, ABS,
+    SIN, COS, TAN, CSC, SEC, COT, ASIN, ACOS, ATAN, ACSC, ASEC, ACOT, SINH, COSH, TANH
+};
+
+// Register a_ op register b_, CONST reads value_, INPUT reads input a_ and PARAM is parameter a_ with value value_
+struct Instruction {
+    OpCode op_;
+    int a_;
+    int b_;
+    float value_;
+};
+
+/*
+    Flattens one or more expressions into a single instruction list that is run
+    over batches of samples, one instruction at a time across the whole batch.
+    Structurally identical subtrees compile to the same register, so outputs that
+    share subexpressions such as \cos(u) only evaluate them once, and subtrees
+    without inputs are folded into constants.
+*/
+class Program {
+private:
+    std::vector<std::string> inputs_;
+    std::vector<std::string> parameters_;
+    std::vector<Instruction> code_;
+    std::vector<int> outputs_;
+    // Instruction (op, a, b, value bits) to the register already holding it
+    std::map<std::tuple<int, int, int, uint32_t>, int> registers_;
+
+    int compile(const Expr* expr);
+    int append(OpCode op, int a, int b, float value);
+    static void apply(const Instruction& ins, const float* a, const float* b, float* out, size_t count);
+public:
+    /*
+        parameters are variables that keep one value for a whole run, such as the
+        animation time. They evaluate to 0 until bound.
+    */
+    explicit Program(const std::vector<const Expr*>& outputs, const std::vector<std::string>& inputs,
+                     const std::vector<std::string>& parameters = {});
+
+    // Copy with values[i] as the i-th parameter, folding what only depended on parameters
+    Program bind(const std::vector<float>& values) const;
+    bool parameterized() const;
+
+    /*
+        Evaluates count samples. inputs[i] holds count values of the i-th input
+        variable and outputs[o] receives count values of the o-th expression.
+        scratch is resized as needed so callers can reuse it across batches.
+    */
+    void run(const std::vector<const float*>& inputs, const std::vector<float*>& outputs,
+             size_t count, std::vector<float>& scratch) const;
+    size_t size() const { return code_.size(); }
+    size_t outputs() const { return outputs_.size(); }
+};
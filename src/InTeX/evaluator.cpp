@@ -27,7 +27,7 @@ float Evaluator::evaluateHelper(const Expr* expr) {
                 return evaluateHelper(op->e1_) * evaluateHelper(op->e2_);
             } else if (op->op_ == '/') {
                 float eval = evaluateHelper(op->e2_);
-                if (abs(eval) > zero) {
+                if (std::abs(eval) > zero) {
                     return evaluateHelper(op->e1_) / eval;
                 }
                 return NAN;
@@ -39,7 +39,7 @@ float Evaluator::evaluateHelper(const Expr* expr) {
         case Type::FRAC: {
             Frac* frac = (Frac*)expr;
             eval = evaluateHelper(frac->denominator_);
-            if (abs(eval) > zero) {
+            if (std::abs(eval) > zero) {
                 return evaluateHelper(frac->numerator_) / eval;
             }
             return NAN;
@@ -47,7 +47,7 @@ float Evaluator::evaluateHelper(const Expr* expr) {
         case Type::SQRT: {
             Sqrt* sqrt = (Sqrt*)expr;
             float root = evaluateHelper(sqrt->root_);
-            if (abs(root) > zero) {
+            if (std::abs(root) > zero) {
                 return pow(evaluateHelper(sqrt->e_), 1.0/evaluateHelper(sqrt->root_));
             }
             return NAN;
@@ -56,9 +56,9 @@ float Evaluator::evaluateHelper(const Expr* expr) {
             Log* log_expr = (Log*)expr;
             float base = evaluateHelper(log_expr->base_);
             eval = evaluateHelper(log_expr->e_);
-            if (abs(base) > zero) {
+            if (std::abs(base) > zero) {
                 float denom = log(base);
-                if (abs(denom) > zero && abs(eval) > zero) {
+                if (std::abs(denom) > zero && std::abs(eval) > zero) {
                     return log(eval) / denom;
                 }
             }
@@ -67,7 +67,7 @@ float Evaluator::evaluateHelper(const Expr* expr) {
         case Type::LN: {
             Ln* ln = (Ln*)expr;
             eval = evaluateHelper(ln->e_);
-            if (abs(eval) > zero) {
+            if (std::abs(eval) > zero) {
                 return log(eval);
             }
             return NAN;
@@ -75,7 +75,7 @@ float Evaluator::evaluateHelper(const Expr* expr) {
         case Type::LG: {
             Lg* lg = (Lg*)expr;
             eval = evaluateHelper(lg->e_);
-            if (abs(eval) > zero) {
+            if (std::abs(eval) > zero) {
                 return log2(evaluateHelper(lg->e_));
             }
             return NAN;
@@ -89,26 +89,26 @@ float Evaluator::evaluateHelper(const Expr* expr) {
                 return cos(evaluateHelper(trig->e_));
             } else if (func == "tan") {
                 float denom = cos(evaluateHelper(trig->e_));
-                if (abs(denom) > zero) {
+                if (std::abs(denom) > zero) {
                     return sin(evaluateHelper(trig->e_))/denom;
                 }
                 return NAN;
             } else if (func == "csc") {
                 eval = evaluateHelper(trig->e_);
-                if (abs(eval) > zero) {
+                if (std::abs(eval) > zero) {
                     return 1.0/sin(evaluateHelper(trig->e_));
                 }
                 return NAN;
             } else if (func == "sec") {
                 eval = evaluateHelper(trig->e_);
-                if (abs(eval) > zero) {
+                if (std::abs(eval) > zero) {
                     return 1.0/cos(evaluateHelper(trig->e_));
                 } else {
                     throw std::runtime_error ("evaluating error: division by 0");
                 }
             } else if (func == "cot") {
                 float denom = sin(evaluateHelper(trig->e_));
-                if (abs(denom) > zero) {
+                if (std::abs(denom) > zero) {
                     return cos(evaluateHelper(trig->e_))/denom;
                 }
                 return NAN;
@@ -120,19 +120,19 @@ float Evaluator::evaluateHelper(const Expr* expr) {
                 return atan(evaluateHelper(trig->e_));
             } else if (func == "arccsc") {
                 eval = evaluateHelper(trig->e_);
-                if (abs(eval) > zero) {
+                if (std::abs(eval) > zero) {
                      return asin(1.0/eval);
                 }
                 return NAN;
             } else if (func == "arcsec") {
                 eval = evaluateHelper(trig->e_);
-                if (abs(eval) > 0) {
+                if (std::abs(eval) > 0) {
                      return acos(1.0/eval);
                 }
                 return NAN;
             } else if (func == "arccot") {
                 eval = evaluateHelper(trig->e_);
-                if (abs(eval) > 0) {
+                if (std::abs(eval) > 0) {
                      return atan(1.0/eval);
                 }
                 return NAN;
@@ -145,13 +145,13 @@ float Evaluator::evaluateHelper(const Expr* expr) {
             }
         }
         case Type::ABS:
-            return abs(evaluateHelper(((Abs*)expr)->e_));
+            return std::abs(evaluateHelper(((Abs*)expr)->e_));
         default:
             throw std::runtime_error ("evaluating error: invalid expression");
     }
 }
 
-Evaluator* Evaluator::copy() {
+Evaluator* Evaluator::copy() const {
     return new Evaluator(ast_->copy(),{});
 }
 
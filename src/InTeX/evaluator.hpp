@@ -15,6 +15,6 @@ class Evaluator {
         ~Evaluator() {
             delete ast_;
         }
-        Evaluator* copy();
+        Evaluator* copy() const;
         float evaluate();
 };
\ No newline at end of file
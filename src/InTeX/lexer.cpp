@@ -119,12 +119,12 @@ void Lexer::lexHelper() {
                     advance();
                 }
                 if (n % 2) {
-                    if (tokens_.empty() || tokens_.back() == "{" || tokens_.back() == "(" || tokens_.back() == "[") {
+                    if (tokens_.empty() || tokens_.back() == "{" || tokens_.back() == "(" || tokens_.back() == "[" || tokens_.back() == "=" || tokens_.back() == ",") {
                         tokens_.push_back("0");
                     }
                     tokens_.push_back("-");
                 } else {
-                    if (!(tokens_.empty() || tokens_.back() == "{" || tokens_.back() == "(" || tokens_.back() == "[")) {
+                    if (!(tokens_.empty() || tokens_.back() == "{" || tokens_.back() == "(" || tokens_.back() == "[" || tokens_.back() == "=" || tokens_.back() == ",")) {
                         tokens_.push_back("+");
                     }
                 }
@@ -181,5 +181,5 @@ const std::unordered_set<std::string> Lexer::valid_cmds_ = {
 };
 
 const std::unordered_set<char> Lexer::valid_syms_ = {
-    '+', '-', '*', '/', '^', '=', '(', ')', '{', '}', '[', ']', '_'
+    '+', '-', '*', '/', '^', '=', '(', ')', '{', '}', '[', ']', '_', ','
 };
@@ -1,6 +1,7 @@
 #include "ast.hpp"
 #include "utils.hpp"
 #include "parser.hpp"
+#include <algorithm>
 #include <stdexcept>
 
 bool Parser::advance() {
@@ -444,6 +445,73 @@ Expr* Parser::parse() {
     return operand_.top();
 }
 
+// Parses each side of an equation with its own parser, i.e. f(x,y,z) = g(x,y,z)
+Equation* Parser::parseEquation() {
+    std::vector<std::string>::const_iterator eq = std::find(tokens_.cbegin(), tokens_.cend(), "=");
+    if (eq == tokens_.cend()) {
+        throw std::runtime_error("parsing error: expected = in equation");
+    }
+    if (std::find(eq + 1, tokens_.cend(), "=") != tokens_.cend()) {
+        throw std::runtime_error("parsing error: too many = in equation");
+    }
+    if (eq == tokens_.cbegin() || eq + 1 == tokens_.cend()) {
+        throw std::runtime_error("parsing error: missing side of equation");
+    }
+    Parser lhs(std::vector<std::string>(tokens_.cbegin(), eq));
+    Parser rhs(std::vector<std::string>(eq + 1, tokens_.cend()));
+    Expr* e1 = lhs.parse()->copy();
+    Expr* e2;
+    try {
+        e2 = rhs.parse()->copy();
+    } catch (...) {
+        delete e1;
+        throw;
+    }
+    return new Implicit(e1, e2);
+}
+
+// Parses a parenthesized triple (x(u,v), y(u,v), z(u,v)), each component with its own parser
+Equation* Parser::parseParametric() {
+    if (tokens_.size() < 2 || tokens_.front() != "(" || tokens_.back() != ")") {
+        throw std::runtime_error("parsing error: parametric surface must be written as (x, y, z)");
+    }
+    std::vector<std::vector<std::string>> components(1);
+    int depth = 0;
+    for (auto it = tokens_.cbegin() + 1; it != tokens_.cend() - 1; ++it) {
+        if (*it == "(" || *it == "{" || *it == "[" || *it == "left|") {
+            depth++;
+        } else if (*it == ")" || *it == "}" || *it == "]" || *it == "right|") {
+            depth--;
+        }
+        if (depth < 0) {
+            throw std::runtime_error("parsing error: parametric surface must be written as (x, y, z)");
+        }
+        if (*it == "," && depth == 0) {
+            components.emplace_back();
+        } else {
+            components.back().push_back(*it);
+        }
+    }
+    if (components.size() != 3) {
+        throw std::runtime_error("parsing error: parametric surface needs 3 components, got "
+        + std::to_string(components.size()));
+    }
+    std::vector<Expr*> exprs;
+    try {
+        for (const std::vector<std::string>& component : components) {
+            if (component.empty()) {
+                throw std::runtime_error("parsing error: missing component in parametric surface");
+            }
+            Parser parser(component);
+            exprs.push_back(parser.parse()->copy());
+        }
+    } catch (...) {
+        for (Expr* expr : exprs) delete expr;
+        throw;
+    }
+    return new Parametric(exprs[0], exprs[1], exprs[2]);
+}
+
 Parser::~Parser() {
     while (!operand_.empty()) {
         delete operand_.top();
@@ -60,4 +60,6 @@ class Parser {
         explicit Parser(const std::vector<std::string> tokens);
         ~Parser();
         Expr* parse();
+        Equation* parseEquation();
+        Equation* parseParametric();
 };
\ No newline at end of file
@@ -24,6 +24,34 @@ bool is_var(std::string str) {
     return false;
 }
 
+// True if var appears anywhere in expr
+bool has_var(const Expr* expr, const std::string& var) {
+    switch (expr->type_) {
+        case Type::NUM:
+            return false;
+        case Type::VAR:
+            return ((Var*)expr)->value_ == var;
+        case Type::OP:
+            return has_var(((Op*)expr)->e1_, var) || has_var(((Op*)expr)->e2_, var);
+        case Type::FRAC:
+            return has_var(((Frac*)expr)->numerator_, var) || has_var(((Frac*)expr)->denominator_, var);
+        case Type::SQRT:
+            return has_var(((Sqrt*)expr)->root_, var) || has_var(((Sqrt*)expr)->e_, var);
+        case Type::LOG:
+            return has_var(((Log*)expr)->base_, var) || has_var(((Log*)expr)->e_, var);
+        case Type::LN:
+            return has_var(((Ln*)expr)->e_, var);
+        case Type::LG:
+            return has_var(((Lg*)expr)->e_, var);
+        case Type::TRIG:
+            return has_var(((Trig*)expr)->e_, var);
+        case Type::ABS:
+            return has_var(((Abs*)expr)->e_, var);
+        default:
+            throw std::runtime_error ("variable search error: invalid expression type");
+    }
+}
+
 void print_ast(const Expr* expr, const std::string prefix) {
     switch (expr->type_) {
         case Type::NUM:
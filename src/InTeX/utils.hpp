@@ -6,6 +6,8 @@ bool is_float(std::string str);
 
 bool is_var(std::string str);
 
+bool has_var(const Expr* expr, const std::string& var);
+
 void print_indented(const unsigned int depth, const std::string& str);
 
 void print_ast(const Expr* expr, const std::string prefix);
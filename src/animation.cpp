@@ -0,0 +1,30 @@
+#include "animation.hpp"
+#include "trace.hpp"
+
+double AnimationClock::timeAt(long long now_us) const {
+    return playing_ ? origin_ + speed_ * (now_us - origin_us_) / 1e6 : origin_;
+}
+
+double AnimationClock::time() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return timeAt(Trace::now());
+}
+
+bool AnimationClock::playing() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return playing_;
+}
+
+double AnimationClock::speed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return speed_;
+}
+
+void AnimationClock::set(bool playing, double speed) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    long long now = Trace::now();
+    origin_ = timeAt(now);
+    origin_us_ = now;
+    playing_ = playing;
+    speed_ = speed;
+}
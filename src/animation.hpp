@@ -0,0 +1,92 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Seconds of animation time between frames at speed 1
+constexpr double FRAME_INTERVAL = 1.0 / 30.0;
+// Frames an animated equation is meshed ahead of the one on screen
+constexpr size_t FRAMES_AHEAD = 8;
+
+/*
+    Value of the animated variable t, shared by the UI thread and the frame
+    producers. While playing, t advances at speed units per second of wall
+    clock time, pausing keeps it where it is.
+*/
+class AnimationClock {
+private:
+    mutable std::mutex mutex_;
+    bool playing_ = false;
+    double speed_ = 1.0;
+    // t at origin_us_, the clock runs on from there while playing
+    double origin_ = 0.0;
+    long long origin_us_ = 0;
+
+    double timeAt(long long now_us) const;
+public:
+    double time() const;
+    bool playing() const;
+    double speed() const;
+    // Changes playback without a jump in t
+    void set(bool playing, double speed);
+};
+
+/*
+    Bounded ring of frames between the producer of one animated equation and the
+    UI thread. push blocks while the ring is full, so the producer never gets
+    more than the capacity ahead of the screen. take never blocks: it returns
+    the newest frame that is due and drops the older ones, so a consumer that
+    falls behind skips frames instead of showing them late.
+*/
+template <typename T>
+class FrameRing {
+private:
+    struct Frame {
+        double time_;
+        T value_;
+    };
+    std::mutex mutex_;
+    std::condition_variable space_;
+    std::vector<Frame> frames_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+    bool closed_ = false;
+public:
+    explicit FrameRing(size_t capacity) : frames_(capacity) {}
+
+    // Waits for a free slot, false once the ring is closed
+    bool push(double time, T value) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_.wait(lock, [this]() { return closed_ || size_ < frames_.size(); });
+        if (closed_) return false;
+        frames_[(head_ + size_) % frames_.size()] = Frame{time, std::move(value)};
+        size_++;
+        return true;
+    }
+
+    // Newest frame with a time up to time, dropped counts the older ones skipped
+    bool take(double time, T& value, size_t& dropped) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bool found = false;
+        dropped = 0;
+        while (size_ > 0 && frames_[head_].time_ <= time) {
+            if (found) dropped++;
+            value = std::move(frames_[head_].value_);
+            frames_[head_].value_ = T();
+            head_ = (head_ + 1) % frames_.size();
+            size_--;
+            found = true;
+        }
+        if (found) space_.notify_one();
+        return found;
+    }
+
+    // Wakes a blocked producer, every later push fails
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        space_.notify_all();
+    }
+};
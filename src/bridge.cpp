@@ -1,5 +1,111 @@
 #include "bridge.hpp"
 #include "geometry.hpp"
+#include "marchingcubes.hpp"
+#include "parametric.hpp"
+#include "InTeX/utils.hpp"
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <algorithm>
+#include <cstdio>
+#include <set>
+
+/*
+    Lexes and parses latex into the expressions that get meshed. Equations of the
+    form z = f(x,y) stay explicit surfaces, any other equation becomes the implicit
+    field lhs - rhs whose zero set is meshed, and a tuple (x, y, z) of expressions
+    in u and v is a parametric surface with one expression per component.
+    Any of them may use the animation time t.
+*/
+static std::vector<Expr*> parseSurface(const QString& latex, Type& type) {
+    std::vector<std::string> tokens;
+    {
+        TraceSpan span("lex");
+        Lexer lexer(latex.toStdString());
+        tokens = lexer.lex();
+    }
+    TraceSpan span("parse");
+    Parser parser(tokens);
+    if (std::find(tokens.begin(), tokens.end(), ",") != tokens.end()) {
+        std::unique_ptr<Parametric> eq((Parametric*)parser.parseParametric());
+        type = Type::PARA;
+        return {((Expr*)eq->x_)->copy(), ((Expr*)eq->y_)->copy(), ((Expr*)eq->z_)->copy()};
+    }
+    if (std::find(tokens.begin(), tokens.end(), "=") == tokens.end()) {
+        type = Type::UNDEF;
+        return {parser.parse()->copy()};
+    }
+    std::unique_ptr<Implicit> eq((Implicit*)parser.parseEquation());
+    const Expr* lhs = eq->e1_;
+    const Expr* rhs = eq->e2_;
+    if (lhs->type_ == Type::VAR && ((Var*)lhs)->value_ == "z" && !has_var(rhs, "z")) {
+        type = Type::UNDEF;
+        return {((Expr*)rhs)->copy()};
+    }
+    if (rhs->type_ == Type::VAR && ((Var*)rhs)->value_ == "z" && !has_var(lhs, "z")) {
+        type = Type::UNDEF;
+        return {((Expr*)lhs)->copy()};
+    }
+    type = Type::IMPL;
+    return {new Op('-', ((Expr*)lhs)->copy(), ((Expr*)rhs)->copy())};
+}
+
+/*
+    Compiles the parsed components into one program over the inputs of the
+    surface type. The evaluator keeps the first component, the others are only
+    needed by the program.
+*/
+static std::shared_ptr<const Program> compileSurface(std::vector<Expr*>& components, Type type) {
+    std::vector<std::string> inputs = {"x", "y"};
+    if (type == Type::IMPL) inputs = {"x", "y", "z"};
+    if (type == Type::PARA) inputs = {"u", "v"};
+    TraceSpan span("compile");
+    std::shared_ptr<const Program> program;
+    try {
+        program = std::make_shared<const Program>(std::vector<const Expr*>(components.begin(), components.end()), inputs,
+                                                  std::vector<std::string>{"t"});
+    } catch (...) {
+        for (Expr* expr : components) delete expr;
+        throw;
+    }
+    for (size_t i = 1; i < components.size(); i++) delete components[i];
+    return program;
+}
+
+/*
+    Builds the snapshot of an equation. vars holds values for variables other
+    than the surface inputs.
+*/
+static std::shared_ptr<const Surface> createSurface(const QString& latex, const QVariantMap& vars, long long revision) {
+    Type type;
+    std::vector<Expr*> components = parseSurface(latex, type);
+    std::shared_ptr<const Program> program = compileSurface(components, type);
+    std::shared_ptr<const Singularities> singularities;
+    if (type == Type::UNDEF) singularities = std::make_shared<const Singularities>(components[0], std::vector<std::string>{"t"});
+    std::unique_ptr<Evaluator> evaluator(new Evaluator(components[0], {}));
+
+    // Convert passed javascript object for variables into unordered_map<string, float>
+    for (auto it = vars.begin(); it != vars.end(); ++it) {
+        if (it.value().canConvert<float>()) {
+            evaluator->vars_[it.key().toStdString()] = it.value().toFloat();
+        }
+    }
+    return std::shared_ptr<const Surface>(new Surface{revision, type, std::move(evaluator), program,
+                                                      program->parameterized(), singularities, std::make_shared<TileCache>()});
+}
+
+// Everything of an edit that shapes its meshes, the variables in key order
+static QByteArray sourceKey(const QString& latex, const QVariantMap& vars) {
+    QByteArray key = latex.toUtf8();
+    for (auto it = vars.begin(); it != vars.end(); ++it) {
+        key += '\n' + it.key().toUtf8() + '=' + QByteArray::number(it.value().toDouble(), 'g', 17);
+    }
+    return key;
+}
+
+static QString sessionPath() {
+    return QDir::home().filePath("graphtex_session.json");
+}
 
 bool Bridge::updateEvaluator(const QString &latex, const QString &id, const QVariantMap &vars, QVariant step_q, QVariant range_q, QVariant clip_z) {
     // Normalize the ID to ensure consistent hashing
@@ -13,25 +119,16 @@ bool Bridge::updateEvaluator(const QString &latex, const QString &id, const QVar
         return false;
     }
 
-    if (evaluators_.count(norm)) {
+    if (surfaces_.count(norm)) {
+        // Edits are traced as job 0 of the equation
+        TraceJob trace(norm.toStdString(), 0);
         try {
-            Lexer lexer(latex.toStdString());
-            Parser parser(lexer.lex());
-            Expr* ast = parser.parse()->copy();
-            
-            delete evaluators_[norm]->ast_;
-            evaluators_[norm]->ast_ = ast;
-            evaluators_[norm]->vars_.clear();
-
-            // Convert passed javascript object for variables into unordered_map<string, float>
-            for (auto it = vars.begin(); it != vars.end(); ++it) {
-                if (it.value().canConvert<float>()) {
-                    evaluators_[norm]->vars_[it.key().toStdString()] = it.value().toFloat();
-                }
-            }
+            // Jobs still meshing the old snapshot keep it, and its tiles, alive until they finish
+            surfaces_[norm] = createSurface(latex, vars, ++next_revision_);
+            sources_[norm] = sourceKey(latex, vars);
 
             // Generate the mesh
-            generateMeshASync(id, range, step, clip);
+            generateMeshASync(norm, range, step, clip);
             return true;
         } catch (const std::exception& e) {
             qDebug() << "Error updating AST:" << e.what();
@@ -49,22 +146,14 @@ bool Bridge::createEvaluator(const QString &latex, const QString &id, const QVar
     int range = range_q.toInt();
     bool clip = clip_z.toBool();
 
+    TraceJob trace(norm.toStdString(), 0);
     try {
         // Create a new evaluator
-        Lexer lexer(latex.toStdString());
-        Parser parser(lexer.lex());
-        Expr* ast = parser.parse()->copy();
-        evaluators_[norm] = new Evaluator(ast, {});
-
-        // Convert passed javascript object for variables into unordered_map<string, float>
-        for (auto it = vars.begin(); it != vars.end(); ++it) {
-            if (it.value().canConvert<float>()) {
-                evaluators_[norm]->vars_[it.key().toStdString()] = it.value().toFloat();
-            }
-        }
+        surfaces_[norm] = createSurface(latex, vars, ++next_revision_);
+        sources_[norm] = sourceKey(latex, vars);
 
         // Generate the mesh
-        generateMeshASync(id, range, step, clip);
+        generateMeshASync(norm, range, step, clip);
         qDebug() << "Mesh updated for ID:" << norm;
         return true;
     } catch (const std::exception& e) {
@@ -77,17 +166,29 @@ bool Bridge::createEvaluator(const QString &latex, const QString &id, const QVar
 bool Bridge::deleteEvaluator(const QString &id) {
     // Normalize the ID to ensure consistent hashing
     QString norm = id.trimmed().normalized(QString::NormalizationForm_C);
-    if (evaluators_.count(norm)) {
-        delete evaluators_[norm];
+    if (surfaces_.count(norm)) {
+        // Running jobs hold their own reference to the snapshot
+        surfaces_.erase(norm);
+        sources_.erase(norm);
+        stopAnimation(norm);
+        mesh_handler_->remove(norm);
+        if (jobs_.count(norm) && jobs_[norm].running_) {
+            cancelJob(jobs_[norm].running_);
+        }
+        jobs_.erase(norm);
+        schedule();
         return true;
     }
     return false;
 }
 
-void Bridge::updateMesh(int range, int step, bool clip_z) {
-    for (std::pair<QString, Evaluator*> pair : evaluators_) {
+void Bridge::updateMesh(int range, int step, bool clip_z, double center_x, double center_y, bool nested, bool compact) {
+    center_x_ = center_x;
+    center_y_ = center_y;
+    nested_ = nested;
+    compact_ = compact;
+    for (const std::pair<const QString, std::shared_ptr<const Surface>>& pair : surfaces_) {
         QString id = pair.first;
-        Evaluator* evaluator = pair.second;
 
         // Update the geometry with the new range and step
         generateMeshASync(id, range, step, clip_z);
@@ -96,46 +197,624 @@ void Bridge::updateMesh(int range, int step, bool clip_z) {
 }
 
 void Bridge::generateMeshASync(const QString& id, int range, int step, bool clip_z) {
-    if (!evaluators_.count(id)) return;
-    
-    Evaluator* evaluator = evaluators_[id];
-    long long job_id = ++latest_id_;
+    if (!surfaces_.count(id)) return;
+
+    JobSlot& slot = jobs_[id];
+    // The running job's result would be replaced as soon as it arrived
+    if (slot.running_) cancelJob(slot.running_);
+    MeshRequest request{range, step, clip_z, center_x_, center_y_, nested_, compact_, decimation_, contours_, heightfield_};
+    if (clock_->playing() && surfaces_[id]->animated_) {
+        slot.has_pending_ = false;
+        slot.request_ = request;
+        startAnimation(id);
+        schedule();
+        return;
+    }
+    stopAnimation(id);
+    // Nothing to mesh when the mesh on screen is this request's, or an earlier session stored it
+    QByteArray key = cacheKey(id, request);
+    if (!key.isEmpty()) {
+        static Counter& hits = Metrics::counter("graphtex_disk_cache_requests_total", "Mesh requests looked up on disk", "result=\"hit\"");
+        static Counter& misses = Metrics::counter("graphtex_disk_cache_requests_total", "Mesh requests looked up on disk", "result=\"miss\"");
+        bool shown = key == slot.shown_key_;
+        EncodedMesh cached = shown ? EncodedMesh() : disk_cache_.load(key);
+        if (!shown) (cached.vertex_count_ > 0 ? hits : misses).add();
+        if (shown || cached.vertex_count_ > 0) {
+            slot.has_pending_ = false;
+            slot.request_ = request;
+            if (!shown) publishMesh(id, ++next_version_, std::move(cached), key);
+            schedule();
+            return;
+        }
+    }
+    if (!slot.has_pending_) slot.queued_ = ++next_queued_;
+    slot.pending_ = request;
+    slot.has_pending_ = true;
+    schedule();
+}
+
+// Empty for animated equations, their frames are not kept
+QByteArray Bridge::cacheKey(const QString& id, const MeshRequest& request) const {
+    auto source = sources_.find(id);
+    auto surface = surfaces_.find(id);
+    if (source == sources_.end() || surface == surfaces_.end() || surface->second->animated_) return QByteArray();
+    char settings[176];
+    std::snprintf(settings, sizeof(settings), "\n%d %d %d %.17g %.17g %d %d %zu %.9g %d %d", request.range_, request.step_,
+                  request.clip_, request.center_x_, request.center_y_, request.nested_, request.compact_,
+                  request.decimation_.budget_, request.decimation_.tolerance_, request.contours_, request.heightfield());
+    return source->second + settings;
+}
+
+/*
+    Starts pending jobs by priority: the focused equation first, then visible
+    equations in the order they were requested. Hidden equations keep their
+    pending request until they are shown. The focused equation never waits, its
+    job cancels the running background jobs and requeues their requests, and no
+    background job starts while it runs, so its latency does not depend on how
+    many other equations there are.
+    Explicit equations whose view was rescaled, and so miss their tile caches,
+    are meshed by one batch job when they share a request.
+*/
+void Bridge::schedule() {
+    auto focused = jobs_.find(focused_id_);
+    if (focused != jobs_.end() && focused->second.has_pending_ && focused->second.visible_ && !focused->second.running_) {
+        for (std::pair<const QString, JobSlot>& pair : jobs_) {
+            JobSlot& slot = pair.second;
+            if (pair.first == focused_id_ || !slot.running_ || slot.running_->cancelled()) continue;
+            cancelJob(slot.running_);
+        }
+        focused->second.has_pending_ = false;
+        startJob(focused_id_, focused->second.pending_);
+    }
+    if (focused != jobs_.end() && focused->second.running_) return;
 
-    auto future = QtConcurrent::run([this, evaluator, step, range, clip_z]() -> std::pair<std::vector<float>, std::vector<float>> {
+    // Pans stay on single jobs, their tiles are mostly cached
+    auto rescaled = [](const JobSlot& slot) {
+        return slot.pending_.step_ != slot.request_.step_ || slot.pending_.range_ != slot.request_.range_ ||
+               slot.pending_.nested_ != slot.request_.nested_;
+    };
+    auto batchable = [&](const QString& id, const JobSlot& slot) {
+        return surfaces_.count(id) && surfaces_[id]->type_ == Type::UNDEF && !surfaces_[id]->animated_ && rescaled(slot);
+    };
+    int running = runningJobs();
+    while (running < MAX_BACKGROUND_JOBS) {
+        auto next = jobs_.end();
+        for (auto it = jobs_.begin(); it != jobs_.end(); ++it) {
+            const JobSlot& slot = it->second;
+            if (!slot.has_pending_ || !slot.visible_ || slot.running_) continue;
+            if (next == jobs_.end() || slot.queued_ < next->second.queued_) next = it;
+        }
+        if (next == jobs_.end()) break;
+        next->second.has_pending_ = false;
+        std::vector<QString> batch = {next->first};
+        if (batchable(next->first, next->second)) {
+            for (std::pair<const QString, JobSlot>& pair : jobs_) {
+                JobSlot& slot = pair.second;
+                if (batch.size() == MAX_BATCH) break;
+                if (!slot.has_pending_ || !slot.visible_ || slot.running_ || !(slot.pending_ == next->second.pending_)) continue;
+                if (!batchable(pair.first, slot)) continue;
+                slot.has_pending_ = false;
+                batch.push_back(pair.first);
+            }
+        }
+        if (batch.size() > 1) {
+            startBatch(batch, next->second.pending_);
+        } else {
+            startJob(next->first, next->second.pending_);
+        }
+        running++;
+    }
+
+    static Gauge& pending = Metrics::gauge("graphtex_jobs_pending", "Mesh requests waiting for a job");
+    static Gauge& active = Metrics::gauge("graphtex_jobs_running", "Mesh jobs running, including cancelled ones");
+    int waiting = 0;
+    for (const std::pair<const QString, JobSlot>& pair : jobs_) {
+        if (pair.second.has_pending_) waiting++;
+    }
+    pending.set(waiting);
+    active.set(runningJobs());
+}
+
+// A batch job counts once, however many equations it meshes
+int Bridge::runningJobs() const {
+    std::set<const CancelToken*> tokens;
+    for (const std::pair<const QString, JobSlot>& pair : jobs_) {
+        if (pair.second.running_) tokens.insert(pair.second.running_.get());
+    }
+    return static_cast<int>(tokens.size());
+}
+
+/*
+    Cancels a running job and requeues the request of every equation it was
+    meshing, unless a newer request is already pending for it.
+*/
+void Bridge::cancelJob(const std::shared_ptr<CancelToken>& token) {
+    // The slots holding token may be the caller's
+    std::shared_ptr<CancelToken> cancelled = token;
+    cancelled->cancel();
+    for (std::pair<const QString, JobSlot>& pair : jobs_) {
+        JobSlot& slot = pair.second;
+        if (slot.running_ != cancelled || slot.has_pending_) continue;
+        slot.pending_ = slot.request_;
+        slot.has_pending_ = true;
+        slot.queued_ = ++next_queued_;
+    }
+}
+
+void Bridge::startJob(const QString& id, const MeshRequest& request) {
+    // Pins the snapshot for the whole job
+    std::shared_ptr<const Surface> surface = surfaces_[id];
+    std::shared_ptr<CancelToken> token = std::make_shared<CancelToken>();
+    jobs_[id].running_ = token;
+    jobs_[id].request_ = request;
+    long long version = ++next_version_;
+
+    long long queued = Trace::now();
+    double time = clock_->time();
+    auto future = QtConcurrent::run([surface, request, token, id, version, queued, time]() -> EncodedMesh {
+        TraceJob trace(id.toStdString(), version);
+        long long started = Trace::now();
+        Metrics::stage("wait").record(started - queued);
+        if (Trace::enabled()) {
+            Trace::record(TraceEvent{"wait", id.toStdString(), version, queued, started - queued, 0});
+        }
+        TraceSpan span("mesh");
         try {
-            Geometry geometry(evaluator, step, range, clip_z);
-            return std::make_pair(geometry.vertices_, geometry.normals_);
+            Mesh mesh = buildMesh(*surface, request, time, token.get());
+            if (mesh.empty() || token->cancelled()) return EncodedMesh();
+            TraceSpan encode("encode");
+            return encodeMesh(std::move(mesh), request.compact_);
+        } catch (const MeshCancelled&) {
+            return EncodedMesh();
         } catch (const std::exception& e) {
             qDebug() << "Error generating mesh: " << e.what();
-            return std::make_pair(std::vector<float>(), std::vector<float>());
+            return EncodedMesh();
         }
     });
 
-    auto watcher = new QFutureWatcher<std::pair<std::vector<float>, std::vector<float>>>(this);
-    connect(watcher, &QFutureWatcher<std::pair<std::vector<float>, std::vector<float>>>::finished, 
-            [this, job_id, watcher, id]() {
-        auto result = watcher->result();
-        if (result.first.empty() && result.second.empty()) return;
+    auto watcher = new QFutureWatcher<EncodedMesh>(this);
+    connect(watcher, &QFutureWatcher<EncodedMesh>::finished, 
+            [this, watcher, id, token, version, revision = surface->revision_]() {
+        finishJob(id, token, version, revision, watcher->future().takeResult());
+        watcher->deleteLater();
+    });
+    
+    watcher->setFuture(future);
+}
+
+/*
+    Meshes explicit equations that share a request in one job. Their trees are
+    compiled into one program, so common subexpressions are evaluated once per
+    sample, and one pass over the grid fills the heights of every equation
+    before each is triangulated and encoded on its own. The pass samples the
+    whole grid, the tile caches are neither read nor filled.
+*/
+void Bridge::startBatch(const std::vector<QString>& ids, const MeshRequest& request) {
+    // Pins the snapshots for the whole job
+    std::vector<std::shared_ptr<const Surface>> surfaces;
+    std::vector<long long> versions, revisions;
+    std::shared_ptr<CancelToken> token = std::make_shared<CancelToken>();
+    for (const QString& id : ids) {
+        surfaces.push_back(surfaces_[id]);
+        revisions.push_back(surfaces_[id]->revision_);
+        versions.push_back(++next_version_);
+        jobs_[id].running_ = token;
+        jobs_[id].request_ = request;
+    }
 
-        QByteArray raw_vertices(reinterpret_cast<const char*>(result.first.data()), result.first.size() * sizeof(float));
-        QString vertices_base64 = QString::fromLatin1(raw_vertices.toBase64());
+    long long queued = Trace::now();
+    auto future = QtConcurrent::run([surfaces, ids, versions, request, token, queued]() -> std::vector<EncodedMesh> {
+        std::vector<EncodedMesh> results(ids.size());
+        long long started = Trace::now();
+        Metrics::stage("wait").record(started - queued);
+        try {
+            std::vector<std::vector<float>> heights;
+            {
+                // Traced as a stage of every equation in the batch
+                TraceJob trace(ids[0].toStdString(), versions[0]);
+                std::vector<const Expr*> outputs;
+                for (const std::shared_ptr<const Surface>& surface : surfaces) outputs.push_back(surface->evaluator_->ast_);
+                Program program(outputs, {"x", "y"});
+                heights = Geometry::sampleBatch(&program, request.step_, request.range_, request.center_x_, request.center_y_,
+                                                request.nested_, token.get());
+            }
+            if (Trace::enabled()) {
+                long long sampled = Trace::now();
+                for (size_t i = 0; i < ids.size(); i++) {
+                    Trace::record(TraceEvent{"wait", ids[i].toStdString(), versions[i], queued, started - queued, 0});
+                    if (i == 0) continue;
+                    Trace::record(TraceEvent{"sampleBatch", ids[i].toStdString(), versions[i], started, sampled - started, 0});
+                }
+            }
+            for (size_t i = 0; i < ids.size(); i++) {
+                TraceJob trace(ids[i].toStdString(), versions[i]);
+                TraceSpan span("mesh");
+                Geometry geometry(heights[i], request.step_, request.range_, request.center_x_, request.center_y_, request.clip_,
+                                  request.nested_, token.get(), !request.compact_, request.contours_, true,
+                                  request.heightfield(), surfaces[i]->singularities_.get());
+                BufferPool::recycle(heights[i]);
+                Mesh mesh = decimate(std::move(geometry.mesh_), request.decimation_, token.get());
+                if (mesh.empty() || token->cancelled()) continue;
+                TraceSpan encode("encode");
+                results[i] = encodeMesh(std::move(mesh), request.compact_);
+            }
+        } catch (const MeshCancelled&) {
+        } catch (const std::exception& e) {
+            qDebug() << "Error generating mesh: " << e.what();
+        }
+        return results;
+    });
 
-        QByteArray raw_normals(reinterpret_cast<const char*>(result.second.data()), result.second.size() * sizeof(float));
-        QString normals_base64 = QString::fromLatin1(raw_normals.toBase64());
-        
-        qDebug() << "Mesh updated for ID:" << id;
-        // Ensure older threads that finish later than newer ones don't overwrite new data
-        if (job_id >= latest_completed_id_) {
-            latest_completed_id_ = job_id;
-            emit meshUpdated(id, vertices_base64, normals_base64);
+    auto watcher = new QFutureWatcher<std::vector<EncodedMesh>>(this);
+    connect(watcher, &QFutureWatcher<std::vector<EncodedMesh>>::finished,
+            [this, watcher, ids, token, versions, revisions]() {
+        std::vector<EncodedMesh> results = watcher->future().takeResult();
+        for (size_t i = 0; i < ids.size(); i++) {
+            finishJob(ids[i], token, versions[i], revisions[i], std::move(results[i]));
         }
-        
         watcher->deleteLater();
     });
-    
+
     watcher->setFuture(future);
 }
 
+/*
+    Meshes a snapshot for a request. Animated equations are meshed from their
+    program bound to time, explicit ones through sampleBatch as their evaluator
+    has no t, and without tiles since every frame samples a new surface.
+*/
+Mesh Bridge::buildMesh(const Surface& surface, const MeshRequest& request, double time, const CancelToken* cancel) {
+    // Raw meshes are built in the renderer's interleaved vertex layout, compact ones get encoded anyway
+    bool interleaved = !request.compact_;
+    const Program* program = surface.program_.get();
+    std::unique_ptr<const Program> frame;
+    if (surface.animated_) {
+        frame.reset(new Program(program->bind({static_cast<float>(time)})));
+        program = frame.get();
+    }
+    Mesh mesh;
+    if (surface.type_ == Type::IMPL) {
+        MarchingCubes cubes(program, request.step_, request.range_, request.center_x_, request.center_y_, cancel, interleaved);
+        mesh = std::move(cubes.mesh_);
+    } else if (surface.type_ == Type::PARA) {
+        ParametricSurface parametric(program, request.step_, request.range_, request.center_x_, request.center_y_, cancel, interleaved);
+        mesh = std::move(parametric.mesh_);
+    } else if (surface.animated_) {
+        std::vector<std::vector<float>> heights = Geometry::sampleBatch(program, request.step_, request.range_, request.center_x_,
+                                                                        request.center_y_, request.nested_, cancel);
+        Singularities singularities = surface.singularities_->bind({static_cast<float>(time)});
+        Geometry geometry(heights[0], request.step_, request.range_, request.center_x_, request.center_y_, request.clip_,
+                          request.nested_, cancel, interleaved, request.contours_, false, request.heightfield(),
+                          &singularities);
+        BufferPool::recycle(heights[0]);
+        mesh = std::move(geometry.mesh_);
+    } else {
+        Geometry geometry(surface.evaluator_.get(), surface.cache_.get(), request.step_, request.range_, request.center_x_,
+                          request.center_y_, request.clip_, request.nested_, cancel, interleaved, request.contours_, true,
+                          request.heightfield(), surface.singularities_.get());
+        mesh = std::move(geometry.mesh_);
+    }
+    return decimate(std::move(mesh), request.decimation_, cancel);
+}
+
+void Bridge::finishJob(const QString& id, const std::shared_ptr<CancelToken>& token, long long version, long long revision,
+                       EncodedMesh result) {
+    auto it = jobs_.find(id);
+    // The equation was deleted, or deleted and created again, while the job ran
+    if (it == jobs_.end() || it->second.running_ != token) return;
+    JobSlot& slot = it->second;
+    slot.running_.reset();
+
+    static Counter& cancelled = Metrics::counter("graphtex_jobs_total", "Mesh jobs finished", "result=\"cancelled\"");
+    static Counter& stale = Metrics::counter("graphtex_jobs_total", "Mesh jobs finished", "result=\"stale\"");
+    static Counter& empty = Metrics::counter("graphtex_jobs_total", "Mesh jobs finished", "result=\"empty\"");
+    static Counter& shown = Metrics::counter("graphtex_jobs_total", "Mesh jobs finished", "result=\"shown\"");
+
+    // Meshes of an expression that has since been edited are never shown
+    bool current = surfaces_.count(id) && surfaces_[id]->revision_ == revision;
+    if (token->cancelled()) {
+        cancelled.add();
+    } else if (!current || version <= slot.shown_version_) {
+        stale.add();
+    } else if (result.vertex_count_ == 0) {
+        empty.add();
+    }
+    if (current && !token->cancelled() && result.vertex_count_ > 0 && version > slot.shown_version_) {
+        shown.add();
+        publishMesh(id, version, std::move(result), cacheKey(id, slot.request_));
+        qDebug() << "Mesh updated for ID:" << id;
+    }
+    schedule();
+}
+
+// Hands a mesh newer than the one shown to the renderer
+void Bridge::publishMesh(const QString& id, long long version, EncodedMesh result, const QByteArray& key) {
+    static Histogram& bytes = Metrics::histogram("graphtex_mesh_update_bytes", "Vertex bytes the renderer fetches per meshUpdated");
+    jobs_[id].shown_version_ = version;
+    jobs_[id].shown_key_ = key;
+    jobs_[id].field_ = result.field_;
+    TraceJob trace(id.toStdString(), version);
+    std::vector<VertexRange> patches;
+    long long base_version;
+    int vertex_count = result.vertex_count_, index_count = result.index_count_;
+    bool compact = result.compact_, interleaved = result.interleaved_, heightfield = result.heightfield_;
+    int contour_lines = result.contour_lines_;
+    size_t full_bytes = result.bytes();
+    {
+        TraceSpan span("publish");
+        base_version = mesh_handler_->publish(id, version, std::move(result), patches);
+    }
+    QVariantList ranges;
+    uint64_t patched = 0;
+    for (const VertexRange& range : patches) {
+        ranges.append(QVariant(QVariantList{range.first_, range.count_}));
+        patched += range.count_;
+    }
+    // A patch only fetches the changed ranges, 6 floats per vertex
+    bytes.record(base_version ? patched * 6 * sizeof(float) : full_bytes);
+    if (Trace::enabled()) emitTrace(id, version);
+    emit meshUpdated(id, version, vertex_count, index_count, compact, interleaved, heightfield, base_version, ranges,
+                     contour_lines);
+}
+
+void Bridge::updatePriority(const QString &id, bool focused, bool visible) {
+    QString norm = id.trimmed().normalized(QString::NormalizationForm_C);
+    if (focused) {
+        focused_id_ = norm;
+    } else if (focused_id_ == norm) {
+        focused_id_.clear();
+    }
+    if (surfaces_.count(norm)) {
+        JobSlot& slot = jobs_[norm];
+        slot.visible_ = visible;
+        if (clock_->playing() && surfaces_[norm]->animated_) {
+            if (!visible) {
+                stopAnimation(norm);
+            } else if (!animations_.count(norm)) {
+                startAnimation(norm);
+            }
+        }
+        // Mesh it again once shown, nobody sees the result meanwhile
+        if (!visible && slot.running_ && !slot.running_->cancelled()) {
+            cancelJob(slot.running_);
+        }
+    }
+    schedule();
+}
+
+void Bridge::setAnimation(bool playing, double speed) {
+    clock_->set(playing, std::max(0.0, speed));
+    for (const std::pair<const QString, std::shared_ptr<const Surface>>& pair : surfaces_) {
+        if (!pair.second->animated_) continue;
+        if (playing) {
+            // Running producers pick up the new speed with their next frame
+            if (!animations_.count(pair.first)) startAnimation(pair.first);
+        } else {
+            stopAnimation(pair.first);
+            const MeshRequest& request = jobs_[pair.first].request_;
+            if (request.step_ > 0) generateMeshASync(pair.first, request.range_, request.step_, request.clip_);
+        }
+    }
+    if (playing) {
+        frame_timer_->start(DISPLAY_INTERVAL_MS);
+    } else {
+        frame_timer_->stop();
+    }
+    emit animationTime(clock_->time());
+}
+
+void Bridge::setDecimation(int budget, double tolerance) {
+    decimation_ = Decimation{static_cast<size_t>(std::max(0, budget)), static_cast<float>(std::max(0.0, tolerance))};
+    remeshAll();
+}
+
+QVariantMap Bridge::pick(const QVariantList &origin, const QVariantList &direction) {
+    TraceSpan span("pick");
+    if (origin.size() != 3 || direction.size() != 3) return QVariantMap();
+    float o[3], d[3];
+    for (int k = 0; k < 3; k++) {
+        o[k] = origin[k].toFloat();
+        d[k] = direction[k].toFloat();
+    }
+    QString nearest;
+    Pick best{};
+    best.t_ = INFINITY;
+    for (const std::pair<const QString, std::shared_ptr<const Surface>>& pair : surfaces_) {
+        const Surface& surface = *pair.second;
+        auto job = jobs_.find(pair.first);
+        if (surface.type_ != Type::UNDEF || job == jobs_.end() || !job->second.visible_ || !job->second.shown_version_) continue;
+        const JobSlot& slot = job->second;
+        PickView view{static_cast<double>(slot.request_.range_), slot.request_.center_x_, slot.request_.center_y_,
+                      slot.request_.clip_};
+        const Program* program = surface.program_.get();
+        std::unique_ptr<const Program> frame;
+        if (surface.animated_) {
+            frame.reset(new Program(program->bind({static_cast<float>(clock_->time())})));
+            program = frame.get();
+        }
+        Pick hit;
+        if (pickSurface(*program, slot.field_.get(), view, o, d, hit) && hit.t_ < best.t_) {
+            best = hit;
+            nearest = pair.first;
+        }
+    }
+    if (nearest.isEmpty()) return QVariantMap();
+    return QVariantMap{{"id", nearest}, {"x", best.x_}, {"y", best.y_}, {"z", best.z_},
+                       {"dzdx", best.dzdx_}, {"dzdy", best.dzdy_}};
+}
+
+void Bridge::setContours(int levels) {
+    contours_ = std::max(0, levels);
+    remeshAll();
+}
+
+void Bridge::setHeightfield(bool enabled) {
+    heightfield_ = enabled;
+    remeshAll();
+}
+
+void Bridge::remeshAll() {
+    for (std::pair<const QString, JobSlot>& pair : jobs_) {
+        MeshRequest request = pair.second.has_pending_ ? pair.second.pending_ : pair.second.request_;
+        if (request.step_ > 0) generateMeshASync(pair.first, request.range_, request.step_, request.clip_);
+    }
+}
+
+/*
+    Meshes frames of an animated equation ahead of the clock, with the request
+    of its last job. Each frame is meant for one interval after the previous
+    one, or, once the producer has fallen behind, for where the clock will be
+    when it is done, so frames that could only be shown late are never meshed.
+*/
+void Bridge::startAnimation(const QString& id) {
+    stopAnimation(id);
+    const JobSlot& slot = jobs_[id];
+    if (!slot.visible_ || slot.request_.step_ == 0) return;
+    Animation& animation = animations_[id];
+    animation.producer_ = std::make_shared<CancelToken>();
+    animation.frames_ = std::make_shared<FrameRing<EncodedMesh>>(FRAMES_AHEAD);
+    // One thread per producer, stopped ones may still be finishing their frame
+    animation_pool_.setMaxThreadCount(std::max(animation_pool_.maxThreadCount(), animation_pool_.activeThreadCount() + 1));
+    animation.future_ = QtConcurrent::run(&animation_pool_, [surface = surfaces_[id], request = slot.request_, clock = clock_,
+                                           token = animation.producer_, frames = animation.frames_]() {
+        double time = clock->time();
+        while (!token->cancelled()) {
+            long long started = Trace::now();
+            EncodedMesh frame;
+            try {
+                TraceSpan span("frame");
+                Mesh mesh = buildMesh(*surface, request, time, token.get());
+                if (!mesh.empty()) frame = encodeMesh(std::move(mesh), request.compact_);
+            } catch (const MeshCancelled&) {
+                return;
+            } catch (const std::exception& e) {
+                qDebug() << "Error generating frame: " << e.what();
+                return;
+            }
+            // Blocks while FRAMES_AHEAD frames wait to be shown
+            if (!frames->push(time, std::move(frame))) return;
+            double speed = clock->speed();
+            time = std::max(time + speed * FRAME_INTERVAL, clock->time() + speed * (Trace::now() - started) / 1e6);
+        }
+    });
+}
+
+void Bridge::stopAnimation(const QString& id) {
+    auto it = animations_.find(id);
+    if (it == animations_.end()) return;
+    // The producer stops within a row of its current frame
+    it->second.producer_->cancel();
+    it->second.frames_->close();
+    animations_.erase(it);
+}
+
+// Shows the newest due frame of every animation, frames that were not shown in time are dropped
+void Bridge::presentFrames() {
+    static Counter& shown = Metrics::counter("graphtex_animation_frames_total", "Animation frames meshed", "result=\"shown\"");
+    static Counter& dropped = Metrics::counter("graphtex_animation_frames_total", "Animation frames meshed", "result=\"dropped\"");
+    double time = clock_->time();
+    for (std::pair<const QString, Animation>& pair : animations_) {
+        EncodedMesh frame;
+        size_t skipped;
+        if (!pair.second.frames_->take(time, frame, skipped)) continue;
+        dropped.add(skipped);
+        if (frame.vertex_count_ == 0) continue;
+        shown.add();
+        publishMesh(pair.first, ++next_version_, std::move(frame));
+    }
+    emit animationTime(time);
+}
+
+Bridge::~Bridge() {
+    // A producer blocked on a full ring would keep animation_pool_ from finishing
+    for (std::pair<const QString, Animation>& pair : animations_) {
+        pair.second.producer_->cancel();
+        pair.second.frames_->close();
+    }
+    for (std::pair<const QString, Animation>& pair : animations_) pair.second.future_.waitForFinished();
+}
+
+/*
+    Sends the stages of a job to the overlay, starting with the last edit of
+    the equation if it was made after the previous job.
+*/
+void Bridge::emitTrace(const QString& id, long long job) {
+    std::vector<TraceEvent> stages = Trace::find(id.toStdString(), job);
+    if (stages.empty()) return;
+    long long origin = stages.front().start_us_;
+    for (const TraceEvent& event : stages) origin = std::min(origin, event.start_us_);
+
+    std::vector<TraceEvent> edit = Trace::find(id.toStdString(), 0);
+    auto lex = std::find_if(edit.rbegin(), edit.rend(), [](const TraceEvent& event) { return event.name_ == "lex"; });
+    if (lex != edit.rend() && lex->start_us_ >= traced_until_[id]) {
+        stages.insert(stages.begin(), lex.base() - 1, edit.end());
+        origin = std::min(origin, lex->start_us_);
+    }
+    traced_until_[id] = Trace::now();
+
+    QVariantList list;
+    for (const TraceEvent& event : stages) {
+        list.append(QVariant(QVariantList{QString::fromStdString(event.name_), (event.start_us_ - origin) / 1000.0,
+                                          event.duration_us_ / 1000.0}));
+    }
+    emit jobTraced(id, job, list);
+}
+
+bool Bridge::saveSession(const QString &json) {
+    QSaveFile file(sessionPath());
+    if (!file.open(QIODevice::WriteOnly)) return false;
+    file.write(json.toUtf8());
+    return file.commit();
+}
+
+QString Bridge::loadSession() {
+    QFile file(sessionPath());
+    if (!file.open(QIODevice::ReadOnly)) return QString();
+    return QString::fromUtf8(file.readAll());
+}
+
+/*
+    Entries are only written here, so the cache holds exactly the meshes of the
+    last session. Meshes that came from the cache are already stored.
+*/
+void Bridge::storeMeshes() {
+    std::vector<QByteArray> keys;
+    for (const std::pair<const QString, JobSlot>& pair : jobs_) {
+        const QByteArray& key = pair.second.shown_key_;
+        const EncodedMesh* mesh = mesh_handler_->mesh(pair.first);
+        if (key.isEmpty() || !mesh) continue;
+        if (!disk_cache_.store(key, *mesh) && disk_cache_.load(key).vertex_count_ == 0) continue;
+        keys.push_back(key);
+    }
+    disk_cache_.retain(keys);
+}
+
+void Bridge::setTracing(bool enabled) {
+    Trace::setEnabled(enabled);
+}
+
+QString Bridge::saveTrace() {
+    QString path = QDir::home().filePath("graphtex_trace.json");
+    return Trace::save(path.toStdString()) ? path : QString();
+}
+
+/*
+    The renderer measures with its own clock, so its spans are placed relative
+    to the moment they arrive. That shifts them by the WebChannel latency.
+*/
+void Bridge::recordSpans(const QString &id, long long job, const QVariantList &spans) {
+    if (!Trace::enabled()) return;
+    QString norm = id.trimmed().normalized(QString::NormalizationForm_C);
+    long long now = Trace::now();
+    for (const QVariant& value : spans) {
+        QVariantList span = value.toList();
+        if (span.size() != 3) continue;
+        long long start = now - static_cast<long long>(span[1].toDouble() * 1000.0);
+        Trace::record(TraceEvent{span[0].toString().toStdString(), norm.toStdString(), job, start,
+                                 static_cast<long long>(span[2].toDouble() * 1000.0), 0});
+    }
+}
+
 void Bridge::print(const QString& str) {
     qDebug() << str;
 }
\ No newline at end of file
@@ -5,34 +5,212 @@
 #include <QVariantList>
 #include <cstdint>
 #include <unordered_map>
+#include <memory>
 #include "InTeX/ast.hpp"
 #include "InTeX/lexer.hpp"
 #include "InTeX/parser.hpp"
 #include "InTeX/evaluator.hpp"
+#include "InTeX/compiler.hpp"
+#include "tilecache.hpp"
+#include "surface.hpp"
+#include "cancel.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include "mesh.hpp"
+#include "meshcodec.hpp"
+#include "meshscheme.hpp"
+#include "animation.hpp"
+#include "meshcache.hpp"
+#include "decimate.hpp"
 #include <cmath>
+#include <QDir>
+#include <QTimer>
 #include <QFutureWatcher>
 #include <QtConcurrent/QtConcurrentRun>
+#include <QThreadPool>
 #include <QFuture>
 
 class Bridge : public QObject
 {
     Q_OBJECT
 public:
-    explicit Bridge(QObject *parent = nullptr) : QObject(parent) {}
+    explicit Bridge(QObject *parent = nullptr)
+        : QObject(parent), mesh_handler_(new MeshSchemeHandler(this)), disk_cache_(QDir::home().filePath("graphtex_cache")),
+          frame_timer_(new QTimer(this)) {
+        connect(frame_timer_, &QTimer::timeout, this, &Bridge::presentFrames);
+    }
+    ~Bridge() override;
+    // Install on the page's profile so the renderer can fetch published meshes
+    MeshSchemeHandler* meshHandler() { return mesh_handler_; }
+    // Writes the meshes on screen to the disk cache and drops every other entry, once the window is closed
+    void storeMeshes();
 
 public slots:
     bool updateEvaluator(const QString &latex, const QString &id, const QVariantMap &vars, QVariant step_q, QVariant range_q, QVariant clip_z);
     bool createEvaluator(const QString &latex, const QString &id, const QVariantMap &vars, QVariant step_q, QVariant range_q, QVariant clip_z);
     bool deleteEvaluator(const QString &id);
-    void updateMesh(int range, int step, bool clip_z);
+    void updateMesh(int range, int step, bool clip_z, double center_x, double center_y, bool nested, bool compact);
+    // Scheduling hints from the equation list, hidden equations are only meshed once shown again
+    void updatePriority(const QString &id, bool focused, bool visible);
+    // Plays or pauses the animation time t, speed is t per second
+    void setAnimation(bool playing, double speed);
+    // Decimates meshes to at most budget triangles, moving the surface by at most tolerance, 0 turns either off
+    void setDecimation(int budget, double tolerance);
+    // Traces levels contour lines over explicit surfaces, 0 turns them off
+    void setContours(int levels);
+    // Sends explicit surfaces as their sampled heights for the renderer to triangulate, see encodeHeightfield
+    void setHeightfield(bool enabled);
+    /*
+        Nearest point of a visible explicit equation under the ray origin + t
+        direction, both in the renderer's mesh coordinates, as id, x, y, z and
+        the derivatives dzdx and dzdy. Empty when the ray misses every surface.
+        Walks the grid of the mesh on screen, cheap enough for every pointer move.
+    */
+    QVariantMap pick(const QVariantList &origin, const QVariantList &direction);
+    // Equations and settings of the page as JSON, kept in graphtex_session.json in the home folder
+    bool saveSession(const QString &json);
+    // The saved session, an empty string if there is none
+    QString loadSession();
+    void setTracing(bool enabled);
+    // Writes every recorded span as a Chrome trace, returns the file path or an empty string on failure
+    QString saveTrace();
+    // Renderer stages of a job, each [name, milliseconds since it started, duration in milliseconds]
+    void recordSpans(const QString &id, long long job, const QVariantList &spans);
     void print(const QString &str);
 
 signals:
-    void meshUpdated(const QString &id, QString vertices_base64, QString normals_base64);
+    /*
+        The mesh itself is fetched from mesh:<id>/<version>, index_count is 0 for raw
+        triangle soups. Raw meshes that are interleaved hold position and normal of
+        each vertex together, see Mesh::interleaved_. A nonzero base_version means
+        the body only holds the vertex ranges [first, count] in patches, to be
+        applied on top of that version. Contour lines, when contour_lines is
+        nonzero, are fetched from mesh:<id>/<version>/contours. Heightfield meshes
+        are laid out by encodeHeightfield, with half float heights when compact.
+    */
+    void meshUpdated(const QString &id, long long version, int vertex_count, int index_count, bool compact,
+                     bool interleaved, bool heightfield, long long base_version, const QVariantList &patches,
+                     int contour_lines);
+    // While tracing, the stages of a finished job before its meshUpdated, each [name, start, duration] in milliseconds
+    void jobTraced(const QString &id, long long job, const QVariantList &stages);
+    // Value of t on screen, at display rate while playing
+    void animationTime(double time);
 
 private:
-    std::unordered_map<QString, Evaluator*> evaluators_;
-    void generateMeshASync(const QString& id, int step, int range, bool clip_z);
-    std::atomic<long long> latest_id_ = 0;
-    std::atomic<long long> latest_completed_id_ = 0;
+    /*
+        Latest snapshot of each equation. Only the UI thread reads or replaces
+        these, jobs get their own reference when they are started, so publishing
+        an edit is a pointer swap and the workers take no locks.
+    */
+    std::unordered_map<QString, std::shared_ptr<const Surface>> surfaces_;
+    long long next_revision_ = 0;
+    MeshSchemeHandler* mesh_handler_;
+    // Latex and variables of each equation, the start of its disk cache keys
+    std::unordered_map<QString, QByteArray> sources_;
+    MeshCache disk_cache_;
+    // Centre of the view window shared by all equations
+    double center_x_ = 0.0;
+    double center_y_ = 0.0;
+    // Sample on 2^k + 1 nested grids anchored to the view window
+    bool nested_ = false;
+    // Send quantized meshes, see encodeCompact
+    bool compact_ = false;
+    // Triangle budget and tolerance of the meshes, off by default
+    Decimation decimation_;
+    // Contour levels of explicit surfaces, off by default
+    int contours_ = 0;
+    // Send explicit surfaces as heightfields, see encodeHeightfield
+    bool heightfield_ = false;
+
+    // Mesh settings captured when a mesh is requested
+    struct MeshRequest {
+        int range_;
+        int step_;
+        bool clip_;
+        double center_x_;
+        double center_y_;
+        bool nested_;
+        bool compact_;
+        Decimation decimation_;
+        int contours_;
+        bool heightfield_;
+
+        // Decimated meshes need their triangles, so they never go out as heightfields
+        bool heightfield() const { return heightfield_ && !decimation_.enabled(); }
+
+        bool operator==(const MeshRequest& other) const {
+            return range_ == other.range_ && step_ == other.step_ && clip_ == other.clip_ && center_x_ == other.center_x_ &&
+                   center_y_ == other.center_y_ && nested_ == other.nested_ && compact_ == other.compact_ &&
+                   decimation_.budget_ == other.decimation_.budget_ && decimation_.tolerance_ == other.decimation_.tolerance_ &&
+                   contours_ == other.contours_ && heightfield_ == other.heightfield_;
+        }
+    };
+    /*
+        At most one running and one pending job per equation. A new request cancels
+        the running job and replaces the pending one, so only the latest request
+        is ever meshed to completion.
+    */
+    struct JobSlot {
+        // Shared by every equation of a batch job
+        std::shared_ptr<CancelToken> running_;
+        // Request the running job was started with, requeued if it is preempted
+        MeshRequest request_{};
+        bool has_pending_ = false;
+        MeshRequest pending_;
+        // Order in which pending requests arrived, equal priorities run oldest first
+        long long queued_ = 0;
+        bool visible_ = true;
+        // Version of the last mesh published for this equation
+        long long shown_version_ = 0;
+        // Disk cache key of that mesh, empty for animation frames
+        QByteArray shown_key_;
+        // Grid of that mesh for pick, null for animation frames and meshes from the disk cache
+        std::shared_ptr<const HeightField> field_;
+    };
+    std::unordered_map<QString, JobSlot> jobs_;
+    long long next_version_ = 0;
+    long long next_queued_ = 0;
+    // Equation being edited, its jobs start immediately and preempt all others
+    QString focused_id_;
+    // Jobs of the other equations running at once, each job already uses every core
+    static constexpr int MAX_BACKGROUND_JOBS = 2;
+    // Explicit equations sampled by one batch job, see startBatch
+    static constexpr size_t MAX_BATCH = 16;
+    void generateMeshASync(const QString& id, int range, int step, bool clip_z);
+    // Requests every equation again with the current settings
+    void remeshAll();
+    QByteArray cacheKey(const QString& id, const MeshRequest& request) const;
+    void schedule();
+    int runningJobs() const;
+    void cancelJob(const std::shared_ptr<CancelToken>& token);
+    void startJob(const QString& id, const MeshRequest& request);
+    void startBatch(const std::vector<QString>& ids, const MeshRequest& request);
+    static Mesh buildMesh(const Surface& surface, const MeshRequest& request, double time, const CancelToken* cancel);
+
+    // Shared with the frame producers, which finish after their animation is stopped
+    std::shared_ptr<AnimationClock> clock_ = std::make_shared<AnimationClock>();
+    /*
+        Frames of an animated equation while playing. They replace its mesh
+        jobs until the animation is paused, then one job meshes the paused t.
+    */
+    struct Animation {
+        std::shared_ptr<CancelToken> producer_;
+        std::shared_ptr<FrameRing<EncodedMesh>> frames_;
+        QFuture<void> future_;
+    };
+    std::unordered_map<QString, Animation> animations_;
+    // Producers hold a thread while they play, so they get their own and never starve mesh jobs
+    QThreadPool animation_pool_;
+    // Shows the frames that are due while playing
+    QTimer* frame_timer_;
+    static constexpr int DISPLAY_INTERVAL_MS = 16;
+    void startAnimation(const QString& id);
+    void stopAnimation(const QString& id);
+    void presentFrames();
+    // End of the last traced job per equation, earlier edits belong to earlier jobs
+    std::unordered_map<QString, long long> traced_until_;
+    void emitTrace(const QString& id, long long job);
+    void finishJob(const QString& id, const std::shared_ptr<CancelToken>& token, long long version, long long revision,
+                   EncodedMesh result);
+    void publishMesh(const QString& id, long long version, EncodedMesh result, const QByteArray& key = QByteArray());
 };
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include "bufferpool.hpp"
+#include "metrics.hpp"
+#include <map>
+#include <mutex>
+
+namespace {
+
+// Smallest power of two that holds size elements
+int sizeClass(size_t size) {
+    int c = 0;
+    while ((size_t(1) << c) < size) c++;
+    return c;
+}
+
+template <class T>
+struct Pool {
+    std::mutex mutex_;
+    // Free buffers by size class
+    std::map<int, std::vector<std::vector<T>>> free_;
+};
+
+Pool<float> floats;
+Pool<uint32_t> indices;
+std::mutex bytes_mutex;
+long long pooled_bytes = 0;
+
+Gauge& pooledGauge() {
+    static Gauge& gauge = Metrics::gauge("graphtex_buffer_pool_bytes", "Bytes held by free pooled buffers");
+    return gauge;
+}
+
+void account(long long bytes) {
+    std::lock_guard<std::mutex> lock(bytes_mutex);
+    pooled_bytes += bytes;
+    pooledGauge().set(pooled_bytes);
+}
+
+// Reserves room for bytes in the pool, false when it is full
+bool admit(long long bytes) {
+    std::lock_guard<std::mutex> lock(bytes_mutex);
+    if (pooled_bytes + bytes > static_cast<long long>(BufferPool::MAX_BYTES)) return false;
+    pooled_bytes += bytes;
+    pooledGauge().set(pooled_bytes);
+    return true;
+}
+
+template <class T>
+void reserve(Pool<T>& pool, std::vector<T>& buffer, size_t size) {
+    if (buffer.capacity() >= size) return;
+    if (size < BufferPool::MIN_ELEMENTS) {
+        buffer.reserve(size);
+        return;
+    }
+    int c = sizeClass(size);
+    std::vector<T> taken;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex_);
+        auto it = pool.free_.find(c);
+        if (it != pool.free_.end() && !it->second.empty()) {
+            taken = std::move(it->second.back());
+            it->second.pop_back();
+        }
+    }
+    static Counter& hits = Metrics::counter("graphtex_buffer_pool_requests_total", "Large buffer requests", "result=\"hit\"");
+    static Counter& misses = Metrics::counter("graphtex_buffer_pool_requests_total", "Large buffer requests", "result=\"miss\"");
+    if (taken.capacity() > 0) {
+        hits.add();
+        account(-static_cast<long long>(taken.capacity() * sizeof(T)));
+    } else {
+        misses.add();
+        taken.reserve(size_t(1) << c);
+    }
+    taken.assign(buffer.begin(), buffer.end());
+    BufferPool::recycle(buffer);
+    buffer.swap(taken);
+}
+
+template <class T>
+void recycle(Pool<T>& pool, std::vector<T>& buffer) {
+    size_t capacity = buffer.capacity();
+    // Only buffers handed out by reserve have an exact power of two capacity
+    if (capacity < BufferPool::MIN_ELEMENTS || (capacity & (capacity - 1)) != 0 || !admit(capacity * sizeof(T))) {
+        std::vector<T>().swap(buffer);
+        return;
+    }
+    buffer.clear();
+    std::lock_guard<std::mutex> lock(pool.mutex_);
+    pool.free_[sizeClass(capacity)].push_back(std::move(buffer));
+    buffer = std::vector<T>();
+}
+
+template <class T>
+void clear(Pool<T>& pool) {
+    std::lock_guard<std::mutex> lock(pool.mutex_);
+    for (auto& entry : pool.free_) {
+        for (std::vector<T>& buffer : entry.second) account(-static_cast<long long>(buffer.capacity() * sizeof(T)));
+    }
+    pool.free_.clear();
+}
+
+}
+
+void BufferPool::reserve(std::vector<float>& buffer, size_t size) {
+    ::reserve(floats, buffer, size);
+}
+
+void BufferPool::reserve(std::vector<uint32_t>& buffer, size_t size) {
+    ::reserve(indices, buffer, size);
+}
+
+void BufferPool::recycle(std::vector<float>& buffer) {
+    ::recycle(floats, buffer);
+}
+
+void BufferPool::recycle(std::vector<uint32_t>& buffer) {
+    ::recycle(indices, buffer);
+}
+
+void BufferPool::clear() {
+    ::clear(floats);
+    ::clear(indices);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+    Recycles the large buffers of mesh jobs. Every slider tick meshes the
+    equation again at the same size, so instead of allocating and page faulting
+    fresh vectors each time, jobs take their buffers from the pool and meshes
+    give them back once the last reference to them is gone, i.e. when the
+    transport has replaced them.
+    Capacities are rounded up to a power of two so a buffer fits every request
+    of its size class. Buffers below MIN_ELEMENTS are left to the allocator,
+    and the pool keeps at most MAX_BYTES, anything beyond that is freed.
+*/
+class BufferPool {
+public:
+    static constexpr size_t MIN_ELEMENTS = size_t(1) << 16;
+    static constexpr size_t MAX_BYTES = size_t(512) << 20;
+
+    // Grows buffer to a capacity of at least size, keeping its contents
+    static void reserve(std::vector<float>& buffer, size_t size);
+    static void reserve(std::vector<uint32_t>& buffer, size_t size);
+    // Hands buffer back for reuse, leaving it empty
+    static void recycle(std::vector<float>& buffer);
+    static void recycle(std::vector<uint32_t>& buffer);
+    // Frees every pooled buffer
+    static void clear();
+};
@@ -0,0 +1,21 @@
+#pragma once
+#include <atomic>
+#include <stdexcept>
+
+/*
+    Shared by the scheduler and a running mesh job. Meshers poll it once per
+    grid row or layer and stop as soon as nobody wants the job's result.
+*/
+class CancelToken {
+private:
+    std::atomic<bool> cancelled_{false};
+public:
+    void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+    bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+};
+
+// Thrown out of a mesher whose token was cancelled
+class MeshCancelled : public std::runtime_error {
+public:
+    MeshCancelled() : std::runtime_error("mesh job cancelled") {}
+};
@@ -0,0 +1,208 @@
+#include "contours.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+
+// Contour levels only cover the view box, like clipped meshes
+constexpr float BOUND = 10.0f;
+
+// Crossing between two grid edges, each named by edgeId
+struct Segment {
+    uint64_t a_;
+    uint64_t b_;
+};
+
+/*
+    Every grid edge has one id, so the two cells sharing an edge agree on it:
+    2 (i cols + j) for the edge from (i, j) to (i, j + 1), one more for the
+    edge from (i, j) to (i + 1, j).
+*/
+uint64_t edgeId(int cols, int i, int j, bool vertical) {
+    return 2 * (static_cast<uint64_t>(i) * cols + j) + vertical;
+}
+
+class Tracer {
+private:
+    const float* grid_;
+    int rows_;
+    int cols_;
+    const std::vector<uint8_t>& skip_;
+    std::vector<float> heights_;
+
+    float z(int i, int j) const { return grid_[3 * (static_cast<size_t>(i) * cols_ + j) + 2]; }
+
+    // Where the level crosses an edge, computed from the id alone so both cells get the same point
+    void point(uint64_t id, float level, float* out) const {
+        bool vertical = id & 1;
+        uint64_t corner = id >> 1;
+        const float* p0 = grid_ + 3 * corner;
+        const float* p1 = grid_ + 3 * (corner + (vertical ? cols_ : 1));
+        float t = (level - p0[2]) / (p1[2] - p0[2]);
+        out[0] = p0[0] + t * (p1[0] - p0[0]);
+        out[1] = p0[1] + t * (p1[1] - p0[1]);
+        out[2] = level;
+    }
+
+    /*
+        Edges of a cell in order bottom, right, top, left, so corner k sits
+        between edges k - 1 and k. A saddle has four crossings and is split by
+        the value at the cell's center: the corners on the other side of it
+        get cut off.
+    */
+    void cell(int i, int j, float level, std::vector<Segment>& out) const {
+        float corners[4] = {z(i, j), z(i, j + 1), z(i + 1, j + 1), z(i + 1, j)};
+        bool above[4];
+        for (int k = 0; k < 4; k++) above[k] = corners[k] >= level;
+        uint64_t edges[4] = {edgeId(cols_, i, j, false), edgeId(cols_, i, j + 1, true),
+                             edgeId(cols_, i + 1, j, false), edgeId(cols_, i, j, true)};
+        uint64_t crossed[4];
+        int count = 0;
+        for (int k = 0; k < 4; k++) {
+            if (above[k] != above[(k + 1) % 4]) crossed[count++] = edges[k];
+        }
+        if (count == 2) {
+            out.push_back(Segment{crossed[0], crossed[1]});
+        } else if (count == 4) {
+            bool center = (corners[0] + corners[1] + corners[2] + corners[3]) / 4 >= level;
+            if (above[0] != center) {
+                out.push_back(Segment{edges[3], edges[0]});
+                out.push_back(Segment{edges[1], edges[2]});
+            } else {
+                out.push_back(Segment{edges[0], edges[1]});
+                out.push_back(Segment{edges[2], edges[3]});
+            }
+        }
+    }
+public:
+    Tracer(const float* grid, int rows, int cols, int levels, const std::vector<uint8_t>& skip)
+        : grid_(grid), rows_(rows), cols_(cols), skip_(skip) {
+        float lo = INFINITY, hi = -INFINITY;
+        for (size_t p = 0; p < static_cast<size_t>(rows) * cols; p++) {
+            float value = grid[3 * p + 2];
+            if (!std::isfinite(value)) continue;
+            lo = std::min(lo, value);
+            hi = std::max(hi, value);
+        }
+        lo = std::max(lo, -BOUND);
+        hi = std::min(hi, BOUND);
+        if (!(lo < hi)) return;
+        for (int k = 0; k < levels; k++) heights_.push_back(lo + (hi - lo) * (k + 1) / (levels + 1));
+    }
+
+    size_t levels() const { return heights_.size(); }
+
+    // Segments of every level in cell rows [row_lo, row_hi)
+    void band(int row_lo, int row_hi, std::vector<std::vector<Segment>>& segments) const {
+        segments.resize(heights_.size());
+        for (int i = row_lo; i < row_hi; i++) {
+            for (int j = 0; j < cols_ - 1; j++) {
+                if (!skip_.empty() && skip_[static_cast<size_t>(i) * (cols_ - 1) + j]) continue;
+                float corners[4] = {z(i, j), z(i, j + 1), z(i + 1, j + 1), z(i + 1, j)};
+                if (!std::isfinite(corners[0]) || !std::isfinite(corners[1]) || !std::isfinite(corners[2]) ||
+                    !std::isfinite(corners[3])) {
+                    continue;
+                }
+                float lo = std::min(std::min(corners[0], corners[1]), std::min(corners[2], corners[3]));
+                float hi = std::max(std::max(corners[0], corners[1]), std::max(corners[2], corners[3]));
+                // Only the levels between the cell's lowest and highest corner cross it
+                auto first = std::upper_bound(heights_.begin(), heights_.end(), lo);
+                for (auto level = first; level != heights_.end() && *level <= hi; ++level) {
+                    cell(i, j, *level, segments[level - heights_.begin()]);
+                }
+            }
+        }
+    }
+
+    // Joins the segments of one level at their shared edges
+    void stitch(size_t level, const std::vector<const std::vector<Segment>*>& parts, Contours& out) const {
+        std::vector<Segment> segments;
+        for (const std::vector<Segment>* part : parts) segments.insert(segments.end(), part->begin(), part->end());
+        // Segments ending on each edge, at most two
+        std::unordered_map<uint64_t, std::array<int, 2>> ends;
+        ends.reserve(2 * segments.size());
+        for (size_t s = 0; s < segments.size(); s++) {
+            for (uint64_t id : {segments[s].a_, segments[s].b_}) {
+                auto it = ends.emplace(id, std::array<int, 2>{-1, -1}).first;
+                (it->second[0] < 0 ? it->second[0] : it->second[1]) = static_cast<int>(s);
+            }
+        }
+        std::vector<char> used(segments.size(), 0);
+        // The unused segment continuing the line at edge id, -1 at its end
+        auto next = [&](uint64_t id) {
+            const std::array<int, 2>& at = ends[id];
+            for (int s : at) {
+                if (s >= 0 && !used[s]) return s;
+            }
+            return -1;
+        };
+        std::deque<uint64_t> line;
+        for (size_t s = 0; s < segments.size(); s++) {
+            if (used[s]) continue;
+            used[s] = 1;
+            line.assign({segments[s].a_, segments[s].b_});
+            for (int t; (t = next(line.back())) >= 0;) {
+                used[t] = 1;
+                line.push_back(segments[t].a_ == line.back() ? segments[t].b_ : segments[t].a_);
+            }
+            for (int t; (t = next(line.front())) >= 0;) {
+                used[t] = 1;
+                line.push_front(segments[t].a_ == line.front() ? segments[t].b_ : segments[t].a_);
+            }
+            for (uint64_t id : line) {
+                float p[3];
+                point(id, heights_[level], p);
+                out.points_.insert(out.points_.end(), p, p + 3);
+            }
+            out.lengths_.push_back(static_cast<uint32_t>(line.size()));
+        }
+    }
+};
+
+} // namespace
+
+Contours traceContours(const float* grid, int rows, int cols, int levels, const std::vector<uint8_t>& skip) {
+    Contours contours;
+    if (levels <= 0 || rows < 2 || cols < 2) return contours;
+    TraceSpan span("contours");
+    Tracer tracer(grid, rows, cols, levels, skip);
+    if (tracer.levels() == 0) return contours;
+
+    int cells = rows - 1;
+    int threads = std::max(1, std::min<int>(std::thread::hardware_concurrency(), cells / 16));
+    std::vector<std::vector<std::vector<Segment>>> bands(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() { tracer.band(cells * t / threads, cells * (t + 1) / threads, bands[t]); });
+    }
+    for (std::thread& worker : workers) worker.join();
+    workers.clear();
+
+    std::vector<Contours> lines(tracer.levels());
+    std::atomic<size_t> next_level(0);
+    auto stitcher = [&]() {
+        for (size_t level = next_level++; level < lines.size(); level = next_level++) {
+            std::vector<const std::vector<Segment>*> parts;
+            for (const std::vector<std::vector<Segment>>& band : bands) parts.push_back(&band[level]);
+            tracer.stitch(level, parts, lines[level]);
+        }
+    };
+    int stitchers = std::max(1, std::min<int>(std::thread::hardware_concurrency(), static_cast<int>(lines.size())));
+    for (int t = 0; t < stitchers; t++) workers.emplace_back(stitcher);
+    for (std::thread& worker : workers) worker.join();
+
+    for (const Contours& level : lines) {
+        contours.points_.insert(contours.points_.end(), level.points_.begin(), level.points_.end());
+        contours.lengths_.insert(contours.lengths_.end(), level.lengths_.begin(), level.lengths_.end());
+    }
+    static Counter& points = Metrics::counter("graphtex_contour_points_total", "Points of traced contour lines");
+    points.add(contours.points_.size() / 3);
+    return contours;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+/*
+    Iso-height lines of a surface as polylines in view coordinates. The first
+    lengths_[0] points of points_, 3 floats each, make the first polyline, the
+    next lengths_[1] the second and so on. Closed lines end on their first point.
+*/
+struct Contours {
+    std::vector<float> points_;
+    std::vector<uint32_t> lengths_;
+
+    bool empty() const { return lengths_.empty(); }
+};
+
+/*
+    Marching squares over a grid of rows x cols points, 3 floats each in view
+    coordinates as Geometry samples them. levels heights are spread evenly
+    between the lowest and highest finite samples inside the view box. Cell
+    (i, j), between grid rows i and i + 1 and columns j and j + 1, is left out
+    when skip[i * (cols - 1) + j] is nonzero, skip may also be empty. Row bands
+    are traced in parallel, then the segments of each level are stitched into
+    polylines, levels in parallel.
+*/
+Contours traceContours(const float* grid, int rows, int cols, int levels, const std::vector<uint8_t>& skip);
@@ -0,0 +1,335 @@
+#include "decimate.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "vec3.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// Collapses that turn a triangle further than about 78 degrees would fold the surface
+constexpr float FLIP_COSINE = 0.2f;
+// Collapses between polls of the cancel token
+constexpr int CANCEL_INTERVAL = 4096;
+
+// Sum of squared distances to a set of planes, the upper triangle of a symmetric 4x4 matrix
+struct Quadric {
+    double q_[10] = {};
+
+    void addPlane(double a, double b, double c, double d) {
+        q_[0] += a * a; q_[1] += a * b; q_[2] += a * c; q_[3] += a * d;
+        q_[4] += b * b; q_[5] += b * c; q_[6] += b * d;
+        q_[7] += c * c; q_[8] += c * d;
+        q_[9] += d * d;
+    }
+
+    Quadric operator+(const Quadric& other) const {
+        Quadric sum;
+        for (int i = 0; i < 10; i++) sum.q_[i] = q_[i] + other.q_[i];
+        return sum;
+    }
+
+    double error(const vec3& p) const {
+        double x = p.x, y = p.y, z = p.z;
+        return q_[0] * x * x + 2 * q_[1] * x * y + 2 * q_[2] * x * z + 2 * q_[3] * x +
+               q_[4] * y * y + 2 * q_[5] * y * z + 2 * q_[6] * y +
+               q_[7] * z * z + 2 * q_[8] * z + q_[9];
+    }
+};
+
+// Merging vertex from_ into to_, valid while neither has changed since it was costed
+struct Collapse {
+    double cost_;
+    uint32_t from_;
+    uint32_t to_;
+    uint32_t from_stamp_;
+    uint32_t to_stamp_;
+
+    bool operator>(const Collapse& other) const { return cost_ > other.cost_; }
+};
+
+/*
+    One block of a mesh, welded by position so that neighbouring triangles
+    share vertices. Triangles keep their original order, dead ones are
+    skipped when the block is written out.
+*/
+class Block {
+private:
+    std::vector<vec3> positions_;
+    std::vector<vec3> normals_;
+    std::vector<uint32_t> triangles_;
+    std::vector<char> alive_;
+    // Triangles around each vertex, dead ones included until the vertex is next touched
+    std::vector<std::vector<uint32_t>> around_;
+    std::vector<Quadric> quadrics_;
+    std::vector<char> locked_;
+    std::vector<char> removed_;
+    std::vector<uint32_t> stamps_;
+    std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> queue_;
+    size_t live_ = 0;
+
+    static uint64_t edgeKey(uint32_t a, uint32_t b) {
+        return a < b ? (static_cast<uint64_t>(a) << 32 | b) : (static_cast<uint64_t>(b) << 32 | a);
+    }
+
+    vec3 faceNormal(uint32_t t, uint32_t from, uint32_t to) const {
+        vec3 p[3];
+        for (int i = 0; i < 3; i++) {
+            uint32_t v = triangles_[3 * t + i];
+            p[i] = positions_[v == from ? to : v];
+        }
+        return (p[1] - p[0]).cross(p[2] - p[0]);
+    }
+
+    void neighbours(uint32_t v, std::vector<uint32_t>& out) const {
+        out.clear();
+        for (uint32_t t : around_[v]) {
+            if (!alive_[t]) continue;
+            for (int i = 0; i < 3; i++) {
+                uint32_t w = triangles_[3 * t + i];
+                if (w != v) out.push_back(w);
+            }
+        }
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+    }
+
+    // Queues the cheaper direction of the edge that keeps locked vertices in place
+    void push(uint32_t a, uint32_t b) {
+        if (locked_[a] && locked_[b]) return;
+        Quadric sum = quadrics_[a] + quadrics_[b];
+        double into_b = locked_[a] ? std::numeric_limits<double>::infinity() : sum.error(positions_[b]);
+        double into_a = locked_[b] ? std::numeric_limits<double>::infinity() : sum.error(positions_[a]);
+        if (into_b <= into_a) {
+            queue_.push(Collapse{into_b, a, b, stamps_[a], stamps_[b]});
+        } else {
+            queue_.push(Collapse{into_a, b, a, stamps_[b], stamps_[a]});
+        }
+    }
+
+    /*
+        A collapse has to keep the mesh a manifold, so the two vertices may only
+        share the neighbours opposite their edge, and may not fold or flatten
+        any triangle that survives it.
+    */
+    bool valid(uint32_t from, uint32_t to, std::vector<uint32_t>& from_ring, std::vector<uint32_t>& to_ring) const {
+        neighbours(from, from_ring);
+        neighbours(to, to_ring);
+        std::vector<uint32_t> common;
+        std::set_intersection(from_ring.begin(), from_ring.end(), to_ring.begin(), to_ring.end(), std::back_inserter(common));
+        if (common.size() != 2) return false;
+        for (uint32_t t : around_[from]) {
+            if (!alive_[t]) continue;
+            const uint32_t* v = &triangles_[3 * t];
+            if (v[0] == to || v[1] == to || v[2] == to) continue;
+            vec3 before = faceNormal(t, from, from).normalize();
+            vec3 after = faceNormal(t, from, to);
+            if (after.length() == 0.0f || before.dot(after.normalize()) < FLIP_COSINE) return false;
+        }
+        return true;
+    }
+
+    void apply(uint32_t from, uint32_t to) {
+        for (uint32_t t : around_[from]) {
+            if (!alive_[t]) continue;
+            uint32_t* v = &triangles_[3 * t];
+            if (v[0] == to || v[1] == to || v[2] == to) {
+                alive_[t] = 0;
+                live_--;
+                continue;
+            }
+            for (int i = 0; i < 3; i++) {
+                if (v[i] == from) v[i] = to;
+            }
+            around_[to].push_back(t);
+        }
+        std::vector<uint32_t>().swap(around_[from]);
+        std::vector<uint32_t>& around = around_[to];
+        around.erase(std::remove_if(around.begin(), around.end(), [&](uint32_t t) { return !alive_[t]; }), around.end());
+        quadrics_[to] = quadrics_[to] + quadrics_[from];
+        removed_[from] = 1;
+        stamps_[to]++;
+    }
+public:
+    // Welds the triangles vertex(0) .. vertex(3 * count - 1), degenerate ones are dropped
+    Block(const Mesh& mesh, size_t count, const std::function<size_t(size_t)>& vertex) {
+        std::unordered_map<vec3, uint32_t, vec3::Vec3Hash> welded;
+        welded.reserve(count);
+        triangles_.reserve(3 * count);
+        for (size_t t = 0; t < count; t++) {
+            uint32_t v[3];
+            for (int i = 0; i < 3; i++) {
+                size_t source = vertex(3 * t + i);
+                const float* p = mesh.position(source);
+                auto it = welded.emplace(vec3(p[0], p[1], p[2]), static_cast<uint32_t>(positions_.size()));
+                if (it.second) {
+                    const float* n = mesh.normal(source);
+                    positions_.push_back(it.first->first);
+                    normals_.push_back(vec3(n[0], n[1], n[2]));
+                }
+                v[i] = it.first->second;
+            }
+            if (v[0] == v[1] || v[1] == v[2] || v[0] == v[2]) continue;
+            triangles_.insert(triangles_.end(), v, v + 3);
+        }
+        size_t vertices = positions_.size(), triangles = triangles_.size() / 3;
+        live_ = triangles;
+        alive_.assign(triangles, 1);
+        around_.resize(vertices);
+        quadrics_.resize(vertices);
+        locked_.assign(vertices, 0);
+        removed_.assign(vertices, 0);
+        stamps_.assign(vertices, 0);
+
+        std::unordered_map<uint64_t, int> edges;
+        edges.reserve(3 * triangles / 2 + 1);
+        for (uint32_t t = 0; t < triangles; t++) {
+            const uint32_t* v = &triangles_[3 * t];
+            vec3 normal = faceNormal(t, v[0], v[0]).normalize();
+            double d = -normal.dot(positions_[v[0]]);
+            for (int i = 0; i < 3; i++) {
+                around_[v[i]].push_back(t);
+                quadrics_[v[i]].addPlane(normal.x, normal.y, normal.z, d);
+                edges[edgeKey(v[i], v[(i + 1) % 3])]++;
+            }
+        }
+        // Open and non manifold edges stay where they are
+        for (const std::pair<const uint64_t, int>& edge : edges) {
+            if (edge.second == 2) continue;
+            locked_[edge.first >> 32] = 1;
+            locked_[edge.first & 0xffffffffu] = 1;
+        }
+        for (const std::pair<const uint64_t, int>& edge : edges) {
+            push(static_cast<uint32_t>(edge.first >> 32), static_cast<uint32_t>(edge.first & 0xffffffffu));
+        }
+    }
+
+    size_t triangles() const { return live_; }
+
+    // Returns false when cancelled
+    bool run(size_t budget, double max_cost, const CancelToken* cancel) {
+        std::vector<uint32_t> from_ring, to_ring;
+        int collapses = 0;
+        while (!queue_.empty() && live_ > budget) {
+            Collapse collapse = queue_.top();
+            if (collapse.cost_ > max_cost) break;
+            queue_.pop();
+            if (removed_[collapse.from_] || removed_[collapse.to_] || stamps_[collapse.from_] != collapse.from_stamp_ ||
+                stamps_[collapse.to_] != collapse.to_stamp_) {
+                continue;
+            }
+            if (!valid(collapse.from_, collapse.to_, from_ring, to_ring)) continue;
+            apply(collapse.from_, collapse.to_);
+            neighbours(collapse.to_, to_ring);
+            for (uint32_t w : to_ring) push(collapse.to_, w);
+            if (++collapses % CANCEL_INTERVAL == 0 && cancel && cancel->cancelled()) return false;
+        }
+        return true;
+    }
+
+    // Appends the surviving triangles to a triangle soup in out's layout
+    void emitSoup(Mesh& out) const {
+        for (size_t t = 0; t < alive_.size(); t++) {
+            if (!alive_[t]) continue;
+            for (int i = 0; i < 3; i++) {
+                const vec3& p = positions_[triangles_[3 * t + i]];
+                const vec3& n = normals_[triangles_[3 * t + i]];
+                out.vertices_.insert(out.vertices_.end(), {p.x, p.y, p.z});
+                std::vector<float>& normals = out.interleaved_ ? out.vertices_ : out.normals_;
+                normals.insert(normals.end(), {n.x, n.y, n.z});
+            }
+        }
+    }
+
+    // Replaces out's vertices and indices with the surviving vertices and triangles
+    void emitIndexed(Mesh& out) const {
+        std::vector<uint32_t> remap(positions_.size(), UINT32_MAX);
+        for (size_t t = 0; t < alive_.size(); t++) {
+            if (!alive_[t]) continue;
+            for (int i = 0; i < 3; i++) {
+                uint32_t v = triangles_[3 * t + i];
+                if (remap[v] == UINT32_MAX) {
+                    remap[v] = static_cast<uint32_t>(out.vertexCount());
+                    const vec3& p = positions_[v];
+                    const vec3& n = normals_[v];
+                    out.vertices_.insert(out.vertices_.end(), {p.x, p.y, p.z});
+                    std::vector<float>& normals = out.interleaved_ ? out.vertices_ : out.normals_;
+                    normals.insert(normals.end(), {n.x, n.y, n.z});
+                }
+                out.indices_.push_back(remap[v]);
+            }
+        }
+    }
+};
+
+} // namespace
+
+Mesh decimate(Mesh mesh, const Decimation& settings, const CancelToken* cancel) {
+    size_t triangles = mesh.indices_.empty() ? mesh.vertexCount() / 3 : mesh.indices_.size() / 3;
+    if (!settings.enabled() || triangles == 0) return mesh;
+    if (settings.tolerance_ <= 0.0f && triangles <= settings.budget_) return mesh;
+    TraceSpan span("decimate");
+    double max_cost = settings.tolerance_ > 0.0f ? static_cast<double>(settings.tolerance_) * settings.tolerance_
+                                                 : std::numeric_limits<double>::infinity();
+    // Each block's share of the budget, at least one triangle so a share never turns the budget off
+    auto share = [&](size_t count) -> size_t {
+        if (settings.budget_ == 0) return 0;
+        return std::max<size_t>(1, static_cast<size_t>(static_cast<double>(settings.budget_) * count / triangles));
+    };
+    Mesh out(mesh.interleaved_);
+    out.reserve(mesh.vertexCount());
+    // Contours and the height field come from the full grid, so they stay as they are
+    out.contours_ = std::move(mesh.contours_);
+    out.field_ = std::move(mesh.field_);
+
+    if (!mesh.indices_.empty()) {
+        // Indexed meshes have no blocks and are decimated whole
+        Block block(mesh, triangles, [&](size_t k) { return mesh.indices_[k]; });
+        if (!block.run(share(triangles), max_cost, cancel)) throw MeshCancelled();
+        block.emitIndexed(out);
+    } else {
+        std::vector<size_t> starts(mesh.blocks_.begin(), mesh.blocks_.end());
+        if (starts.empty() || starts[0] != 0) starts.insert(starts.begin(), 0);
+        starts.push_back(mesh.vertexCount());
+        size_t blocks = starts.size() - 1;
+        std::vector<Mesh> outputs;
+        for (size_t b = 0; b < blocks; b++) outputs.emplace_back(mesh.interleaved_);
+        std::atomic<size_t> next(0);
+        std::atomic<bool> stopped(false);
+        auto worker = [&]() {
+            for (size_t b = next++; b < blocks && !stopped; b = next++) {
+                size_t first = starts[b], count = (starts[b + 1] - first) / 3;
+                Block block(mesh, count, [&](size_t k) { return first + k; });
+                if (!block.run(share(count), max_cost, cancel)) {
+                    stopped = true;
+                    return;
+                }
+                block.emitSoup(outputs[b]);
+            }
+        };
+        int threads = std::max(1, std::min<int>(std::thread::hardware_concurrency(), static_cast<int>(blocks)));
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) workers.emplace_back(worker);
+        for (std::thread& thread : workers) thread.join();
+        // Exceptions cannot leave the worker threads
+        if (stopped) throw MeshCancelled();
+        for (size_t b = 0; b < blocks; b++) {
+            if (!mesh.blocks_.empty()) out.blocks_.push_back(out.vertexCount());
+            out.vertices_.insert(out.vertices_.end(), outputs[b].vertices_.begin(), outputs[b].vertices_.end());
+            out.normals_.insert(out.normals_.end(), outputs[b].normals_.begin(), outputs[b].normals_.end());
+        }
+    }
+
+    size_t kept = out.indices_.empty() ? out.vertexCount() / 3 : out.indices_.size() / 3;
+    static Counter& removed = Metrics::counter("graphtex_decimated_triangles_total", "Triangles removed by decimate");
+    removed.add(triangles - kept);
+    return out;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "mesh.hpp"
+#include "cancel.hpp"
+#include <cstddef>
+
+// Triangle budget and error tolerance of decimate, zero turns either off
+struct Decimation {
+    // Most triangles to keep
+    size_t budget_ = 0;
+    // Largest distance, in view units, a collapse may move the surface by
+    float tolerance_ = 0.0f;
+
+    bool enabled() const { return budget_ > 0 || tolerance_ > 0.0f; }
+};
+
+/*
+    Collapses edges of a triangle soup by quadric error, cheapest first, until
+    the budget is met or the next collapse would exceed the tolerance. A vertex
+    is only ever merged into a neighbour, so every position left is one of the
+    originals and keeps its normal. Vertices on open edges never move, which
+    keeps clip boundaries, the gaps left at discontinuities and the edges of
+    the view intact. Blocks of the mesh are decimated in parallel, each to its
+    share of the budget, and the edges between them count as open.
+*/
+Mesh decimate(Mesh mesh, const Decimation& settings, const CancelToken* cancel = nullptr);
@@ -0,0 +1,301 @@
+#include "exporter.hpp"
+#include "geometry.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+ExportFormat exportFormat(const std::string& path) {
+    size_t dot = path.find_last_of('.');
+    std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (extension == "stl") return ExportFormat::STL;
+    if (extension == "ply") return ExportFormat::PLY;
+    if (extension == "obj") return ExportFormat::OBJ;
+    if (extension == "glb") return ExportFormat::GLB;
+    throw std::runtime_error("export error: unknown format '" + extension + "', use .stl, .ply, .obj or .glb");
+}
+
+MeshWriter::MeshWriter(const std::string& path) : file_(path, std::ios::binary | std::ios::trunc), buffer_(EXPORT_BUFFER) {
+    if (!file_) {
+        throw std::runtime_error("export error: cannot open " + path);
+    }
+}
+
+void MeshWriter::flush() {
+    file_.write(buffer_.data(), used_);
+    used_ = 0;
+    if (!file_) {
+        throw std::runtime_error("export error: writing failed, the disk may be full");
+    }
+}
+
+void MeshWriter::put(const void* data, size_t size) {
+    if (used_ + size > buffer_.size()) flush();
+    std::memcpy(buffer_.data() + used_, data, size);
+    used_ += size;
+    bytes_ += size;
+}
+
+void MeshWriter::print(const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int size = std::vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    put(line, std::min<size_t>(size, sizeof(line) - 1));
+}
+
+void MeshWriter::patch(uint64_t offset, const void* data, size_t size) {
+    flush();
+    file_.seekp(offset);
+    file_.write(static_cast<const char*>(data), size);
+    file_.seekp(0, std::ios::end);
+}
+
+void MeshWriter::finish() {
+    close();
+    flush();
+    file_.close();
+    if (file_.fail()) {
+        throw std::runtime_error("export error: writing failed, the disk may be full");
+    }
+}
+
+namespace {
+
+// Sum of the vertex normals, STL readers want one normal per facet
+void facetNormal(const Mesh& mesh, size_t v, float* normal) {
+    float x = 0.0f, y = 0.0f, z = 0.0f;
+    for (size_t i = v; i < v + 3; i++) {
+        x += mesh.normal(i)[0];
+        y += mesh.normal(i)[1];
+        z += mesh.normal(i)[2];
+    }
+    float length = std::sqrt(x * x + y * y + z * z);
+    if (length > 0.0f) {
+        x /= length;
+        y /= length;
+        z /= length;
+    }
+    normal[0] = x;
+    normal[1] = y;
+    normal[2] = z;
+}
+
+// Binary STL: 80 byte header, triangle count, then 50 bytes per triangle
+class StlWriter : public MeshWriter {
+public:
+    explicit StlWriter(const std::string& path) : MeshWriter(path) {
+        char header[80] = "GraphTeX binary STL";
+        put(header, sizeof(header));
+        uint32_t count = 0;
+        put(&count, sizeof(count));
+    }
+
+    void write(const Mesh& mesh) override {
+        size_t count = mesh.vertexCount();
+        if ((vertices_ + count) / 3 > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("export error: STL holds at most 2^32 triangles, lower the resolution");
+        }
+        char record[50] = {};
+        for (size_t v = 0; v < count; v += 3) {
+            float normal[3];
+            facetNormal(mesh, v, normal);
+            std::memcpy(record, normal, 12);
+            for (size_t i = 0; i < 3; i++) std::memcpy(record + 12 + 12 * i, mesh.position(v + i), 12);
+            put(record, sizeof(record));
+        }
+        vertices_ += count;
+    }
+
+    void close() override {
+        uint32_t count = static_cast<uint32_t>(triangles());
+        patch(80, &count, sizeof(count));
+    }
+};
+
+/*
+    Binary PLY with positions and normals per vertex. The counts in the header
+    are padded to a fixed width so they can be patched in place. Faces of a
+    triangle soup are just consecutive vertices, so they are generated at the
+    end instead of being kept.
+*/
+class PlyWriter : public MeshWriter {
+private:
+    static constexpr int COUNT_WIDTH = 20;
+    uint64_t vertex_count_at_ = 0;
+    uint64_t face_count_at_ = 0;
+
+    void count(uint64_t offset, uint64_t value) {
+        char text[COUNT_WIDTH + 1];
+        std::snprintf(text, sizeof(text), "%-*llu", COUNT_WIDTH, static_cast<unsigned long long>(value));
+        patch(offset, text, COUNT_WIDTH);
+    }
+public:
+    explicit PlyWriter(const std::string& path) : MeshWriter(path) {
+        print("ply\nformat binary_little_endian 1.0\ncomment GraphTeX\nelement vertex ");
+        vertex_count_at_ = bytes_;
+        print("%-*d\n", COUNT_WIDTH, 0);
+        print("property float x\nproperty float y\nproperty float z\n");
+        print("property float nx\nproperty float ny\nproperty float nz\nelement face ");
+        face_count_at_ = bytes_;
+        print("%-*d\n", COUNT_WIDTH, 0);
+        print("property list uchar int vertex_indices\nend_header\n");
+    }
+
+    void write(const Mesh& mesh) override {
+        size_t count = mesh.vertexCount();
+        if (vertices_ + count > static_cast<uint64_t>(std::numeric_limits<int32_t>::max())) {
+            throw std::runtime_error("export error: PLY indices hold at most 2^31 vertices, lower the resolution");
+        }
+        for (size_t v = 0; v < count; v++) {
+            float vertex[6];
+            std::memcpy(vertex, mesh.position(v), 12);
+            std::memcpy(vertex + 3, mesh.normal(v), 12);
+            put(vertex, sizeof(vertex));
+        }
+        vertices_ += count;
+    }
+
+    void close() override {
+        char face[13];
+        face[0] = 3;
+        for (uint64_t v = 0; v < vertices_; v += 3) {
+            int32_t indices[3] = {static_cast<int32_t>(v), static_cast<int32_t>(v + 1), static_cast<int32_t>(v + 2)};
+            std::memcpy(face + 1, indices, sizeof(indices));
+            put(face, sizeof(face));
+        }
+        count(vertex_count_at_, vertices_);
+        count(face_count_at_, triangles());
+    }
+};
+
+// Wavefront OBJ, every vertex with its own normal of the same index
+class ObjWriter : public MeshWriter {
+public:
+    explicit ObjWriter(const std::string& path) : MeshWriter(path) {
+        print("# GraphTeX\n");
+    }
+
+    void write(const Mesh& mesh) override {
+        size_t count = mesh.vertexCount();
+        for (size_t v = 0; v < count; v += 3) {
+            for (size_t i = v; i < v + 3; i++) {
+                const float* p = mesh.position(i);
+                const float* n = mesh.normal(i);
+                print("v %.7g %.7g %.7g\nvn %.7g %.7g %.7g\n", p[0], p[1], p[2], n[0], n[1], n[2]);
+            }
+            unsigned long long first = vertices_ + v + 1;
+            print("f %llu//%llu %llu//%llu %llu//%llu\n", first, first, first + 1, first + 1, first + 2, first + 2);
+        }
+        vertices_ += count;
+    }
+};
+
+/*
+    Binary glTF with one non indexed mesh, positions and normals interleaved
+    in the BIN chunk. The JSON chunk comes first but needs the counts and
+    bounds, so JSON_BYTES are reserved for it and filled in at the end, padded
+    with spaces. glTF is y up, the mesh is z up, so (x, y, z) is written as
+    (x, z, -y).
+*/
+class GlbWriter : public MeshWriter {
+private:
+    static constexpr uint32_t JSON_BYTES = 1024;
+    static constexpr uint64_t BIN_AT = 12 + 8 + JSON_BYTES;
+    float min_[3] = {INFINITY, INFINITY, INFINITY};
+    float max_[3] = {-INFINITY, -INFINITY, -INFINITY};
+
+    static void yUp(const float* in, float* out) {
+        out[0] = in[0];
+        out[1] = in[2];
+        out[2] = -in[1];
+    }
+public:
+    explicit GlbWriter(const std::string& path) : MeshWriter(path) {
+        std::vector<char> header(BIN_AT + 8, ' ');
+        std::memcpy(header.data(), "glTF", 4);
+        uint32_t version = 2;
+        std::memcpy(header.data() + 4, &version, 4);
+        std::memcpy(header.data() + 12, &JSON_BYTES, 4);
+        std::memcpy(header.data() + 16, "JSON", 4);
+        std::memcpy(header.data() + BIN_AT + 4, "BIN\0", 4);
+        put(header.data(), header.size());
+    }
+
+    void write(const Mesh& mesh) override {
+        size_t count = mesh.vertexCount();
+        if (BIN_AT + 8 + 24 * (vertices_ + count) > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("export error: GLB files hold at most 4 GB, lower the resolution or export STL or PLY");
+        }
+        for (size_t v = 0; v < count; v++) {
+            float vertex[6];
+            yUp(mesh.position(v), vertex);
+            yUp(mesh.normal(v), vertex + 3);
+            for (int i = 0; i < 3; i++) {
+                min_[i] = std::min(min_[i], vertex[i]);
+                max_[i] = std::max(max_[i], vertex[i]);
+            }
+            put(vertex, sizeof(vertex));
+        }
+        vertices_ += count;
+    }
+
+    void close() override {
+        if (vertices_ == 0) {
+            throw std::runtime_error("export error: the surface has no triangles in view");
+        }
+        unsigned long long count = vertices_, length = 24 * vertices_;
+        char json[JSON_BYTES + 1];
+        int size = std::snprintf(json, sizeof(json),
+            "{\"asset\":{\"version\":\"2.0\",\"generator\":\"GraphTeX\"},\"scene\":0,\"scenes\":[{\"nodes\":[0]}],"
+            "\"nodes\":[{\"mesh\":0}],\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0,\"NORMAL\":1},\"mode\":4}]}],"
+            "\"buffers\":[{\"byteLength\":%llu}],"
+            "\"bufferViews\":[{\"buffer\":0,\"byteLength\":%llu,\"byteStride\":24,\"target\":34962}],"
+            "\"accessors\":[{\"bufferView\":0,\"componentType\":5126,\"count\":%llu,\"type\":\"VEC3\","
+            "\"min\":[%.9g,%.9g,%.9g],\"max\":[%.9g,%.9g,%.9g]},"
+            "{\"bufferView\":0,\"byteOffset\":12,\"componentType\":5126,\"count\":%llu,\"type\":\"VEC3\"}]}",
+            length, length, count, min_[0], min_[1], min_[2], max_[0], max_[1], max_[2], count);
+        std::memset(json + size, ' ', JSON_BYTES - size);
+        patch(20, json, JSON_BYTES);
+        uint32_t bin = static_cast<uint32_t>(length), total = static_cast<uint32_t>(BIN_AT + 8 + length);
+        patch(BIN_AT, &bin, 4);
+        patch(8, &total, 4);
+    }
+};
+
+} // namespace
+
+std::unique_ptr<MeshWriter> MeshWriter::create(const std::string& path, ExportFormat format) {
+    switch (format) {
+        case ExportFormat::STL: return std::unique_ptr<MeshWriter>(new StlWriter(path));
+        case ExportFormat::PLY: return std::unique_ptr<MeshWriter>(new PlyWriter(path));
+        case ExportFormat::OBJ: return std::unique_ptr<MeshWriter>(new ObjWriter(path));
+        case ExportFormat::GLB: return std::unique_ptr<MeshWriter>(new GlbWriter(path));
+    }
+    throw std::runtime_error("export error: unknown format");
+}
+
+ExportStats exportSurface(const Program* program, int step, int range, double center_x, double center_y, bool clip,
+                          bool nested, const std::string& path, const CancelToken* cancel,
+                          const Singularities* singularities) {
+    TraceSpan span("export");
+    std::unique_ptr<MeshWriter> writer = MeshWriter::create(path, exportFormat(path));
+    try {
+        Geometry::stream(program, step, range, center_x, center_y, clip, nested,
+                         [&](const Mesh& mesh) { writer->write(mesh); }, cancel, singularities);
+        writer->finish();
+    } catch (...) {
+        writer.reset();
+        std::remove(path.c_str());
+        throw;
+    }
+    static Counter& bytes = Metrics::counter("graphtex_export_bytes_total", "Bytes written by exportSurface");
+    bytes.add(writer->bytes());
+    return ExportStats{writer->triangles(), writer->bytes()};
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include "mesh.hpp"
+#include "cancel.hpp"
+#include "InTeX/compiler.hpp"
+#include "singularities.hpp"
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Bytes MeshWriter gathers before each write to the file
+constexpr size_t EXPORT_BUFFER = 1 << 20;
+
+enum class ExportFormat { STL, PLY, OBJ, GLB };
+
+// Format named by the extension of path: .stl, .ply, .obj or .glb
+ExportFormat exportFormat(const std::string& path);
+
+/*
+    Writes a triangle soup to a file band by band through a buffer of
+    EXPORT_BUFFER bytes. Only counts and bounds are kept, so memory does not
+    grow with the mesh. Formats that give counts before the data get a
+    placeholder that finish() patches. Binary formats are little endian, like
+    every platform the application builds on.
+*/
+class MeshWriter {
+private:
+    std::ofstream file_;
+    std::vector<char> buffer_;
+    size_t used_ = 0;
+
+    void flush();
+protected:
+    uint64_t vertices_ = 0;
+    uint64_t bytes_ = 0;
+
+    void put(const void* data, size_t size);
+    void print(const char* format, ...);
+    // Overwrites bytes already written at offset, for counts known at the end
+    void patch(uint64_t offset, const void* data, size_t size);
+    virtual void close() {}
+public:
+    explicit MeshWriter(const std::string& path);
+    virtual ~MeshWriter() = default;
+    static std::unique_ptr<MeshWriter> create(const std::string& path, ExportFormat format);
+
+    // Appends the triangles of a split mesh
+    virtual void write(const Mesh& mesh) = 0;
+    // Completes the file, which is not valid before
+    void finish();
+    uint64_t triangles() const { return vertices_ / 3; }
+    uint64_t bytes() const { return bytes_; }
+};
+
+struct ExportStats {
+    uint64_t triangles_;
+    uint64_t bytes_;
+};
+
+/*
+    Meshes the explicit surface program, with inputs x and y, on the grid a
+    Geometry with the same arguments uses and writes it to path, in the format
+    its extension names, while it is meshed. Working memory depends on the
+    resolution's width only, see Geometry::stream. singularities, built from
+    the same expression, refines the mesh at its poles and domain edges. A
+    partial file is removed when meshing or writing fails.
+*/
+ExportStats exportSurface(const Program* program, int step, int range, double center_x, double center_y, bool clip,
+                          bool nested, const std::string& path, const CancelToken* cancel = nullptr,
+                          const Singularities* singularities = nullptr);
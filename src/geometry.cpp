@@ -1,211 +1,980 @@
 #include "geometry.hpp"
+#include <cmath>
+#include <thread>
+#include <tuple>
 
-Geometry::Geometry(Evaluator* evaluator, int step, int range, bool clip) {
+// Floor division so negative lattice indices map to the correct tile
+static long long floorDiv(long long a, long long b) {
+    return a / b - ((a % b != 0) && ((a < 0) != (b < 0)));
+}
+
+Geometry::Geometry(const Evaluator* evaluator, TileCache* cache, int step, int range,
+                   double center_x, double center_y, bool clip, bool nested, const CancelToken* cancel, bool interleaved,
+                   int contour_levels, bool pickable, bool heightfield, const Singularities* singularities)
+    : mesh_(interleaved) {
     evaluator_ = evaluator;
+    cache_ = cache;
+    cancel_ = cancel;
+    if (singularities && singularities->count()) singular_ = singularities;
+    layout(step, range, center_x, center_y, nested);
+    BufferPool::reserve(vertices_, 3 * rows_ * cols_);
+    vertices_.resize(3 * rows_ * cols_);
+    {
+        TraceSpan span("generateVertices");
+        generateVertices(0, rows_);
+    }
+    triangulate(clip, contour_levels, pickable, heightfield);
+}
+
+Geometry::Geometry(const std::vector<float>& heights, int step, int range, double center_x, double center_y,
+                   bool clip, bool nested, const CancelToken* cancel, bool interleaved, int contour_levels,
+                   bool pickable, bool heightfield, const Singularities* singularities)
+    : mesh_(interleaved) {
+    evaluator_ = nullptr;
+    cache_ = nullptr;
+    cancel_ = cancel;
+    if (singularities && singularities->count()) singular_ = singularities;
+    layout(step, range, center_x, center_y, nested);
+    if (heights.size() != static_cast<size_t>(rows_) * cols_) {
+        throw std::runtime_error("geometry error: heights do not match the sampling grid");
+    }
+    BufferPool::reserve(vertices_, 3 * rows_ * cols_);
+    vertices_.resize(3 * rows_ * cols_);
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            setVertex(i, j, heights[i * cols_ + j]);
+        }
+    }
+    triangulate(clip, contour_levels, pickable, heightfield);
+}
+
+// Sampling grid of a view, shared by every Geometry with the same step, range, center and nesting
+void Geometry::layout(int step, int range, double center_x, double center_y, bool nested) {
     step_ = step;
     range_ = range;
-    step_size_ = 2.0f * range_ / (step_ - 1);
-    vertices_.resize(3 * step_ * step_);
-    tempVertices_.reserve(3 * step_ * step_);
-    normals_.reserve(3 * step_ * step_);
-    generateVertices(0, step_);
-    clipTriangles(1, step_, clip);
-    vertices_ = tempVertices_;
+    center_x_ = center_x;
+    center_y_ = center_y;
+    if (step_ < 2) {
+        throw std::runtime_error("geometry error: mesh resolution must be at least 2");
+    }
+    if (nested) {
+        /*
+            Nested grids anchor the lattice to the window and use 2^k + 1 samples
+            per row, so every coarser resolution is a subset of the finer one
+        */
+        level_ = -std::max(1, static_cast<int>(std::round(std::log2(step_ - 1))));
+        lattice_ = {center_x_ - range_, center_y_ - range_, 2.0 * range_};
+    } else {
+        /*
+            The requested spacing is kept exactly. Only its power of two becomes
+            the tile level, the rest is the lattice unit, so views an octave
+            apart share tiles and panning reuses them at any spacing
+        */
+        double spacing = 2.0 * range_ / (step_ - 1);
+        level_ = static_cast<int>(std::round(std::log2(spacing)));
+        lattice_ = {0.0, 0.0, std::ldexp(spacing, -level_)};
+    }
+    step_size_ = std::ldexp(lattice_.unit_, level_);
+    sampleAxis(center_x_ - range_, center_x_ + range_, lattice_.origin_x_, xs_, gxs_);
+    sampleAxis(center_y_ - range_, center_y_ + range_, lattice_.origin_y_, ys_, gys_);
+    cols_ = xs_.size();
+    rows_ = ys_.size();
 }
 
-void Geometry::generateVertices(int minrow, int maxrow) {
+void Geometry::triangulate(bool clip, int contour_levels, bool pickable, bool heightfield) {
+    if (contour_levels > 0 || pickable || heightfield) rejected_.assign(static_cast<size_t>(rows_ - 1) * (cols_ - 1), 0);
+    if (singular_) {
+        TraceSpan span("sampleSigns");
+        sampleSigns();
+    }
+    if (heightfield) {
+        TraceSpan span("rejectTriangles");
+        rejectTriangles(1, rows_);
+    } else {
+        // Two triangles per quad, more only where clipping splits one
+        mesh_.reserve(6 * static_cast<size_t>(rows_ - 1) * (cols_ - 1));
+        {
+            TraceSpan span("clipTriangles");
+            clipTriangles(1, rows_, clip);
+        }
+        TraceSpan span("normals");
+        computeNormals(mesh_);
+        std::unordered_map<vec3, vec3, vec3::Vec3Hash>().swap(normal_map_);
+    }
+    // Contours skip the quads the mesh dropped, so they end at the same discontinuities
+    mesh_.contours_ = traceContours(vertices_.data(), rows_, cols_, contour_levels, rejected_);
+    if (pickable) {
+        TraceSpan span("heightField");
+        PickView view{static_cast<double>(range_), center_x_, center_y_, clip};
+        mesh_.field_ = std::make_shared<const HeightField>(vertices_.data(), rows_, cols_, view, rejected_);
+    }
+    if (heightfield) {
+        Mesh::Grid& grid = mesh_.grid_;
+        grid.rows_ = rows_;
+        grid.cols_ = cols_;
+        grid.clip_ = clip;
+        for (int j = 0; j < cols_; j++) grid.xs_.push_back(vertices_[gridIndex(0, j)]);
+        for (int i = 0; i < rows_; i++) grid.ys_.push_back(vertices_[gridIndex(i, 0) + 1]);
+        size_t count = static_cast<size_t>(rows_) * cols_;
+        BufferPool::reserve(grid.heights_, count);
+        grid.heights_.resize(count);
+        for (size_t p = 0; p < count; p++) grid.heights_[p] = vertices_[3 * p + 2];
+        grid.rejected_ = std::move(rejected_);
+    }
+    std::vector<uint8_t>().swap(rejected_);
+    std::vector<uint64_t>().swap(signs_);
+    std::unordered_map<uint64_t, Crossing>().swap(crossings_);
+    std::unordered_map<uint64_t, std::vector<ChainPoint>>().swap(chains_);
+    // The grid is not needed once triangulated, release it before the mesh moves on
+    BufferPool::recycle(vertices_);
+
+    static Counter& samples = Metrics::counter("graphtex_samples_total", "Expression samples evaluated", "surface=\"explicit\"");
+    static Counter& nan_samples = Metrics::counter("graphtex_nan_samples_total", "Samples that evaluated to NaN", "surface=\"explicit\"");
+    static Counter& discontinuities = Metrics::counter("graphtex_discontinuity_rejections_total",
+                                                       "Triangles dropped by crossDiscontinuity");
+    static Counter& singular = Metrics::counter("graphtex_singular_triangles_total",
+                                                "Triangles refined or dropped at a pole or domain edge of their expression");
+    samples.add(samples_);
+    nan_samples.add(nan_samples_);
+    discontinuities.add(discontinuities_);
+    singular.add(singular_triangles_);
+}
+
+void Geometry::axes(int step, int range, double center_x, double center_y, bool nested, std::vector<double>& xs,
+                    std::vector<double>& ys) {
+    Geometry grid;
+    grid.layout(step, range, center_x, center_y, nested);
+    xs = std::move(grid.xs_);
+    ys = std::move(grid.ys_);
+}
+
+// One pass over the grid for all outputs, see runRows
+std::vector<std::vector<float>> Geometry::sampleBatch(const Program* program, int step, int range, double center_x,
+                                                      double center_y, bool nested, const CancelToken* cancel) {
+    TraceSpan span("sampleBatch");
+    Geometry grid;
+    grid.cancel_ = cancel;
+    grid.layout(step, range, center_x, center_y, nested);
+    const int rows = grid.rows_, cols = grid.cols_;
+    std::vector<std::vector<float>> heights(program->outputs());
+    for (std::vector<float>& output : heights) {
+        BufferPool::reserve(output, static_cast<size_t>(rows) * cols);
+        output.resize(static_cast<size_t>(rows) * cols);
+    }
+    grid.runRows(program, 0, rows, [&](size_t o, int i) { return heights[o].data() + static_cast<size_t>(i) * cols; });
+    // Bands stop early when cancelled, exceptions cannot leave the worker threads
+    grid.checkCancelled();
+    return heights;
+}
+
+/*
+    Runs program on the grid rows [row_lo, row_hi) split across threads, in
+    chunks of BATCH_SAMPLES, small enough that the program's registers for a
+    chunk stay in cache while every instruction sweeps it. Output o of row i
+    goes to row_output(o, i). Bands stop early when cancelled, callers check
+    afterwards.
+*/
+void Geometry::runRows(const Program* program, int row_lo, int row_hi,
+                       const std::function<float*(size_t, int)>& row_output) const {
+    static Counter& samples = Metrics::counter("graphtex_samples_total", "Expression samples evaluated", "surface=\"explicit\"");
+    static Counter& nan_samples = Metrics::counter("graphtex_nan_samples_total", "Samples that evaluated to NaN", "surface=\"explicit\"");
+    const int cols = cols_;
+    const size_t outputs_count = program->outputs();
+    auto band = [&](int band_lo, int band_hi) {
+        // truncate small decimals like sample does
+        const float epsilon = 1e-6;
+        std::vector<float> xs(BATCH_SAMPLES), ys(BATCH_SAMPLES), scratch;
+        std::vector<float*> outputs(outputs_count);
+        uint64_t nans = 0;
+        for (int i = band_lo; i < band_hi; i++) {
+            if (cancel_ && cancel_->cancelled()) return;
+            float y = std::abs(ys_[i]) < epsilon ? 0.0f : static_cast<float>(ys_[i]);
+            for (int j0 = 0; j0 < cols; j0 += BATCH_SAMPLES) {
+                int count = std::min(BATCH_SAMPLES, cols - j0);
+                for (int j = 0; j < count; j++) {
+                    double x = xs_[j0 + j];
+                    xs[j] = std::abs(x) < epsilon ? 0.0f : static_cast<float>(x);
+                    ys[j] = y;
+                }
+                for (size_t o = 0; o < outputs_count; o++) outputs[o] = row_output(o, i) + j0;
+                program->run({xs.data(), ys.data()}, outputs, count, scratch);
+                for (float* output : outputs) {
+                    for (int j = 0; j < count; j++) nans += std::isnan(output[j]);
+                }
+            }
+        }
+        samples.add(static_cast<uint64_t>(band_hi - band_lo) * cols * outputs_count);
+        nan_samples.add(nans);
+    };
+    int rows = row_hi - row_lo;
+    int threads = std::max(1, std::min<int>(std::thread::hardware_concurrency(), rows / 2));
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back(band, row_lo + rows * t / threads, row_lo + rows * (t + 1) / threads);
+    }
+    for (std::thread& worker : workers) worker.join();
+}
+
+/*
+    Quads of row r join grid rows r - 1 and r, and the discontinuity check
+    looks one row further either way, so a band of quad rows [lo, hi) needs
+    grid rows lo - 2 through hi. Those stay in vertices_, starting at row0_,
+    and the rows two bands share are moved down rather than sampled again.
+    A vertex on a band's last row also touches triangles of the next band, so
+    each band is handed to sink one band late, once its normals are complete.
+    normal_map_ only keeps the positions the next band can still reach.
+*/
+void Geometry::stream(const Program* program, int step, int range, double center_x, double center_y, bool clip,
+                      bool nested, const std::function<void(const Mesh&)>& sink, const CancelToken* cancel,
+                      const Singularities* singularities) {
+    TraceSpan span("streamMesh");
+    Geometry grid;
+    grid.cancel_ = cancel;
+    if (singularities && singularities->count()) grid.singular_ = singularities;
+    grid.layout(step, range, center_x, center_y, nested);
+    const int rows = grid.rows_, cols = grid.cols_;
+    BufferPool::reserve(grid.vertices_, 3 * static_cast<size_t>(STREAM_ROWS + 3) * cols);
+    std::vector<float> heights;
+    BufferPool::reserve(heights, static_cast<size_t>(STREAM_ROWS + 3) * cols);
+    Mesh pending;
+    int sampled = 0;
+    for (int lo = 1; lo < rows; lo += STREAM_ROWS) {
+        int hi = std::min(rows, lo + STREAM_ROWS);
+        int first = std::max(0, lo - 2), last = std::min(rows, hi + 1);
+        size_t kept = 3 * static_cast<size_t>(std::max(0, sampled - first)) * cols;
+        std::copy(grid.vertices_.end() - kept, grid.vertices_.end(), grid.vertices_.begin());
+        grid.vertices_.resize(3 * static_cast<size_t>(last - first) * cols);
+        grid.row0_ = first;
+
+        int from = std::max(first, sampled);
+        heights.resize(static_cast<size_t>(last - from) * cols);
+        grid.runRows(program, from, last, [&](size_t, int i) { return heights.data() + static_cast<size_t>(i - from) * cols; });
+        grid.checkCancelled();
+        for (int i = from; i < last; i++) {
+            for (int j = 0; j < cols; j++) grid.setVertex(i, j, heights[static_cast<size_t>(i - from) * cols + j]);
+        }
+        sampled = last;
+        if (grid.singular_) {
+            grid.sampleSigns();
+            grid.crossings_.clear();
+            grid.chains_.clear();
+        }
+
+        grid.mesh_.reserve(6 * static_cast<size_t>(hi - lo) * (cols - 1));
+        grid.clipTriangles(lo, hi, clip);
+        if (!pending.empty()) {
+            grid.computeNormals(pending);
+            sink(pending);
+        }
+        pending = std::move(grid.mesh_);
+        grid.mesh_ = Mesh();
+        // Positions below grid row lo - 2 belong to quads already handed on
+        if (lo > 1) {
+            float below = grid.vertices_[grid.gridIndex(lo - 2, 0) + 1];
+            for (auto it = grid.normal_map_.begin(); it != grid.normal_map_.end();) {
+                it = it->first.y < below ? grid.normal_map_.erase(it) : std::next(it);
+            }
+        }
+    }
+    if (!pending.empty()) {
+        grid.computeNormals(pending);
+        sink(pending);
+    }
+    BufferPool::recycle(heights);
+
+    static Counter& discontinuities = Metrics::counter("graphtex_discontinuity_rejections_total",
+                                                       "Triangles dropped by crossDiscontinuity");
+    static Counter& singular = Metrics::counter("graphtex_singular_triangles_total",
+                                                "Triangles refined or dropped at a pole or domain edge of their expression");
+    discontinuities.add(grid.discontinuities_);
+    singular.add(grid.singular_triangles_);
+}
+
+/*
+    Lattice points strictly inside [min, max], plus the window edges themselves
+    when they are not on the lattice. Lattice points within a quarter spacing of
+    an off lattice edge are skipped to avoid sliver triangles.
+*/
+void Geometry::sampleAxis(double min, double max, double origin, std::vector<double>& coords, std::vector<long long>& indices) {
+    const double tolerance = 1e-9;
+    double lo = (min - origin) / step_size_;
+    double hi = (max - origin) / step_size_;
+    long long first = static_cast<long long>(std::ceil(lo - tolerance));
+    long long last = static_cast<long long>(std::floor(hi + tolerance));
+    bool lo_exact = std::abs(first - lo) < tolerance;
+    bool hi_exact = std::abs(hi - last) < tolerance;
+
+    if (!lo_exact) {
+        coords.push_back(min);
+        indices.push_back(OFF_LATTICE);
+        if (first - lo < 0.25) first++;
+    }
+    if (!hi_exact && hi - last < 0.25) last--;
+    for (long long g = first; g <= last; g++) {
+        coords.push_back(origin + g * step_size_);
+        indices.push_back(g);
+    }
+    if (!hi_exact) {
+        coords.push_back(max);
+        indices.push_back(OFF_LATTICE);
+    }
+}
+
+// Abandons the mesh once its job has been superseded, called once per row
+void Geometry::checkCancelled() {
+    if (cancel_ && cancel_->cancelled()) {
+        throw MeshCancelled();
+    }
+}
+
+float Geometry::sample(Evaluator* localeval, double x, double y) {
     // truncate small decimals
     const float epsilon = 1e-6;
-    Evaluator* localeval = evaluator_->copy();
+    localeval->vars_["x"] = std::abs(x) < epsilon ? 0.0f : static_cast<float>(x);
+    localeval->vars_["y"] = std::abs(y) < epsilon ? 0.0f : static_cast<float>(y);
+    float z = localeval->evaluate();
+    samples_++;
+    if (std::isnan(z)) nan_samples_++;
+    return z;
+}
+
+/*
+    Copies samples that coincide with cached tiles one level coarser or finer.
+    Even lattice indices at this level are the coarser level's samples, and
+    every sample at this level is an even index of the finer level.
+*/
+void Geometry::seedTile(Tile& tile, const TileKey& key) {
+    std::shared_ptr<const Tile> coarse = cache_->find({key.lattice_, key.level_ + 1, floorDiv(key.tx_, 2), floorDiv(key.ty_, 2)});
+    std::shared_ptr<const Tile> fine[4];
+    for (int i = 0; i < 4; i++) {
+        fine[i] = cache_->find({key.lattice_, key.level_ - 1, 2 * key.tx_ + (i & 1), 2 * key.ty_ + (i >> 1)});
+    }
+    // Offset of this tile within its coarser tile
+    int cx = static_cast<int>(key.tx_ & 1) * TILE_SIZE / 2;
+    int cy = static_cast<int>(key.ty_ & 1) * TILE_SIZE / 2;
+
+    for (int ly = 0; ly < TILE_SIZE; ly++) {
+        for (int lx = 0; lx < TILE_SIZE; lx++) {
+            int k = ly * TILE_SIZE + lx;
+            if (tile.valid_[k]) continue;
+            if (coarse && lx % 2 == 0 && ly % 2 == 0) {
+                int ck = (cy + ly / 2) * TILE_SIZE + cx + lx / 2;
+                if (coarse->valid_[ck]) {
+                    tile.z_[k] = coarse->z_[ck];
+                    tile.valid_[k] = 1;
+                    continue;
+                }
+            }
+            const Tile* src = fine[(2 * ly >= TILE_SIZE) * 2 + (2 * lx >= TILE_SIZE)].get();
+            int fk = (2 * ly % TILE_SIZE) * TILE_SIZE + 2 * lx % TILE_SIZE;
+            if (src && src->valid_[fk]) {
+                tile.z_[k] = src->z_[fk];
+                tile.valid_[k] = 1;
+            }
+        }
+    }
+}
+
+// Looks up every tile overlapping the lattice rect, evaluating only samples no earlier job computed
+void Geometry::fillTiles(Evaluator* localeval, long long gx_lo, long long gx_hi, long long gy_lo, long long gy_hi,
+                         std::vector<std::shared_ptr<const Tile>>& tiles) {
+    long long tx0 = floorDiv(gx_lo, TILE_SIZE), tx1 = floorDiv(gx_hi, TILE_SIZE);
+    long long ty0 = floorDiv(gy_lo, TILE_SIZE), ty1 = floorDiv(gy_hi, TILE_SIZE);
+    long long ntx = tx1 - tx0 + 1;
+    tiles.assign(ntx * (ty1 - ty0 + 1), nullptr);
+
+    for (long long ty = ty0; ty <= ty1; ty++) {
+        for (long long tx = tx0; tx <= tx1; tx++) {
+            TileKey key{lattice_, level_, tx, ty};
+            std::shared_ptr<const Tile> tile = cache_ ? cache_->find(key) : nullptr;
+            // Samples of this tile inside the window
+            int x0 = static_cast<int>(std::max(gx_lo - tx * TILE_SIZE, 0LL));
+            int x1 = static_cast<int>(std::min(gx_hi - tx * TILE_SIZE, TILE_SIZE - 1LL));
+            int y0 = static_cast<int>(std::max(gy_lo - ty * TILE_SIZE, 0LL));
+            int y1 = static_cast<int>(std::min(gy_hi - ty * TILE_SIZE, TILE_SIZE - 1LL));
+
+            bool complete = tile != nullptr;
+            for (int ly = y0; complete && ly <= y1; ly++) {
+                for (int lx = x0; lx <= x1; lx++) {
+                    if (!tile->valid_[ly * TILE_SIZE + lx]) {
+                        complete = false;
+                        break;
+                    }
+                }
+            }
+            if (!complete) {
+                std::shared_ptr<Tile> filled = tile ? std::make_shared<Tile>(*tile) : std::make_shared<Tile>();
+                if (cache_) seedTile(*filled, key);
+                for (int ly = y0; ly <= y1; ly++) {
+                    checkCancelled();
+                    double y = lattice_.origin_y_ + (ty * TILE_SIZE + ly) * step_size_;
+                    for (int lx = x0; lx <= x1; lx++) {
+                        int k = ly * TILE_SIZE + lx;
+                        if (filled->valid_[k]) continue;
+                        filled->z_[k] = sample(localeval, lattice_.origin_x_ + (tx * TILE_SIZE + lx) * step_size_, y);
+                        filled->valid_[k] = 1;
+                    }
+                }
+                if (cache_) cache_->insert(key, filled);
+                tile = filled;
+            }
+            tiles[(ty - ty0) * ntx + (tx - tx0)] = tile;
+        }
+    }
+}
+
+void Geometry::generateVertices(int minrow, int maxrow) {
+    std::unique_ptr<Evaluator> localeval(evaluator_->copy());
+
+    // Lattice bounds of the requested rows, off lattice samples only sit at the ends
+    long long gx_lo = OFF_LATTICE, gx_hi = OFF_LATTICE, gy_lo = OFF_LATTICE, gy_hi = OFF_LATTICE;
+    for (int j = 0; j < cols_; j++) {
+        if (gxs_[j] == OFF_LATTICE) continue;
+        if (gx_lo == OFF_LATTICE) gx_lo = gxs_[j];
+        gx_hi = gxs_[j];
+    }
     for (int i = minrow; i < maxrow; i++) {
-        float y = -range_ + i * step_size_;
-        for (int j = 0; j < step_; j++) {
-            float x = -range_ + j * step_size_;
-            x = std::abs(x) < epsilon ? 0.0 : x;
-            y = std::abs(y) < epsilon ? 0.0 : y;
-            localeval->vars_["x"] = x;
-            localeval->vars_["y"] = y;
-            int index = 3 * (i * step_ + j);
-            // Bound vertices in [-10, 10] WebGL coords
-            vertices_[index] = 20*(x + range_)/(2*range_) - 10;
-            vertices_[index + 1] = 20*(y + range_)/(2*range_) - 10;
-            float z = localeval->evaluate();
-            z = std::abs(z) < epsilon ? 0.0 : z;
-            vertices_[index + 2] = 20*(z + range_)/(2*range_) - 10;
+        if (gys_[i] == OFF_LATTICE) continue;
+        if (gy_lo == OFF_LATTICE) gy_lo = gys_[i];
+        gy_hi = gys_[i];
+    }
+    std::vector<std::shared_ptr<const Tile>> tiles;
+    long long tx0 = 0, ty0 = 0, ntx = 0;
+    if (gx_lo != OFF_LATTICE && gy_lo != OFF_LATTICE) {
+        TraceSpan span("sampleTiles");
+        fillTiles(localeval.get(), gx_lo, gx_hi, gy_lo, gy_hi, tiles);
+        tx0 = floorDiv(gx_lo, TILE_SIZE);
+        ty0 = floorDiv(gy_lo, TILE_SIZE);
+        ntx = floorDiv(gx_hi, TILE_SIZE) - tx0 + 1;
+    }
+
+    for (int i = minrow; i < maxrow; i++) {
+        checkCancelled();
+        double y = ys_[i];
+        for (int j = 0; j < cols_; j++) {
+            double x = xs_[j];
+            float z;
+            if (gys_[i] != OFF_LATTICE && gxs_[j] != OFF_LATTICE) {
+                long long tx = floorDiv(gxs_[j], TILE_SIZE), ty = floorDiv(gys_[i], TILE_SIZE);
+                const Tile& tile = *tiles[(ty - ty0) * ntx + (tx - tx0)];
+                z = tile.z_[(gys_[i] - ty * TILE_SIZE) * TILE_SIZE + (gxs_[j] - tx * TILE_SIZE)];
+            } else {
+                z = sample(localeval.get(), x, y);
+            }
+            setVertex(i, j, z);
         }
     }
-    delete localeval;
+}
+
+void Geometry::setVertex(int i, int j, float z) {
+    size_t index = gridIndex(i, j);
+    vec3 v = viewPoint(xs_[j], ys_[i], z);
+    vertices_[index] = v.x;
+    vertices_[index + 1] = v.y;
+    vertices_[index + 2] = v.z;
+}
+
+vec3 Geometry::viewPoint(double x, double y, float z) const {
+    // truncate small decimals
+    const float epsilon = 1e-6;
+    z = std::abs(z) < epsilon ? 0.0 : z;
+    // Bound vertices in [-10, 10] WebGL coords
+    return vec3(20*(x - center_x_ + range_)/(2*range_) - 10, 20*(y - center_y_ + range_)/(2*range_) - 10,
+                20*(z + range_)/(2*range_) - 10);
 }
 
 // Reconstructs triangles if clips through max/min z plane, along with dynamic normal generaion
 void Geometry::clipTriangles(int minrow, int maxrow, bool clip) {
-    std::vector<float> new_vertices;
-    std::unordered_map<vec3, vec3, vec3::Vec3Hash> normal_map;
     vec3 v0, v1, v2;
     std::vector<vec3> surrounding_grads;
     size_t i0, i1, i2;
-    float bound = 10.0f;
     for (int row = minrow; row < maxrow; row++) {
+        checkCancelled();
+        if ((row - minrow) % BLOCK_ROWS == 0) {
+            mesh_.blocks_.push_back(mesh_.vertexCount());
+        }
         // For fist col of new row, examine each nearby gradient for prev_grad
-        for (int col = 0; col < step_ - 1; col++) { // For each quad
+        for (int col = 0; col < cols_ - 1; col++) { // For each quad
             for (int i = 0; i < 2; i++) { // Two triangles per quad
                 surrounding_grads = computeSurroundingGradients(row, col);
                 if (i == 0) {
-                    i0 = (step_ * row + col) * 3;
-                    i1 = (step_ * (row - 1) + col) * 3;
-                    i2 = (step_ * row + col + 1) * 3;
+                    i0 = gridIndex(row, col);
+                    i1 = gridIndex(row - 1, col);
+                    i2 = gridIndex(row, col + 1);
                     v0 = vec3(vertices_[i0], vertices_[i0 + 1], vertices_[i0 + 2]);
                     v1 = vec3(vertices_[i1], vertices_[i1 + 1], vertices_[i1 + 2]);
                     v2 = vec3(vertices_[i2], vertices_[i2 + 1], vertices_[i2 + 2]);
                 } else {
-                    i0 = (step_ * row + (col + 1)) * 3;
-                    i1 = (step_ * (row - 1) + col) * 3;
-                    i2 = (step_ * (row - 1) + (col + 1)) * 3;
+                    i0 = gridIndex(row, col + 1);
+                    i1 = gridIndex(row - 1, col);
+                    i2 = gridIndex(row - 1, col + 1);
                     v0 = vec3(vertices_[i0], vertices_[i0 + 1], vertices_[i0 + 2]);
                     v1 = vec3(vertices_[i1], vertices_[i1 + 1], vertices_[i1 + 2]);
                     v2 = vec3(vertices_[i2], vertices_[i2 + 1], vertices_[i2 + 2]);
                 }
-                if (!crossDiscontinuity(v0, v1, v2, surrounding_grads, i % 2)) {
-                    if (!clip) { 
-                        pushVertex(v0, v1, v2, new_vertices);
-                        pushNormal(v0, v1, v2, normal_map);
-                        continue;
-                    }
-                    // Detect above range_
-                    bool v0_out, v1_out, v2_out;
-                    bool v0_out_above = v0.z > 10.0f;
-                    bool v1_out_above = v1.z > 10.0f;
-                    bool v2_out_above = v2.z > 10.0f;
-    
-                    bool v0_out_below = v0.z < -10.0f;
-                    bool v1_out_below = v1.z < -10.0f;
-                    bool v2_out_below = v2.z < -10.0f;
-                    
-                    int out_above = v0_out_above + v1_out_above + v2_out_above;
-                    int out_below = v0_out_below + v1_out_below + v2_out_below;
-                    int out = out_above + out_below > 2 ? 3 : std::max(out_above, out_below);
-                    if (out_above >= out_below) {
-                        bound = 10.0f;
-                        v0_out = v0_out_above;
-                        v1_out = v1_out_above;
-                        v2_out = v2_out_above;
-                    } else {
-                        bound = -10.0f;
-                        v0_out = v0_out_below;
-                        v1_out = v1_out_below;
-                        v2_out = v2_out_below;
-                    }
-                    if (out == 2 || out_above + out_below == 2) {
-                        if (v0_out_above && v1_out_below) {
-                            vec3 v3 = v2.lerp(v0, (bound - v2.z)/(v0.z - v2.z));
-                            vec3 v4 = v2.lerp(v1, (-bound - v2.z)/(v1.z - v2.z));
-    
-                            pushVertex(v3, v4, v2, new_vertices);
-                            pushNormal(v3, v4, v2, normal_map);
-                        } else if (v0_out_above && v2_out_below) {
-                            vec3 v3 = v1.lerp(v0, (bound - v1.z)/(v0.z - v1.z));
-                            vec3 v4 = v1.lerp(v2, (-bound - v1.z)/(v2.z - v1.z));
-    
-                            pushVertex(v3, v1, v4, new_vertices);
-                            pushNormal(v3, v1, v4, normal_map);
-                        } else if (v0_out_below && v1_out_above) {
-                            vec3 v3 = v2.lerp(v0, (-bound - v2.z)/(v0.z - v2.z));
-                            vec3 v4 = v2.lerp(v1, (bound - v2.z)/(v1.z - v2.z));
-    
-                            pushVertex(v3, v4, v2, new_vertices);
-                            pushNormal(v3, v4, v2, normal_map);
-                        } else if (v0_out_below && v2_out_above) {
-                            vec3 v3 = v1.lerp(v0, (-bound - v1.z)/(v0.z - v1.z));
-                            vec3 v4 = v1.lerp(v2, (bound - v1.z)/(v2.z - v1.z));
-    
-                            pushVertex(v3, v1, v4, new_vertices);
-                            pushNormal(v3, v1, v4, normal_map);
-                        } else if (v1_out_above && v2_out_below) {
-                            vec3 v3 = v0.lerp(v1, (bound - v0.z)/(v1.z - v0.z));
-                            vec3 v4 = v0.lerp(v2, (-bound - v0.z)/(v2.z - v0.z));
-    
-                            pushVertex(v0, v3, v4, new_vertices);
-                            pushNormal(v0, v3, v4, normal_map);
-                        } else if (v1_out_below && v2_out_above) {
-                            vec3 v3 = v0.lerp(v1, (-bound - v0.z)/(v1.z - v0.z));
-                            vec3 v4 = v0.lerp(v2, (bound - v0.z)/(v2.z - v0.z));
-    
-                            pushVertex(v0, v3, v4, new_vertices);
-                            pushNormal(v0, v3, v4, normal_map);
-                        } else if (v0_out && v1_out) {
-                            vec3 v3 = v2.lerp(v0, (bound - v2.z)/(v0.z - v2.z));
-                            vec3 v4 = v2.lerp(v1, (bound - v2.z)/(v1.z - v2.z));
-    
-                            pushVertex(v3, v4, v2, new_vertices);
-                            pushNormal(v3, v4, v2, normal_map);
-                        } else if (v0_out && v2_out) {
-                            vec3 v3 = v1.lerp(v0, (bound - v1.z)/(v0.z - v1.z));
-                            vec3 v4 = v1.lerp(v2, (bound - v1.z)/(v2.z - v1.z));
-    
-                            pushVertex(v3, v1, v4, new_vertices);
-                            pushNormal(v3, v1, v4, normal_map);
-                        } else {
-                            vec3 v3 = v0.lerp(v1, (bound - v0.z)/(v1.z - v0.z));
-                            vec3 v4 = v0.lerp(v2, (bound - v0.z)/(v2.z - v0.z));
-    
-                            pushVertex(v0, v3, v4, new_vertices);
-                            pushNormal(v0, v3, v4, normal_map);
-                        }
-                    } else if (out == 1) {
-                        if (v0_out) {
-                            vec3 v3 = v1.lerp(v0, (bound - v1.z)/(v0.z - v1.z));
-                            vec3 v4 = v2.lerp(v0, (bound - v2.z)/(v0.z - v2.z));
-    
-                            pushVertex(v3, v1, v4, new_vertices);
-                            pushVertex(v4, v1, v2, new_vertices);
-                            pushNormal(v3, v1, v4, normal_map);
-                            pushNormal(v4, v1, v2, normal_map);
-                        } else if (v1_out) {
-                            vec3 v3 = v0.lerp(v1, (bound - v0.z)/(v1.z - v0.z));
-                            vec3 v4 = v2.lerp(v1, (bound - v2.z)/(v1.z - v2.z));
-    
-                            pushVertex(v0, v3, v2, new_vertices);
-                            pushVertex(v2, v3, v4, new_vertices);
-                            pushNormal(v0, v3, v2, normal_map);
-                            pushNormal(v2, v3, v4, normal_map);
-                        } else {
-                            vec3 v3 = v0.lerp(v2, (bound - v0.z)/(v2.z - v0.z));
-                            vec3 v4 = v1.lerp(v2, (bound - v1.z)/(v2.z - v1.z));
-    
-                            pushVertex(v0, v1, v3, new_vertices);
-                            pushVertex(v3, v1, v4, new_vertices);
-                            pushNormal(v0, v1, v3, normal_map);
-                            pushNormal(v3, v1, v4, normal_map);
-                        }
-                    } else if (out == 0) {
-                        pushVertex(v0, v1, v2, new_vertices);
-                        pushNormal(v0, v1, v2, normal_map);
-                    }
+                if (singular_ && refineTriangle(row, col, i, clip, true)) continue;
+                if (crossDiscontinuity(v0, v1, v2, surrounding_grads, i % 2)) {
+                    discontinuities_++;
+                    if (!rejected_.empty()) rejected_[static_cast<size_t>(row - 1) * (cols_ - 1) + col] |= 1 << i;
+                } else {
+                    clipTriangle(v0, v1, v2, clip);
                 }
             }
         }
     }
-    for (size_t i = 0; i < new_vertices.size(); i += 3) {
-        vec3 v(new_vertices[i], new_vertices[i + 1], new_vertices[i + 2]);
-        vec3 normal = normal_map[v].normalize();
-        normals_.push_back(normal.x);
-        normals_.push_back(normal.y);
-        normals_.push_back(normal.z);
+}
+
+/*
+    Where the segment from a to b crosses height bound. Interpolated, unless
+    the surface has singular sets and f is more than CLIP_TOLERANCE off bound
+    at the interpolated point: f is steep next to a pole, so the crossing is
+    then found on f itself by bisection, from the lower end so that both
+    triangles sharing an edge get the same point.
+*/
+vec3 Geometry::clipPoint(vec3 a, vec3 b, float bound) {
+    if (!singular_) return a.lerp(b, (bound - a.z)/(b.z - a.z));
+    if (std::tie(b.x, b.y) < std::tie(a.x, a.y)) std::swap(a, b);
+    vec3 interpolated = a.lerp(b, (bound - a.z)/(b.z - a.z));
+    auto input = [](double v) { return std::abs(v) < 1e-6 ? 0.0f : static_cast<float>(v); };
+    // Back from view to world coordinates, see viewPoint
+    double scale = range_ / 10.0;
+    float x = input((interpolated.x + 10) * scale - range_ + center_x_);
+    float y = input((interpolated.y + 10) * scale - range_ + center_y_);
+    float z;
+    singular_->surface(&x, &y, &z, 1, scratch_);
+    if (std::abs(viewPoint(0.0, 0.0, z).z - bound) < CLIP_TOLERANCE) return interpolated;
+
+    double x0 = (a.x + 10) * scale - range_ + center_x_, y0 = (a.y + 10) * scale - range_ + center_y_;
+    double dx = (b.x - a.x) * scale, dy = (b.y - a.y) * scale;
+    bool above = a.z > bound;
+    double lo = 0.0, hi = 1.0;
+    for (int k = 0; k < CROSSING_STEPS; k++) {
+        double t = 0.5 * (lo + hi);
+        x = input(x0 + dx * t);
+        y = input(y0 + dy * t);
+        singular_->surface(&x, &y, &z, 1, scratch_);
+        z = viewPoint(0.0, 0.0, z).z;
+        if (!std::isfinite(z)) return interpolated;
+        if ((z > bound) == above) lo = t;
+        else hi = t;
     }
-    tempVertices_.insert(tempVertices_.end(), new_vertices.begin(), new_vertices.end());
+    double t = 0.5 * (lo + hi);
+    return vec3(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, bound);
 }
 
-bool Geometry::crossDiscontinuity(vec3 v0, vec3 v1, vec3 v2, std::vector<vec3> surrounding_grads, bool odd) {
-    if (!v0.isfinite() || !v1.isfinite() || !v2.isfinite()) {
-        std::cerr << "[crossDiscontinuity] Non-finite triangle vertex\n";
-        return true;
+// Pushes the part of a triangle inside the view box, or all of it when not clipping
+void Geometry::clipTriangle(vec3 v0, vec3 v1, vec3 v2, bool clip) {
+    std::vector<float>& new_vertices = mesh_.vertices_;
+    std::unordered_map<vec3, vec3, vec3::Vec3Hash>& normal_map = normal_map_;
+    float bound = 10.0f;
+    if (!clip) {
+        pushVertex(v0, v1, v2, new_vertices);
+        pushNormal(v0, v1, v2, normal_map);
+        return;
     }
+    // Detect above range_
+    bool v0_out, v1_out, v2_out;
+    bool v0_out_above = v0.z > 10.0f;
+    bool v1_out_above = v1.z > 10.0f;
+    bool v2_out_above = v2.z > 10.0f;
 
-    vec3 grad = computeGradient(v0, v1, v2, odd);
-    if (!grad.isfinite()) {
-        std::cerr << "[crossDiscontinuity] Non-finite gradient computed\n";
+    bool v0_out_below = v0.z < -10.0f;
+    bool v1_out_below = v1.z < -10.0f;
+    bool v2_out_below = v2.z < -10.0f;
+
+    int out_above = v0_out_above + v1_out_above + v2_out_above;
+    int out_below = v0_out_below + v1_out_below + v2_out_below;
+    int out = out_above + out_below > 2 ? 3 : std::max(out_above, out_below);
+    if (out_above >= out_below) {
+        bound = 10.0f;
+        v0_out = v0_out_above;
+        v1_out = v1_out_above;
+        v2_out = v2_out_above;
+    } else {
+        bound = -10.0f;
+        v0_out = v0_out_below;
+        v1_out = v1_out_below;
+        v2_out = v2_out_below;
+    }
+    if (out == 2 || out_above + out_below == 2) {
+        if (v0_out_above && v1_out_below) {
+            vec3 v3 = clipPoint(v2, v0, bound);
+            vec3 v4 = clipPoint(v2, v1, -bound);
+
+            pushVertex(v3, v4, v2, new_vertices);
+            pushNormal(v3, v4, v2, normal_map);
+        } else if (v0_out_above && v2_out_below) {
+            vec3 v3 = clipPoint(v1, v0, bound);
+            vec3 v4 = clipPoint(v1, v2, -bound);
+
+            pushVertex(v3, v1, v4, new_vertices);
+            pushNormal(v3, v1, v4, normal_map);
+        } else if (v0_out_below && v1_out_above) {
+            vec3 v3 = clipPoint(v2, v0, -bound);
+            vec3 v4 = clipPoint(v2, v1, bound);
+
+            pushVertex(v3, v4, v2, new_vertices);
+            pushNormal(v3, v4, v2, normal_map);
+        } else if (v0_out_below && v2_out_above) {
+            vec3 v3 = clipPoint(v1, v0, -bound);
+            vec3 v4 = clipPoint(v1, v2, bound);
+
+            pushVertex(v3, v1, v4, new_vertices);
+            pushNormal(v3, v1, v4, normal_map);
+        } else if (v1_out_above && v2_out_below) {
+            vec3 v3 = clipPoint(v0, v1, bound);
+            vec3 v4 = clipPoint(v0, v2, -bound);
+
+            pushVertex(v0, v3, v4, new_vertices);
+            pushNormal(v0, v3, v4, normal_map);
+        } else if (v1_out_below && v2_out_above) {
+            vec3 v3 = clipPoint(v0, v1, -bound);
+            vec3 v4 = clipPoint(v0, v2, bound);
+
+            pushVertex(v0, v3, v4, new_vertices);
+            pushNormal(v0, v3, v4, normal_map);
+        } else if (v0_out && v1_out) {
+            vec3 v3 = clipPoint(v2, v0, bound);
+            vec3 v4 = clipPoint(v2, v1, bound);
+
+            pushVertex(v3, v4, v2, new_vertices);
+            pushNormal(v3, v4, v2, normal_map);
+        } else if (v0_out && v2_out) {
+            vec3 v3 = clipPoint(v1, v0, bound);
+            vec3 v4 = clipPoint(v1, v2, bound);
+
+            pushVertex(v3, v1, v4, new_vertices);
+            pushNormal(v3, v1, v4, normal_map);
+        } else {
+            vec3 v3 = clipPoint(v0, v1, bound);
+            vec3 v4 = clipPoint(v0, v2, bound);
+
+            pushVertex(v0, v3, v4, new_vertices);
+            pushNormal(v0, v3, v4, normal_map);
+        }
+    } else if (out == 1) {
+        if (v0_out) {
+            vec3 v3 = clipPoint(v1, v0, bound);
+            vec3 v4 = clipPoint(v2, v0, bound);
+
+            pushVertex(v3, v1, v4, new_vertices);
+            pushVertex(v4, v1, v2, new_vertices);
+            pushNormal(v3, v1, v4, normal_map);
+            pushNormal(v4, v1, v2, normal_map);
+        } else if (v1_out) {
+            vec3 v3 = clipPoint(v0, v1, bound);
+            vec3 v4 = clipPoint(v2, v1, bound);
+
+            pushVertex(v0, v3, v2, new_vertices);
+            pushVertex(v2, v3, v4, new_vertices);
+            pushNormal(v0, v3, v2, normal_map);
+            pushNormal(v2, v3, v4, normal_map);
+        } else {
+            vec3 v3 = clipPoint(v0, v2, bound);
+            vec3 v4 = clipPoint(v1, v2, bound);
+
+            pushVertex(v0, v1, v3, new_vertices);
+            pushVertex(v3, v1, v4, new_vertices);
+            pushNormal(v0, v1, v3, normal_map);
+            pushNormal(v3, v1, v4, normal_map);
+        }
+    } else if (out == 0) {
+        pushVertex(v0, v1, v2, new_vertices);
+        pushNormal(v0, v1, v2, normal_map);
+    }
+}
+
+// Sign bits of every singular set at the grid rows in vertices_, split across threads like runRows
+void Geometry::sampleSigns() {
+    const int cols = cols_;
+    const int rows = static_cast<int>(vertices_.size() / (3 * static_cast<size_t>(cols)));
+    signs_.resize(static_cast<size_t>(rows) * cols);
+    auto band = [&](int band_lo, int band_hi) {
+        // truncate small decimals like sample does
+        const float epsilon = 1e-6;
+        std::vector<float> xs(BATCH_SAMPLES), ys(BATCH_SAMPLES), scratch;
+        for (int i = band_lo; i < band_hi; i++) {
+            if (cancel_ && cancel_->cancelled()) return;
+            double y = ys_[row0_ + i];
+            for (int j0 = 0; j0 < cols; j0 += BATCH_SAMPLES) {
+                int count = std::min(BATCH_SAMPLES, cols - j0);
+                for (int j = 0; j < count; j++) {
+                    xs[j] = std::abs(xs_[j0 + j]) < epsilon ? 0.0f : static_cast<float>(xs_[j0 + j]);
+                    ys[j] = std::abs(y) < epsilon ? 0.0f : static_cast<float>(y);
+                }
+                singular_->signs(xs.data(), ys.data(), signs_.data() + static_cast<size_t>(i) * cols + j0, count, scratch);
+            }
+        }
+    };
+    int threads = std::max(1, std::min<int>(std::thread::hardware_concurrency(), rows / 2));
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back(band, rows * t / threads, rows * (t + 1) / threads);
+    }
+    for (std::thread& worker : workers) worker.join();
+    checkCancelled();
+}
+
+/*
+    Bisects the grid edge from (r0, c0) to (r1, c1) down to where singular set
+    `set` stops having the sign it has at (r0, c0), then checks f around the
+    bracket against f one bracket width further out on each side. A pole is
+    confirmed when f's change across the bracket is not much smaller than
+    across the wider interval, as it would be for a continuous f, so removable
+    zeros such as the one of \frac{\sin(x)}{x} are not taken for poles. When
+    the set runs through a grid point, where f is undefined, f has to grow
+    towards it instead. A domain edge is confirmed when f is defined on its
+    g > 0 side only. Callers order the ends by grid index, so the two
+    triangles sharing an edge get the same bracket.
+*/
+Geometry::Crossing Geometry::crossEdge(size_t set, int r0, int c0, int r1, int c1) {
+    uint64_t key = edgeKey(set, r0, c0, r1, c1);
+    auto found = crossings_.find(key);
+    if (found != crossings_.end()) return found->second;
+    // truncate small decimals like sample does
+    auto input = [](double v) { return std::abs(v) < 1e-6 ? 0.0f : static_cast<float>(v); };
+    double x0 = xs_[c0], y0 = ys_[r0], dx = xs_[c1] - x0, dy = ys_[r1] - y0;
+    int start = side(set, r0, c0);
+    double lo = 0.0, hi = 1.0;
+    for (int k = 0; k < CROSSING_STEPS; k++) {
+        double t = 0.5 * (lo + hi);
+        float x = input(x0 + dx * t), y = input(y0 + dy * t);
+        // Past float precision the bracket cannot shrink any further
+        if ((x == input(x0 + dx * lo) && y == input(y0 + dy * lo)) || (x == input(x0 + dx * hi) && y == input(y0 + dy * hi))) break;
+        float g = singular_->indicator(set, x, y, scratch_);
+        if ((g > 0) - (g < 0) == start) lo = t;
+        else hi = t;
+    }
+    double width = hi - lo;
+    double ts[4] = {lo, hi, std::max(0.0, lo - width), std::min(1.0, hi + width)};
+    float xs[4], ys[4], zs[4];
+    for (int k = 0; k < 4; k++) {
+        xs[k] = input(x0 + dx * ts[k]);
+        ys[k] = input(y0 + dy * ts[k]);
+    }
+    singular_->surface(xs, ys, zs, 4, scratch_);
+    Crossing crossing{lo, hi, false};
+    if (singular_->kind(set) == Singularities::Kind::POLE) {
+        if (std::isfinite(zs[0]) && std::isfinite(zs[1])) {
+            float jump = std::abs(zs[1] - zs[0]), wider = std::abs(zs[3] - zs[2]);
+            crossing.confirmed_ = std::isfinite(wider) && jump > 0.6f * wider && jump > 1e-4f * range_;
+        } else if (std::isfinite(zs[0]) != std::isfinite(zs[1])) {
+            int near = std::isfinite(zs[0]) ? 0 : 1;
+            crossing.confirmed_ = std::abs(zs[near]) > 1.25f * std::abs(zs[near + 2]);
+        }
+    } else {
+        int end = side(set, r1, c1);
+        if (start > 0 || end > 0) {
+            float inside = start > 0 ? zs[0] : zs[1], outside = start > 0 ? zs[1] : zs[0];
+            crossing.confirmed_ = std::isfinite(inside) && !std::isfinite(outside);
+        }
+    }
+    crossings_[key] = crossing;
+    return crossing;
+}
+
+/*
+    Vertices from grid corner (row, col) along its edge to (other_row,
+    other_col) up to crossing: the corner, REFINE_POINTS points each 4 times
+    closer to the singular set than the last, and the end of the bracket on
+    the corner's side. When clipping, a chain that leaves the view box ends
+    where it does, found by bisection, so the wall of a pole is placed where f
+    actually reaches the box rather than where a grid sample happened to.
+    Parameters are from the edge's lower grid index end, like crossEdge's.
+*/
+std::vector<Geometry::ChainPoint> Geometry::chain(size_t set, const Crossing& crossing, int row, int col, int other_row,
+                                                  int other_col, bool clip) {
+    uint64_t key = edgeKey(set, row, col, other_row, other_col);
+    auto found = chains_.find(key);
+    if (found != chains_.end()) return found->second;
+    auto input = [](double v) { return std::abs(v) < 1e-6 ? 0.0f : static_cast<float>(v); };
+    bool flip = gridIndex(row, col) > gridIndex(other_row, other_col);
+    int r0 = flip ? other_row : row, c0 = flip ? other_col : col;
+    int r1 = flip ? row : other_row, c1 = flip ? col : other_col;
+    double x0 = xs_[c0], y0 = ys_[r0], dx = xs_[c1] - x0, dy = ys_[r1] - y0;
+    double start = flip ? 1.0 : 0.0, end = flip ? crossing.hi_ : crossing.lo_;
+
+    double ts[REFINE_POINTS + 1];
+    float ss[REFINE_POINTS + 1], xs[REFINE_POINTS + 1], ys[REFINE_POINTS + 1], zs[REFINE_POINTS + 1];
+    for (int k = 0; k <= REFINE_POINTS; k++) {
+        ss[k] = k == REFINE_POINTS ? 1.0f : 1.0f - std::ldexp(1.0f, -2 * (k + 1));
+        ts[k] = start + (end - start) * ss[k];
+        xs[k] = input(x0 + dx * ts[k]);
+        ys[k] = input(y0 + dy * ts[k]);
+    }
+    singular_->surface(xs, ys, zs, REFINE_POINTS + 1, scratch_);
+
+    size_t corner = gridIndex(row, col);
+    std::vector<ChainPoint> points{{vec3(vertices_[corner], vertices_[corner + 1], vertices_[corner + 2]), 0.0f}};
+    double t_inside = start;
+    float s_inside = 0.0f;
+    for (int k = 0; k <= REFINE_POINTS; k++) {
+        vec3 v = viewPoint(x0 + dx * ts[k], y0 + dy * ts[k], zs[k]);
+        bool inside = std::abs(points.back().v_.z) <= 10.0f;
+        if (!clip || !inside || std::abs(v.z) <= 10.0f || !std::isfinite(v.z)) {
+            points.push_back({v, ss[k]});
+            t_inside = ts[k];
+            s_inside = ss[k];
+            continue;
+        }
+        // Narrow the step that leaves the box, ending on its outer side so clipping cuts a short segment
+        double t_lo = t_inside, t_hi = ts[k];
+        float s_lo = s_inside, s_hi = ss[k];
+        for (int step = 0; step < CROSSING_STEPS; step++) {
+            double t = 0.5 * (t_lo + t_hi);
+            float x = input(x0 + dx * t), y = input(y0 + dy * t), z;
+            singular_->surface(&x, &y, &z, 1, scratch_);
+            if (std::abs(viewPoint(x0 + dx * t, y0 + dy * t, z).z) > 10.0f) {
+                t_hi = t;
+                s_hi = 0.5f * (s_lo + s_hi);
+            } else {
+                t_lo = t;
+                s_lo = 0.5f * (s_lo + s_hi);
+            }
+        }
+        float x = input(x0 + dx * t_hi), y = input(y0 + dy * t_hi), z;
+        singular_->surface(&x, &y, &z, 1, scratch_);
+        points.push_back({viewPoint(x0 + dx * t_hi, y0 + dy * t_hi, z), s_hi});
+        break;
+    }
+    chains_[key] = points;
+    return points;
+}
+
+/*
+    Handles triangle i of the quad at (row, col) if its corners are on
+    different sides of a singular set and crossEdge confirms the set on one of
+    its edges. Other triangles are left to crossDiscontinuity. When refine is
+    set the triangle is replaced, on each side of the set that is kept, by the
+    strip between the chains from that side's corners towards the others:
+    both sides of a pole, the g > 0 side of a domain edge. Only the bracket
+    around the set itself stays empty. Both triangles sharing an edge build
+    the same chain along it, so the pieces meet without cracks. Poles are
+    dropped rather than refined when not clipping, as f grows without bound
+    next to them.
+*/
+bool Geometry::refineTriangle(int row, int col, int i, bool clip, bool refine) {
+    const int corners[3][2] = {{row, i == 0 ? col : col + 1}, {row - 1, col}, {i == 0 ? row : row - 1, col + 1}};
+    uint64_t bits[3];
+    for (int k = 0; k < 3; k++) bits[k] = signs_[signIndex(corners[k][0], corners[k][1])];
+    uint64_t differ = (bits[0] ^ bits[1]) | (bits[0] ^ bits[2]);
+    uint32_t crossed = static_cast<uint32_t>(differ | differ >> 32);
+    for (size_t set = 0; set < singular_->count(); set++) {
+        if (!(crossed >> set & 1)) continue;
+        int sides[3];
+        for (int k = 0; k < 3; k++) sides[k] = side(set, corners[k][0], corners[k][1]);
+        // Edge k joins corners k and k + 1, crossed where their sides differ
+        Crossing edges[3];
+        bool confirmed = false;
+        for (int k = 0; k < 3; k++) {
+            const int* a = corners[k];
+            const int* b = corners[(k + 1) % 3];
+            if (sides[k] == sides[(k + 1) % 3]) continue;
+            if (gridIndex(a[0], a[1]) > gridIndex(b[0], b[1])) std::swap(a, b);
+            edges[k] = crossEdge(set, a[0], a[1], b[0], b[1]);
+            confirmed = confirmed || edges[k].confirmed_;
+        }
+        if (!confirmed) continue;
+
+        singular_triangles_++;
+        if (!rejected_.empty()) rejected_[static_cast<size_t>(row - 1) * (cols_ - 1) + col] |= 1 << i;
+        bool pole = singular_->kind(set) == Singularities::Kind::POLE;
+        if (!refine || (pole && !clip)) return true;
+
+        size_t i0 = gridIndex(corners[0][0], corners[0][1]);
+        size_t i1 = gridIndex(corners[1][0], corners[1][1]);
+        size_t i2 = gridIndex(corners[2][0], corners[2][1]);
+        float orientation = (vertices_[i1] - vertices_[i0]) * (vertices_[i2 + 1] - vertices_[i0 + 1]) -
+                            (vertices_[i1 + 1] - vertices_[i0 + 1]) * (vertices_[i2] - vertices_[i0]);
+        auto along = [&](int from, int to) {
+            const Crossing& crossing = edges[(from + 1) % 3 == to ? from : to];
+            return chain(set, crossing, corners[from][0], corners[from][1], corners[to][0], corners[to][1], clip);
+        };
+        for (int kept : {1, -1}) {
+            if (!pole && kept < 0) continue;
+            // Corners on this side, the corners on the set itself belong to neither
+            int own[3], others[3], owned = 0, other = 0;
+            for (int k = 0; k < 3; k++) {
+                if (sides[k] == kept) own[owned++] = k;
+                else others[other++] = k;
+            }
+            if (owned == 1) {
+                stitch(along(own[0], others[0]), along(own[0], others[1]), orientation, clip);
+            } else if (owned == 2) {
+                stitch(along(own[0], others[0]), along(own[1], others[0]), orientation, clip);
+            }
+        }
         return true;
     }
+    return false;
+}
+
+/*
+    Triangulates the strip between two chains by always advancing the one
+    whose next point is nearer its start, and clips each triangle. Chains
+    sharing their first point make a fan, the degenerate first triangle is
+    skipped. Triangles are flipped to the orientation of the grid triangle.
+*/
+void Geometry::stitch(const std::vector<ChainPoint>& p, const std::vector<ChainPoint>& q, float orientation, bool clip) {
+    size_t i = 0, j = 0;
+    while (i + 1 < p.size() || j + 1 < q.size()) {
+        vec3 v0 = p[i].v_, v1, v2 = q[j].v_;
+        if (j + 1 == q.size() || (i + 1 < p.size() && p[i + 1].s_ <= q[j + 1].s_)) {
+            v1 = p[++i].v_;
+        } else {
+            v1 = q[++j].v_;
+        }
+        float area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+        if (area == 0.0f || !v0.isfinite() || !v1.isfinite() || !v2.isfinite()) continue;
+        if ((area > 0) != (orientation > 0)) std::swap(v1, v2);
+        clipTriangle(v0, v1, v2, clip);
+    }
+}
+
+// Same triangles and checks as clipTriangles, recording the dropped ones without pushing any.
+// Triangles crossing a singular set are dropped as well, the renderer cannot refine them
+void Geometry::rejectTriangles(int minrow, int maxrow) {
+    for (int row = minrow; row < maxrow; row++) {
+        checkCancelled();
+        for (int col = 0; col < cols_ - 1; col++) {
+            std::vector<vec3> surrounding_grads = computeSurroundingGradients(row, col);
+            for (int i = 0; i < 2; i++) {
+                size_t i0 = i == 0 ? gridIndex(row, col) : gridIndex(row, col + 1);
+                size_t i1 = gridIndex(row - 1, col);
+                size_t i2 = i == 0 ? gridIndex(row, col + 1) : gridIndex(row - 1, col + 1);
+                vec3 v0(vertices_[i0], vertices_[i0 + 1], vertices_[i0 + 2]);
+                vec3 v1(vertices_[i1], vertices_[i1 + 1], vertices_[i1 + 2]);
+                vec3 v2(vertices_[i2], vertices_[i2 + 1], vertices_[i2 + 2]);
+                if (singular_ && refineTriangle(row, col, i, false, false)) continue;
+                if (crossDiscontinuity(v0, v1, v2, surrounding_grads, i % 2)) {
+                    discontinuities_++;
+                    rejected_[static_cast<size_t>(row - 1) * (cols_ - 1) + col] |= 1 << i;
+                }
+            }
+        }
+    }
+}
+
+// Normals of mesh's vertices from the triangles clipTriangles has pushed around them so far
+void Geometry::computeNormals(Mesh& mesh) {
+    size_t count = mesh.vertexCount();
+    mesh.resize(count);
+    for (size_t v = 0; v < count; v++) {
+        const float* position = mesh.position(v);
+        vec3 normal = normal_map_[vec3(position[0], position[1], position[2])].normalize();
+        float* out = mesh.normal(v);
+        out[0] = normal.x;
+        out[1] = normal.y;
+        out[2] = normal.z;
+    }
+}
+
+bool Geometry::crossDiscontinuity(vec3 v0, vec3 v1, vec3 v2, std::vector<vec3> surrounding_grads, bool odd) {
+    // Undefined corners and gradients count as discontinuities, see graphtex_discontinuity_rejections_total
+    if (!v0.isfinite() || !v1.isfinite() || !v2.isfinite()) return true;
+
+    vec3 grad = computeGradient(v0, v1, v2, odd);
+    if (!grad.isfinite()) return true;
 
     vec3 dir1 = vec3(1, 0, 0);
     vec3 dir2 = vec3(0, 1, 0);
@@ -302,9 +1071,9 @@ vec3 Geometry::computeGradient(vec3 v0, vec3 v1, vec3 v2, bool odd) {
 std::vector<vec3> Geometry::computeSurroundingGradients(int row, int col) {
     std::vector<vec3> grads;
     if (row > 1) {
-        int i0 = (step_ * (row - 1) + col) * 3;
-        int i1 = (step_ * (row - 2) + col) * 3;
-        int i2 = (step_ * (row - 1) + 1 + col) * 3;
+        size_t i0 = gridIndex(row - 1, col);
+        size_t i1 = gridIndex(row - 2, col);
+        size_t i2 = gridIndex(row - 1, 1 + col);
         vec3 v0(vertices_[i0], vertices_[i0 + 1], vertices_[i0 + 2]);
         vec3 v1(vertices_[i1], vertices_[i1 + 1], vertices_[i1 + 2]);
         vec3 v2(vertices_[i2], vertices_[i2 + 1], vertices_[i2 + 2]);
@@ -313,9 +1082,9 @@ std::vector<vec3> Geometry::computeSurroundingGradients(int row, int col) {
         grads.push_back(vec3(NAN,NAN,NAN));
     }
     if (col > 0) {
-        int i0 = (step_ * row + col) * 3;
-        int i1 = (step_ * (row - 1) + col - 1) * 3;
-        int i2 = (step_ * (row - 1) + col) * 3;
+        size_t i0 = gridIndex(row, col);
+        size_t i1 = gridIndex(row - 1, col - 1);
+        size_t i2 = gridIndex(row - 1, col);
         vec3 v0(vertices_[i0], vertices_[i0 + 1], vertices_[i0 + 2]);
         vec3 v1(vertices_[i1], vertices_[i1 + 1], vertices_[i1 + 2]);
         vec3 v2(vertices_[i2], vertices_[i2 + 1], vertices_[i2 + 2]);
@@ -323,10 +1092,10 @@ std::vector<vec3> Geometry::computeSurroundingGradients(int row, int col) {
     } else {
         grads.push_back(vec3(NAN,NAN,NAN));
     }
-    if (row < step_ - 1) {
-        int i0 = (step_ * (row + 1) + 1 + col) * 3;
-        int i1 = (step_ * row + col) * 3;
-        int i2 = (step_ * row + 1 + col) * 3;
+    if (row < rows_ - 1) {
+        size_t i0 = gridIndex(row + 1, 1 + col);
+        size_t i1 = gridIndex(row, col);
+        size_t i2 = gridIndex(row, 1 + col);
         vec3 v0(vertices_[i0], vertices_[i0 + 1], vertices_[i0 + 2]);
         vec3 v1(vertices_[i1], vertices_[i1 + 1], vertices_[i1 + 2]);
         vec3 v2(vertices_[i2], vertices_[i2 + 1], vertices_[i2 + 2]);
@@ -334,10 +1103,11 @@ std::vector<vec3> Geometry::computeSurroundingGradients(int row, int col) {
     } else {
         grads.push_back(vec3(NAN,NAN,NAN));
     }
-    if (col < step_ - 1) {
-        int i0 = (step_ * row + 1 + col) * 3;
-        int i1 = (step_ * (row - 1) + 1 + col) * 3;
-        int i2 = (step_ * row + 2 + col) * 3;
+    // col + 2 has to stay inside the row
+    if (col < cols_ - 2) {
+        size_t i0 = gridIndex(row, 1 + col);
+        size_t i1 = gridIndex(row - 1, 1 + col);
+        size_t i2 = gridIndex(row, 2 + col);
         vec3 v0(vertices_[i0], vertices_[i0 + 1], vertices_[i0 + 2]);
         vec3 v1(vertices_[i1], vertices_[i1 + 1], vertices_[i1 + 2]);
         vec3 v2(vertices_[i2], vertices_[i2 + 1], vertices_[i2 + 2]);
@@ -358,7 +1128,12 @@ std::vector<vec3> Geometry::computeSurroundingGradients(int row, int col) {
 }
 
 void Geometry::pushVertex(vec3 v0, vec3 v1, vec3 v2, std::vector<float>& verts) {
-    verts.insert(verts.end(), {v0.x, v0.y, v0.z, v1.x, v1.y, v1.z, v2.x, v2.y, v2.z});
+    if (mesh_.interleaved_) {
+        // Normals are filled in once every triangle around the vertex is known
+        verts.insert(verts.end(), {v0.x, v0.y, v0.z, 0, 0, 0, v1.x, v1.y, v1.z, 0, 0, 0, v2.x, v2.y, v2.z, 0, 0, 0});
+    } else {
+        verts.insert(verts.end(), {v0.x, v0.y, v0.z, v1.x, v1.y, v1.z, v2.x, v2.y, v2.z});
+    }
 };
 
 // Accumlate normals for triangles that share vertices
@@ -1,36 +1,173 @@
+#pragma once
 #include "InTeX/ast.hpp"
 #include "InTeX/lexer.hpp"
 #include "InTeX/parser.hpp"
 #include "InTeX/evaluator.hpp"
 #include "vec3.hpp"
-#include <QDebug>
+#include "tilecache.hpp"
+#include "mesh.hpp"
+#include "cancel.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include "InTeX/compiler.hpp"
+#include "singularities.hpp"
 #include <chrono>
 #include <iostream>
 #include <thread>
 #include <cstdint>
+#include <functional>
+#include <unordered_map>
 #include <algorithm>
+#include <memory>
 #include <mutex>
 #include <vector>
 
+// Grid rows per block of triangles that can be resent on its own
+constexpr int BLOCK_ROWS = 32;
+// Samples per program run in Geometry::sampleBatch
+constexpr int BATCH_SAMPLES = 256;
+// Rows of quads per band in Geometry::stream
+constexpr int STREAM_ROWS = 32;
+// Halvings of a grid edge when locating where it crosses a singular set
+constexpr int CROSSING_STEPS = 12;
+// Points added between a corner and a singular set, each 4 times closer to the set than the last
+constexpr int REFINE_POINTS = 3;
+// Largest error of an interpolated clip point, in view units, before Geometry::clipPoint finds it on f
+constexpr float CLIP_TOLERANCE = 0.05f;
+
 class Geometry {
 private:
-    Evaluator* evaluator_;
+    const Evaluator* evaluator_;
+    TileCache* cache_;
+    const CancelToken* cancel_;
     int step_;
     int range_;
+    double center_x_;
+    double center_y_;
+    int rows_;
+    int cols_;
+    int level_;
+    Lattice lattice_;
     double step_size_;
     std::mutex mutex_;
+    // Tallies for Metrics, added once the mesh is done
+    uint64_t samples_ = 0;
+    uint64_t nan_samples_ = 0;
+    uint64_t discontinuities_ = 0;
+    // Sampled grid, 3 floats per point row by row from row0_, released once triangulated
+    std::vector<float> vertices_;
+    int row0_ = 0;
+    // Sum of the normals of the triangles around each position
+    std::unordered_map<vec3, vec3, vec3::Vec3Hash> normal_map_;
+    // Triangles crossDiscontinuity dropped, bit i for triangle i of each quad, row by row from grid row 0.
+    // Only kept for contours, picking and heightfields
+    std::vector<uint8_t> rejected_;
+    // World coordinates of each row/column and their lattice index, OFF_LATTICE at window edges
+    std::vector<double> xs_, ys_;
+    std::vector<long long> gxs_, gys_;
+    // Singular sets of the surface, if known, and their sign bits at each grid point, row by row from row0_
+    const Singularities* singular_ = nullptr;
+    std::vector<uint64_t> signs_;
+    std::vector<float> scratch_;
+    uint64_t singular_triangles_ = 0;
 
+    // Bracket [lo_, hi_] around where a grid edge crosses a singular set, as parameters from its lower grid index
+    struct Crossing {
+        double lo_;
+        double hi_;
+        bool confirmed_;
+    };
+    // A vertex of a refined triangle, s_ from 0 at its grid corner to 1 next to the singular set
+    struct ChainPoint {
+        vec3 v_;
+        float s_;
+    };
+    // Crossings and chains already built, the two triangles sharing an edge both need them, see edgeKey
+    std::unordered_map<uint64_t, Crossing> crossings_;
+    std::unordered_map<uint64_t, std::vector<ChainPoint>> chains_;
+
+    void sampleAxis(double min, double max, double origin, std::vector<double>& coords, std::vector<long long>& indices);
+    float sample(Evaluator* localeval, double x, double y);
+    void seedTile(Tile& tile, const TileKey& key);
+    void fillTiles(Evaluator* localeval, long long gx_lo, long long gx_hi, long long gy_lo, long long gy_hi,
+                   std::vector<std::shared_ptr<const Tile>>& tiles);
+    // Layout only, for sampleBatch
+    Geometry() : evaluator_(nullptr), cache_(nullptr), cancel_(nullptr) {}
+    void layout(int step, int range, double center_x, double center_y, bool nested);
+    void checkCancelled();
+    void runRows(const Program* program, int row_lo, int row_hi, const std::function<float*(size_t, int)>& row_output) const;
+    size_t gridIndex(int row, int col) const { return 3 * (static_cast<size_t>(row - row0_) * cols_ + col); }
+    void setVertex(int i, int j, float z);
+    vec3 viewPoint(double x, double y, float z) const;
+    vec3 clipPoint(vec3 a, vec3 b, float bound);
+    int side(size_t set, int row, int col) const {
+        uint64_t bits = signs_[signIndex(row, col)];
+        return static_cast<int>(bits >> set & 1) - static_cast<int>(bits >> (32 + set) & 1);
+    }
+    void sampleSigns();
+    size_t signIndex(int row, int col) const { return static_cast<size_t>(row - row0_) * cols_ + col; }
+    // One key per set and direction of each grid edge, from grid point (row, col) towards its neighbour
+    uint64_t edgeKey(size_t set, int row, int col, int other_row, int other_col) const {
+        uint64_t point = static_cast<uint64_t>(row) * cols_ + col;
+        return (point * 9 + (other_row - row + 1) * 3 + (other_col - col + 1)) * MAX_SINGULAR_SETS + set;
+    }
+    Crossing crossEdge(size_t set, int r0, int c0, int r1, int c1);
+    std::vector<ChainPoint> chain(size_t set, const Crossing& crossing, int row, int col, int other_row, int other_col,
+                                  bool clip);
+    bool refineTriangle(int row, int col, int i, bool clip, bool refine);
+    void stitch(const std::vector<ChainPoint>& p, const std::vector<ChainPoint>& q, float orientation, bool clip);
+    void triangulate(bool clip, int contour_levels, bool pickable, bool heightfield);
     void generateVertices(int minrow, int maxrow);
     void clipTriangles(int minrow, int maxrow, bool clip);
+    void clipTriangle(vec3 v0, vec3 v1, vec3 v2, bool clip);
+    // Only fills rejected_, for heightfields the renderer triangulates and clips itself
+    void rejectTriangles(int minrow, int maxrow);
+    void computeNormals(Mesh& mesh);
     bool crossDiscontinuity(vec3 v0, vec3 v1, vec3 v2, std::vector<vec3> surrounding_grads, bool odd);
     vec3 computeGradient(vec3 v0, vec3 v1, vec3 v2, bool odd);
     std::vector<vec3> computeSurroundingGradients(int row, int col);
     void pushVertex(vec3 v0, vec3 v1, vec3 v2, std::vector<float>& verts);
     void pushNormal(vec3 v0, vec3 v1, vec3 v2, std::unordered_map<vec3, vec3, vec3::Vec3Hash>& normal_map);
 public:
-    std::vector<float> tempVertices_;
-    std::vector<float> vertices_;
-    std::vector<float> normals_;
-    explicit Geometry(Evaluator* evaluator, int step, int range, bool clip);
-    ~Geometry() {}
+    // Triangle soup with a block starting every BLOCK_ROWS rows of quads, moved out by the caller.
+    // Interleaved when asked for, so it can go to a vertex buffer as is. Carries contour_levels
+    // contour lines traced over the grid, none by default, and the grid as a HeightField when pickable.
+    // A heightfield mesh only keeps the grid and the triangles crossDiscontinuity drops, see Mesh::grid_.
+    // Triangles crossing one of singularities' sets are refined around it instead, see refineTriangle
+    Mesh mesh_;
+    static constexpr long long OFF_LATTICE = INT64_MIN;
+    explicit Geometry(const Evaluator* evaluator, TileCache* cache, int step, int range,
+                      double center_x, double center_y, bool clip, bool nested = false,
+                      const CancelToken* cancel = nullptr, bool interleaved = false, int contour_levels = 0,
+                      bool pickable = false, bool heightfield = false, const Singularities* singularities = nullptr);
+    // Triangulates heights already sampled on this view's grid, row by row, see sampleBatch
+    explicit Geometry(const std::vector<float>& heights, int step, int range, double center_x, double center_y,
+                      bool clip, bool nested = false, const CancelToken* cancel = nullptr, bool interleaved = false,
+                      int contour_levels = 0, bool pickable = false, bool heightfield = false,
+                      const Singularities* singularities = nullptr);
+    ~Geometry() { BufferPool::recycle(vertices_); }
+    /*
+        Samples every output of program, with inputs x and y, on the grid a
+        Geometry with the same step, range, center and nesting uses. Equations
+        sharing a view are evaluated in one pass, sharing their common
+        subexpressions. Returns one grid of heights per output, from the
+        BufferPool, for the heights constructor.
+    */
+    static std::vector<std::vector<float>> sampleBatch(const Program* program, int step, int range, double center_x,
+                                                       double center_y, bool nested = false,
+                                                       const CancelToken* cancel = nullptr);
+    // World coordinates of the columns and rows of the grid a Geometry with the same arguments samples
+    static void axes(int step, int range, double center_x, double center_y, bool nested, std::vector<double>& xs,
+                     std::vector<double>& ys);
+    /*
+        Meshes program, with inputs x and y, like the constructor would, but
+        STREAM_ROWS rows of quads at a time, handing each band's triangles to
+        sink with finished normals. Only the grid rows a band needs are kept,
+        so memory does not grow with the resolution, see exportSurface.
+    */
+    static void stream(const Program* program, int step, int range, double center_x, double center_y, bool clip,
+                       bool nested, const std::function<void(const Mesh&)>& sink, const CancelToken* cancel = nullptr,
+                       const Singularities* singularities = nullptr);
+    // Grid points sampled, before clipping
+    size_t samples() const { return xs_.size() * ys_.size(); }
 };
\ No newline at end of file
@@ -4,12 +4,17 @@
 #include <QUrl>
 #include <QDir>
 #include <QWebEngineSettings>
+#include <QWebEngineProfile>
 #include "InTeX/evaluator.hpp"
 #include "InTeX/lexer.hpp"
 #include "InTeX/parser.hpp"
 #include "bridge.hpp"
+#include "metricsserver.hpp"
 
 int main(int argc, char *argv[]) {
+    // Custom schemes have to be known before the application starts
+    MeshSchemeHandler::registerScheme();
+
     // Initialize the Qt application
     QApplication app(argc, argv);
     Bridge bridge;
@@ -19,6 +24,7 @@ int main(int argc, char *argv[]) {
     // Create the WebEngine view that will render HTML content
     QWebEngineView view;
     view.page()->setWebChannel(&channel);
+    view.page()->profile()->installUrlSchemeHandler(MeshSchemeHandler::SCHEME, bridge.meshHandler());
     view.settings()->setAttribute(QWebEngineSettings::LocalContentCanAccessFileUrls, true);
 
     // Set the URL to the HTML page using the absolute path of the current directory
@@ -32,6 +38,18 @@ int main(int argc, char *argv[]) {
     // Show the window
     view.show();
 
+    // Prometheus endpoint, only when GRAPHTEX_METRICS_PORT is set
+    MetricsServer metrics;
+    metrics.start();
+
     // Execute the application
-    return app.exec();
+    int code = app.exec();
+
+    // Reopening the session shows these meshes without meshing them again
+    bridge.storeMeshes();
+
+    // Keep the session's metrics, e.g. to compare runs with promtool or a notebook
+    QString path = qEnvironmentVariable("GRAPHTEX_METRICS_FILE", QDir::home().filePath("graphtex_metrics.prom"));
+    if (!Metrics::save(path.toStdString())) qDebug() << "Could not write metrics to" << path;
+    return code;
 }
\ No newline at end of file
@@ -0,0 +1,294 @@
+#include "marchingcubes.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+
+// Corner c of a cell sits at offset (c & 1, (c >> 1) & 1, (c >> 2) & 1)
+static const int edge_corners[12][2] = {
+    {0, 1}, {2, 3}, {4, 5}, {6, 7}, // along x
+    {0, 2}, {1, 3}, {4, 6}, {5, 7}, // along y
+    {0, 4}, {1, 5}, {2, 6}, {3, 7}  // along z
+};
+
+static const int face_corners[6][4] = {
+    {0, 2, 6, 4}, {1, 3, 7, 5}, // x = 0, x = 1
+    {0, 1, 5, 4}, {2, 3, 7, 6}, // y = 0, y = 1
+    {0, 1, 3, 2}, {4, 5, 7, 6}  // z = 0, z = 1
+};
+
+static vec3 cornerOffset(int c) {
+    return vec3(c & 1, (c >> 1) & 1, (c >> 2) & 1);
+}
+
+static int edgeBetween(int a, int b) {
+    for (int e = 0; e < 12; e++) {
+        if ((edge_corners[e][0] == a && edge_corners[e][1] == b) ||
+            (edge_corners[e][0] == b && edge_corners[e][1] == a)) {
+            return e;
+        }
+    }
+    throw std::runtime_error("marching cubes error: corners do not share an edge");
+}
+
+/*
+    Builds the triangle table instead of hard coding it. Each face is walked
+    counter clockwise from outside the cell, and every run of inside corners
+    gives a segment from the edge entering the run to the edge leaving it.
+    Ambiguous faces therefore always separate their inside corners, which
+    neighbouring cells agree on, so the surface is watertight. Segments chain
+    into closed loops that are fan triangulated with consistent winding.
+*/
+static const std::vector<std::vector<int>>& triangleTable() {
+    static const std::vector<std::vector<int>> table = []() {
+        std::vector<std::vector<int>> cases(256);
+        int faces[6][4];
+        for (int f = 0; f < 6; f++) {
+            vec3 a = cornerOffset(face_corners[f][0]);
+            vec3 b = cornerOffset(face_corners[f][1]);
+            vec3 c = cornerOffset(face_corners[f][2]);
+            vec3 center;
+            for (int i = 0; i < 4; i++) center += cornerOffset(face_corners[f][i]) * 0.25f;
+            bool outward = (b - a).cross(c - a).dot(center - vec3(0.5f, 0.5f, 0.5f)) > 0;
+            for (int i = 0; i < 4; i++) {
+                faces[f][i] = face_corners[f][outward ? i : 3 - i];
+            }
+        }
+        for (int config = 0; config < 256; config++) {
+            int next[12];
+            std::fill(next, next + 12, -1);
+            for (int f = 0; f < 6; f++) {
+                for (int i = 0; i < 4; i++) {
+                    int prev = faces[f][(i + 3) % 4];
+                    int cur = faces[f][i];
+                    // Start of a run of inside corners
+                    if (!(config >> cur & 1) || (config >> prev & 1)) continue;
+                    int end = i;
+                    while (config >> faces[f][(end + 1) % 4] & 1) end = (end + 1) % 4;
+                    next[edgeBetween(prev, cur)] = edgeBetween(faces[f][end], faces[f][(end + 1) % 4]);
+                }
+            }
+            bool visited[12] = {};
+            for (int e = 0; e < 12; e++) {
+                if (next[e] < 0 || visited[e]) continue;
+                std::vector<int> loop;
+                for (int cur = e; !visited[cur]; cur = next[cur]) {
+                    visited[cur] = true;
+                    loop.push_back(cur);
+                }
+                for (size_t i = 1; i + 1 < loop.size(); i++) {
+                    cases[config].insert(cases[config].end(), {loop[0], loop[i], loop[i + 1]});
+                }
+            }
+        }
+        return cases;
+    }();
+    return table;
+}
+
+MarchingCubes::MarchingCubes(const Program* program, int step, int range, double center_x, double center_y,
+                             const CancelToken* cancel, bool interleaved)
+    : mesh_(interleaved) {
+    program_ = program;
+    cancel_ = cancel;
+    n_ = step;
+    range_ = range;
+    center_x_ = center_x;
+    center_y_ = center_y;
+    if (n_ < 2) {
+        throw std::runtime_error("marching cubes error: mesh resolution must be at least 2");
+    }
+    spacing_ = 2.0 * range_ / (n_ - 1);
+
+    // One slab per core, each at least two cell layers thick
+    int cells = n_ - 1;
+    int threads = std::max(1, std::min<int>(std::thread::hardware_concurrency(), cells / 2));
+    std::vector<Slab> slabs(threads);
+    for (int s = 0; s < threads; s++) {
+        slabs[s].k0_ = cells * s / threads;
+        slabs[s].k1_ = cells * (s + 1) / threads;
+    }
+    std::vector<std::thread> workers;
+    {
+        TraceSpan span("sweep");
+        for (int s = 0; s < threads; s++) {
+            workers.emplace_back(&MarchingCubes::sweep, this, std::ref(slabs[s]), s == threads - 1);
+        }
+        for (std::thread& worker : workers) worker.join();
+    }
+    // Slabs stop early when cancelled, exceptions cannot leave the worker threads
+    if (cancel_ && cancel_->cancelled()) {
+        throw MeshCancelled();
+    }
+
+    // Resolve slab local indices to global ones
+    TraceSpan span("assemble");
+    std::vector<size_t> vertex_offsets(threads + 1, 0), triangle_offsets(threads + 1, 0);
+    for (int s = 0; s < threads; s++) {
+        vertex_offsets[s + 1] = vertex_offsets[s] + slabs[s].positions_.size();
+        triangle_offsets[s + 1] = triangle_offsets[s] + slabs[s].triangles_.size();
+    }
+    mesh_.resize(vertex_offsets[threads]);
+    BufferPool::reserve(mesh_.indices_, triangle_offsets[threads]);
+    mesh_.indices_.resize(triangle_offsets[threads]);
+    workers.clear();
+    for (int s = 0; s < threads; s++) {
+        workers.emplace_back([this, s, &slabs, &vertex_offsets, &triangle_offsets]() {
+            const Slab& slab = slabs[s];
+            for (size_t v = 0; v < slab.positions_.size(); v++) {
+                // Bound vertices in [-10, 10] WebGL coords
+                vec3 p = slab.positions_[v];
+                vec3 normal = slab.normals_[v];
+                float* position = mesh_.position(vertex_offsets[s] + v);
+                float* out = mesh_.normal(vertex_offsets[s] + v);
+                position[0] = 20*(p.x - center_x_ + range_)/(2*range_) - 10;
+                position[1] = 20*(p.y - center_y_ + range_)/(2*range_) - 10;
+                position[2] = 20*(p.z + range_)/(2*range_) - 10;
+                out[0] = normal.x;
+                out[1] = normal.y;
+                out[2] = normal.z;
+            }
+            size_t index = triangle_offsets[s];
+            for (int local : slab.triangles_) {
+                if (local <= -2) {
+                    mesh_.indices_[index++] = vertex_offsets[s + 1] + slabs[s + 1].bottom_[-2 - local];
+                } else {
+                    mesh_.indices_[index++] = vertex_offsets[s] + local;
+                }
+            }
+        });
+    }
+    for (std::thread& worker : workers) worker.join();
+}
+
+vec3 MarchingCubes::lattice(int i, int j, int k) {
+    return vec3(center_x_ - range_ + i * spacing_, center_y_ - range_ + j * spacing_, -range_ + k * spacing_);
+}
+
+// Evaluates layer k one row of the lattice per program run
+void MarchingCubes::evaluateLayer(int k, std::vector<float>& layer, std::vector<float>& scratch) {
+    std::vector<float> xs(n_), ys(n_), zs(n_, lattice(0, 0, k).z);
+    for (int i = 0; i < n_; i++) xs[i] = lattice(i, 0, k).x;
+    for (int j = 0; j < n_; j++) {
+        std::fill(ys.begin(), ys.end(), lattice(0, j, k).y);
+        program_->run({xs.data(), ys.data(), zs.data()}, {layer.data() + j * n_}, n_, scratch);
+    }
+    static Counter& samples = Metrics::counter("graphtex_samples_total", "Expression samples evaluated", "surface=\"implicit\"");
+    static Counter& nan_samples = Metrics::counter("graphtex_nan_samples_total", "Samples that evaluated to NaN", "surface=\"implicit\"");
+    samples.add(layer.size());
+    nan_samples.add(std::count_if(layer.begin(), layer.end(), [](float value) { return std::isnan(value); }));
+}
+
+/*
+    Places a vertex on every crossed edge of one axis. x and y edges lie in the
+    lower layer k, z edges join layer k to k + 1. With a remote_base the edges
+    belong to the next slab and are only tagged for later lookup.
+*/
+void MarchingCubes::createVertices(Slab& slab, const std::vector<float>& lower, const std::vector<float>& upper,
+                                   int k, int axis, std::vector<int>& edges, int remote_base) {
+    int ni = axis == 0 ? n_ - 1 : n_;
+    int nj = axis == 1 ? n_ - 1 : n_;
+    for (int j = 0; j < nj; j++) {
+        for (int i = 0; i < ni; i++) {
+            int i1 = i + (axis == 0), j1 = j + (axis == 1);
+            float v0 = lower[j * n_ + i];
+            float v1 = (axis == 2 ? upper : lower)[j1 * n_ + i1];
+            int index = j * ni + i;
+            if (!std::isfinite(v0) || !std::isfinite(v1) || (v0 < 0) == (v1 < 0)) {
+                edges[index] = -1;
+                continue;
+            }
+            if (remote_base >= 0) {
+                edges[index] = -2 - (remote_base + index);
+                continue;
+            }
+            vec3 p0 = lattice(i, j, k);
+            vec3 p1 = lattice(i1, j1, k + (axis == 2));
+            edges[index] = slab.positions_.size();
+            slab.positions_.push_back(p0.lerp(p1, v0 / (v0 - v1)));
+            // Edge direction as a fallback where the gradient is undefined
+            slab.normals_.push_back(((p1 - p0) * (v1 - v0)).normalize());
+        }
+    }
+}
+
+// Central difference gradients of the field at every slab vertex, six samples each in batches
+void MarchingCubes::computeNormals(Slab& slab, std::vector<float>& scratch) {
+    const size_t batch = 1024;
+    const float h = spacing_ * 0.5f;
+    std::vector<float> xs, ys, zs, fs;
+    for (size_t first = 0; first < slab.positions_.size(); first += batch) {
+        size_t count = std::min(batch, slab.positions_.size() - first);
+        xs.resize(6 * count);
+        ys.resize(6 * count);
+        zs.resize(6 * count);
+        fs.resize(6 * count);
+        for (size_t v = 0; v < count; v++) {
+            vec3 p = slab.positions_[first + v];
+            for (int s = 0; s < 6; s++) {
+                float offset = s % 2 ? -h : h;
+                xs[6 * v + s] = p.x + (s / 2 == 0 ? offset : 0.0f);
+                ys[6 * v + s] = p.y + (s / 2 == 1 ? offset : 0.0f);
+                zs[6 * v + s] = p.z + (s / 2 == 2 ? offset : 0.0f);
+            }
+        }
+        program_->run({xs.data(), ys.data(), zs.data()}, {fs.data()}, 6 * count, scratch);
+        for (size_t v = 0; v < count; v++) {
+            const float* f = fs.data() + 6 * v;
+            vec3 grad(f[0] - f[1], f[2] - f[3], f[4] - f[5]);
+            if (grad.isfinite() && grad.length() != 0) {
+                slab.normals_[first + v] = grad.normalize();
+            }
+        }
+    }
+}
+
+void MarchingCubes::sweep(Slab& slab, bool last) {
+    const std::vector<std::vector<int>>& table = triangleTable();
+    std::vector<float> scratch;
+    size_t layer_size = n_ * n_;
+    size_t edge_size = n_ * (n_ - 1);
+    std::vector<float> lower(layer_size), upper(layer_size);
+    std::vector<int> xl(edge_size), yl(edge_size), xu(edge_size), yu(edge_size), zc(layer_size);
+
+    evaluateLayer(slab.k0_, lower, scratch);
+    createVertices(slab, lower, lower, slab.k0_, 0, xl);
+    createVertices(slab, lower, lower, slab.k0_, 1, yl);
+    slab.bottom_.insert(slab.bottom_.end(), xl.begin(), xl.end());
+    slab.bottom_.insert(slab.bottom_.end(), yl.begin(), yl.end());
+
+    for (int k = slab.k0_; k < slab.k1_; k++) {
+        if (cancel_ && cancel_->cancelled()) return;
+        evaluateLayer(k + 1, upper, scratch);
+        // The top layer of every slab but the last is owned by the next one
+        bool remote = k + 1 == slab.k1_ && !last;
+        createVertices(slab, upper, upper, k + 1, 0, xu, remote ? 0 : -1);
+        createVertices(slab, upper, upper, k + 1, 1, yu, remote ? edge_size : -1);
+        createVertices(slab, lower, upper, k, 2, zc);
+
+        for (int j = 0; j < n_ - 1; j++) {
+            for (int i = 0; i < n_ - 1; i++) {
+                int config = 0;
+                bool finite = true;
+                for (int c = 0; c < 8; c++) {
+                    float v = (c >> 2 ? upper : lower)[(j + (c >> 1 & 1)) * n_ + i + (c & 1)];
+                    finite = finite && std::isfinite(v);
+                    config |= (v < 0) << c;
+                }
+                if (!finite || config == 0 || config == 255) continue;
+                int edges[12] = {
+                    xl[j * (n_ - 1) + i], xl[(j + 1) * (n_ - 1) + i], xu[j * (n_ - 1) + i], xu[(j + 1) * (n_ - 1) + i],
+                    yl[j * n_ + i], yl[j * n_ + i + 1], yu[j * n_ + i], yu[j * n_ + i + 1],
+                    zc[j * n_ + i], zc[j * n_ + i + 1], zc[(j + 1) * n_ + i], zc[(j + 1) * n_ + i + 1]
+                };
+                for (int e : table[config]) {
+                    slab.triangles_.push_back(edges[e]);
+                }
+            }
+        }
+        std::swap(lower, upper);
+        std::swap(xl, xu);
+        std::swap(yl, yu);
+    }
+    computeNormals(slab, scratch);
+}
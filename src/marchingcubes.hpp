@@ -0,0 +1,52 @@
+#pragma once
+#include "InTeX/compiler.hpp"
+#include "mesh.hpp"
+#include "cancel.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include "vec3.hpp"
+#include <cstdint>
+#include <vector>
+
+/*
+    Meshes the zero set of an implicit equation f(x, y, z) = 0 over the view box.
+    The lattice is cut into slabs along z that are swept in parallel. A slab owns
+    the vertices on its bottom layer, so cells on a slab boundary reference the
+    next slab's vertices instead of creating duplicates.
+*/
+class MarchingCubes {
+private:
+    struct Slab {
+        // Cell layers [k0_, k1_)
+        int k0_;
+        int k1_;
+        std::vector<vec3> positions_;
+        std::vector<vec3> normals_;
+        // Vertex index on each x and y edge of layer k0_, -1 if not crossed
+        std::vector<int> bottom_;
+        // Local vertex indices, values <= -2 refer to edges owned by the next slab
+        std::vector<int> triangles_;
+    };
+
+    const Program* program_;
+    const CancelToken* cancel_;
+    int n_;
+    int range_;
+    double center_x_;
+    double center_y_;
+    double spacing_;
+
+    void sweep(Slab& slab, bool last);
+    void evaluateLayer(int k, std::vector<float>& layer, std::vector<float>& scratch);
+    void createVertices(Slab& slab, const std::vector<float>& lower, const std::vector<float>& upper,
+                        int k, int axis, std::vector<int>& edges, int remote_base = -1);
+    void computeNormals(Slab& slab, std::vector<float>& scratch);
+    vec3 lattice(int i, int j, int k);
+public:
+    // Indexed mesh, vertices are shared by all triangles around them
+    Mesh mesh_;
+    // program maps inputs (x, y, z) to the field value
+    explicit MarchingCubes(const Program* program, int step, int range, double center_x, double center_y,
+                           const CancelToken* cancel = nullptr, bool interleaved = false);
+    ~MarchingCubes() {}
+};
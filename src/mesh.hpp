@@ -0,0 +1,87 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "bufferpool.hpp"
+#include "contours.hpp"
+#include "picking.hpp"
+#include <memory>
+
+/*
+    Mesh handed from a mesh job to the renderer. Triangle soups leave indices_
+    empty and list three vertices per triangle, indexed meshes share vertices
+    between triangles and list three indices per triangle.
+    Split meshes keep positions in vertices_ and normals in normals_. Interleaved
+    meshes are already in the renderer's vertex buffer layout: vertices_ holds
+    the position and then the normal of every vertex, 24 bytes apart, and
+    normals_ stays empty. Heightfield meshes of explicit surfaces leave both
+    empty and keep the sampled grid in grid_, for the renderer to rebuild the
+    triangles from, see encodeHeightfield.
+    A mesh at a high resolution is hundreds of megabytes, so it can only be
+    moved: the mesh job writes it once and hands it on to the transport. Its
+    buffers come from the BufferPool and go back there when it is destroyed.
+*/
+struct Mesh {
+    std::vector<float> vertices_;
+    std::vector<float> normals_;
+    std::vector<uint32_t> indices_;
+    // First vertex of each block of grid rows, empty when the mesh has no grid layout
+    std::vector<uint32_t> blocks_;
+    // Sampled grid of a heightfield mesh, in view coordinates
+    struct Grid {
+        int rows_ = 0;
+        int cols_ = 0;
+        // Whether the renderer cuts the surface off at the top and bottom of the view box
+        bool clip_ = false;
+        // x of each column and y of each row, only the ones at the window edges are off the lattice spacing
+        std::vector<float> xs_;
+        std::vector<float> ys_;
+        // rows_ x cols_ heights, row by row
+        std::vector<float> heights_;
+        // Triangles of each cell the mesh drops, see Geometry::rejected_
+        std::vector<uint8_t> rejected_;
+    };
+    Grid grid_;
+    // Contour lines of explicit surfaces, when asked for
+    Contours contours_;
+    // Sampled grid of explicit surfaces, for picking, when asked for
+    std::shared_ptr<const HeightField> field_;
+    bool interleaved_ = false;
+
+    Mesh() = default;
+    explicit Mesh(bool interleaved) : interleaved_(interleaved) {}
+    Mesh(Mesh&&) = default;
+    Mesh& operator=(Mesh&&) = default;
+    Mesh(const Mesh&) = delete;
+    Mesh& operator=(const Mesh&) = delete;
+    ~Mesh() {
+        BufferPool::recycle(vertices_);
+        BufferPool::recycle(normals_);
+        BufferPool::recycle(indices_);
+        BufferPool::recycle(grid_.heights_);
+    }
+
+    bool empty() const { return vertices_.empty() && grid_.heights_.empty(); }
+    bool heightfield() const { return !grid_.heights_.empty(); }
+    // Floats from one vertex to the next in vertices_
+    size_t stride() const { return interleaved_ ? 6 : 3; }
+    size_t vertexCount() const { return vertices_.size() / stride(); }
+    // Room for count vertices in the mesh's layout
+    void reserve(size_t count) {
+        BufferPool::reserve(vertices_, stride() * count);
+        if (!interleaved_) BufferPool::reserve(normals_, 3 * count);
+    }
+    void resize(size_t count) {
+        reserve(count);
+        vertices_.resize(stride() * count);
+        normals_.resize(interleaved_ ? 0 : 3 * count);
+    }
+    float* position(size_t v) { return &vertices_[stride() * v]; }
+    const float* position(size_t v) const { return &vertices_[stride() * v]; }
+    float* normal(size_t v) { return interleaved_ ? &vertices_[6 * v + 3] : &normals_[3 * v]; }
+    const float* normal(size_t v) const { return interleaved_ ? &vertices_[6 * v + 3] : &normals_[3 * v]; }
+    // Size of the raw layout: vertices, normals, then indices
+    size_t bytes() const {
+        return (vertices_.size() + normals_.size()) * sizeof(float) + indices_.size() * sizeof(uint32_t);
+    }
+};
@@ -0,0 +1,129 @@
+#include "meshcache.hpp"
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <cstring>
+#include <set>
+
+static const char MAGIC[4] = {'G', 'T', 'X', 'M'};
+
+enum : uint32_t { COMPACT = 1, INTERLEAVED = 2, HEIGHTFIELD = 4 };
+
+QString MeshCache::path(const QByteArray& key) const {
+    QByteArray hash = QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex();
+    return QDir(directory_).filePath(QString::fromLatin1(hash) + ".mesh");
+}
+
+EncodedMesh MeshCache::load(const QByteArray& key) const {
+    std::shared_ptr<QFile> file = std::make_shared<QFile>(path(key));
+    if (!file->open(QIODevice::ReadOnly)) return EncodedMesh();
+    qint64 size = file->size();
+    const uchar* data = size > 0 ? file->map(0, size) : nullptr;
+    if (!data) return EncodedMesh();
+
+    qint64 offset = 0;
+    auto read = [&](void* out, qint64 bytes) {
+        if (bytes < 0 || bytes > size - offset) return false;
+        std::memcpy(out, data + offset, bytes);
+        offset += bytes;
+        return true;
+    };
+    char magic[4];
+    uint32_t version, key_size, flags, block_count;
+    int32_t vertex_count, index_count;
+    uint64_t body, contour_bytes;
+    if (!read(magic, 4) || std::memcmp(magic, MAGIC, 4) != 0 || !read(&version, 4) || version != FORMAT_VERSION) {
+        return EncodedMesh();
+    }
+    if (!read(&key_size, 4) || key_size != static_cast<uint32_t>(key.size()) || size - offset < key_size ||
+        std::memcmp(data + offset, key.constData(), key_size) != 0) {
+        return EncodedMesh();
+    }
+    offset += (key_size + 3) / 4 * 4;
+    if (!read(&vertex_count, 4) || !read(&index_count, 4) || !read(&flags, 4) || !read(&block_count, 4) ||
+        vertex_count <= 0 || index_count < 0 || block_count > static_cast<uint32_t>(size / 4)) {
+        return EncodedMesh();
+    }
+    std::vector<uint32_t> blocks(block_count);
+    if (!read(blocks.data(), 4 * static_cast<qint64>(block_count)) || !read(&body, 8) ||
+        body > static_cast<uint64_t>(size - offset)) {
+        return EncodedMesh();
+    }
+    qint64 body_offset = offset;
+    offset += body;
+    uint32_t contour_lines;
+    if (!read(&contour_lines, 4) || !read(&contour_bytes, 8) || contour_bytes != static_cast<uint64_t>(size - offset)) {
+        return EncodedMesh();
+    }
+    // Both raw layouts take 6 floats per vertex
+    bool compact = flags & COMPACT, heightfield = flags & HEIGHTFIELD;
+    if (!compact && !heightfield && body != 24 * static_cast<uint64_t>(vertex_count) + 4 * static_cast<uint64_t>(index_count)) {
+        return EncodedMesh();
+    }
+
+    EncodedMesh mesh;
+    mesh.data_ = QByteArray::fromRawData(reinterpret_cast<const char*>(data + body_offset), static_cast<qsizetype>(body));
+    mesh.contours_ = QByteArray::fromRawData(reinterpret_cast<const char*>(data + offset),
+                                             static_cast<qsizetype>(contour_bytes));
+    mesh.contour_lines_ = contour_lines;
+    mesh.owner_ = file;
+    mesh.vertex_count_ = vertex_count;
+    mesh.index_count_ = index_count;
+    mesh.compact_ = compact;
+    mesh.interleaved_ = flags & INTERLEAVED;
+    mesh.heightfield_ = heightfield;
+    mesh.blocks_ = std::move(blocks);
+    return mesh;
+}
+
+bool MeshCache::store(const QByteArray& key, const EncodedMesh& mesh) const {
+    if (mesh.vertex_count_ == 0 || load(key).vertex_count_ > 0) return false;
+    if (!QDir().mkpath(directory_)) return false;
+    // Written to a temporary file and renamed, a crash never leaves half an entry
+    QSaveFile file(path(key));
+    if (!file.open(QIODevice::WriteOnly)) return false;
+    auto write = [&](const void* data, qint64 bytes) { file.write(static_cast<const char*>(data), bytes); };
+
+    uint32_t version = FORMAT_VERSION, key_size = key.size();
+    uint32_t flags = (mesh.compact_ ? COMPACT : 0) | (mesh.interleaved_ ? INTERLEAVED : 0) |
+                     (mesh.heightfield_ ? HEIGHTFIELD : 0);
+    uint32_t block_count = mesh.blocks_.size();
+    int32_t vertex_count = mesh.vertex_count_, index_count = mesh.index_count_;
+    uint64_t body = mesh.bytes();
+    const char padding[4] = {};
+    write(MAGIC, 4);
+    write(&version, 4);
+    write(&key_size, 4);
+    write(key.constData(), key_size);
+    write(padding, (4 - key_size % 4) % 4);
+    write(&vertex_count, 4);
+    write(&index_count, 4);
+    write(&flags, 4);
+    write(&block_count, 4);
+    write(mesh.blocks_.data(), 4 * static_cast<qint64>(block_count));
+    write(&body, 8);
+    if (mesh.raw_) {
+        write(mesh.raw_->vertices_.data(), mesh.raw_->vertices_.size() * sizeof(float));
+        write(mesh.raw_->normals_.data(), mesh.raw_->normals_.size() * sizeof(float));
+        write(mesh.raw_->indices_.data(), mesh.raw_->indices_.size() * sizeof(uint32_t));
+    } else {
+        write(mesh.data_.constData(), mesh.data_.size());
+    }
+    uint32_t contour_lines = mesh.contour_lines_;
+    uint64_t contour_bytes = mesh.contours_.size();
+    write(&contour_lines, 4);
+    write(&contour_bytes, 8);
+    write(mesh.contours_.constData(), mesh.contours_.size());
+    return file.commit();
+}
+
+void MeshCache::retain(const std::vector<QByteArray>& keys) const {
+    std::set<QString> kept;
+    for (const QByteArray& key : keys) kept.insert(QFileInfo(path(key)).fileName());
+    QDir directory(directory_);
+    for (const QString& name : directory.entryList({"*.mesh"}, QDir::Files)) {
+        if (!kept.count(name)) directory.remove(name);
+    }
+}
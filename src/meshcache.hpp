@@ -0,0 +1,38 @@
+#pragma once
+#include <QByteArray>
+#include <QString>
+#include <cstdint>
+#include <vector>
+#include "meshcodec.hpp"
+
+/*
+    Finished meshes kept on disk between sessions, so reopening one shows its
+    graphs before anything is meshed again. Each entry is a file named after a
+    hash of its key, which holds the equation and every setting that shapes
+    its mesh. The body is the mesh scheme's layout of the mesh:
+      char magic[4] "GTXM", uint32 format version
+      uint32 key size, key, padded to a multiple of 4 bytes
+      int32 vertex_count, int32 index_count, uint32 flags (1 compact, 2 interleaved, 4 heightfield)
+      uint32 block count, uint32 blocks[block count]
+      uint64 body size, body
+      uint32 contour line count, uint64 contour size, contours, see encodeContours
+    Entries are mapped read only and only the header is read, the body and
+    contours are served in place. An entry of another format version or key is a miss.
+*/
+class MeshCache {
+private:
+    QString directory_;
+
+    QString path(const QByteArray& key) const;
+public:
+    static constexpr uint32_t FORMAT_VERSION = 4;
+
+    explicit MeshCache(const QString& directory) : directory_(directory) {}
+
+    // Mesh stored under key, vertex_count_ is 0 on a miss
+    EncodedMesh load(const QByteArray& key) const;
+    // Writes mesh under key unless that entry is already valid
+    bool store(const QByteArray& key, const EncodedMesh& mesh) const;
+    // Deletes every entry but those of keys
+    void retain(const std::vector<QByteArray>& keys) const;
+};
@@ -0,0 +1,310 @@
+#include "meshcodec.hpp"
+#include "vec3.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+EncodedMesh encodeRaw(Mesh&& mesh) {
+    EncodedMesh encoded;
+    encoded.vertex_count_ = mesh.vertexCount();
+    encoded.index_count_ = mesh.indices_.size();
+    encoded.interleaved_ = mesh.interleaved_;
+    encoded.blocks_ = mesh.blocks_;
+    encodeContours(mesh.contours_, encoded);
+    encoded.field_ = mesh.field_;
+    encoded.raw_ = std::make_shared<const Mesh>(std::move(mesh));
+    return encoded;
+}
+
+// Identical position and normal bits, soups repeat every vertex once per triangle around it
+struct VertexKey {
+    std::array<uint32_t, 6> bits_;
+
+    bool operator==(const VertexKey& other) const { return bits_ == other.bits_; }
+
+    struct VertexKeyHash {
+        std::size_t operator()(const VertexKey& key) const {
+            std::size_t seed = 0;
+            for (uint32_t bits : key.bits_) {
+                seed ^= std::hash<uint32_t>{}(bits) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            }
+            return seed;
+        }
+    };
+};
+
+static Mesh weld(const Mesh& soup) {
+    Mesh mesh;
+    std::unordered_map<VertexKey, uint32_t, VertexKey::VertexKeyHash> indices;
+    indices.reserve(soup.vertices_.size() / 9);
+    for (size_t v = 0; v < soup.vertexCount(); v++) {
+        VertexKey key;
+        std::memcpy(key.bits_.data(), soup.position(v), 3 * sizeof(float));
+        std::memcpy(key.bits_.data() + 3, soup.normal(v), 3 * sizeof(float));
+        auto it = indices.find(key);
+        if (it == indices.end()) {
+            it = indices.emplace(key, mesh.vertices_.size() / 3).first;
+            mesh.vertices_.insert(mesh.vertices_.end(), soup.position(v), soup.position(v) + 3);
+            mesh.normals_.insert(mesh.normals_.end(), soup.normal(v), soup.normal(v) + 3);
+        }
+        mesh.indices_.push_back(it->second);
+    }
+    return mesh;
+}
+
+// Folds the lower hemisphere over the diagonals of the upper one's projection
+static void octahedralEncode(vec3 n, int16_t* out) {
+    float sum = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    float u = 0.0f, v = 0.0f;
+    if (std::isfinite(sum) && sum > 0) {
+        u = n.x / sum;
+        v = n.y / sum;
+        if (n.z < 0) {
+            float fu = (1.0f - std::abs(v)) * (u >= 0 ? 1.0f : -1.0f);
+            float fv = (1.0f - std::abs(u)) * (v >= 0 ? 1.0f : -1.0f);
+            u = fu;
+            v = fv;
+        }
+    }
+    out[0] = std::lround(std::clamp(u, -1.0f, 1.0f) * 32767.0f);
+    out[1] = std::lround(std::clamp(v, -1.0f, 1.0f) * 32767.0f);
+}
+
+// Grows the box offset + [0, scale] of a compact layout over a finite position, see finishBounds
+static void bound(const float* position, float* offset, float* scale) {
+    for (int c = 0; c < 3; c++) {
+        float p = position[c];
+        if (!std::isfinite(p)) continue;
+        offset[c] = std::min(offset[c], p);
+        scale[c] = std::max(scale[c], p);
+    }
+}
+
+// Turns the highest corner bound left in scale into the box's extent
+static void finishBounds(float* offset, float* scale) {
+    for (int c = 0; c < 3; c++) {
+        if (!(scale[c] >= offset[c])) offset[c] = scale[c] = 0.0f;
+        scale[c] = scale[c] > offset[c] ? scale[c] - offset[c] : 1.0f;
+    }
+}
+
+static uint16_t quantize(float p, float offset, float scale) {
+    float t = (p - offset) / scale;
+    return std::isfinite(t) ? std::lround(std::clamp(t, 0.0f, 1.0f) * 65535.0f) : 0;
+}
+
+EncodedMesh encodeCompact(const Mesh& mesh) {
+    if (mesh.indices_.empty() && !mesh.vertices_.empty()) {
+        EncodedMesh encoded = encodeCompact(weld(mesh));
+        encodeContours(mesh.contours_, encoded);
+        encoded.field_ = mesh.field_;
+        return encoded;
+    }
+    // Keep only referenced vertices, numbered in order of first use so index deltas stay small
+    std::vector<uint32_t> remap(mesh.vertexCount(), UINT32_MAX);
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> indices(mesh.indices_.size());
+    for (size_t i = 0; i < mesh.indices_.size(); i++) {
+        uint32_t& index = remap[mesh.indices_[i]];
+        if (index == UINT32_MAX) {
+            index = order.size();
+            order.push_back(mesh.indices_[i]);
+        }
+        indices[i] = index;
+    }
+
+    EncodedMesh encoded;
+    encoded.compact_ = true;
+    encoded.vertex_count_ = order.size();
+    encoded.index_count_ = indices.size();
+    size_t count = order.size();
+
+    float offset[3] = {INFINITY, INFINITY, INFINITY};
+    float scale[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (uint32_t v : order) bound(mesh.position(v), offset, scale);
+    finishBounds(offset, scale);
+
+    size_t position_bytes = (6 * count + 3) / 4 * 4;
+    size_t header_bytes = 6 * sizeof(float);
+    QByteArray& data = encoded.data_;
+    data.resize(header_bytes + position_bytes + 4 * count);
+    std::memcpy(data.data(), offset, sizeof(offset));
+    std::memcpy(data.data() + sizeof(offset), scale, sizeof(scale));
+
+    uint16_t* positions = reinterpret_cast<uint16_t*>(data.data() + header_bytes);
+    int16_t* normals = reinterpret_cast<int16_t*>(data.data() + header_bytes + position_bytes);
+    for (size_t v = 0; v < count; v++) {
+        uint32_t source = order[v];
+        for (int c = 0; c < 3; c++) {
+            positions[3 * v + c] = quantize(mesh.position(source)[c], offset[c], scale[c]);
+        }
+        const float* normal = mesh.normal(source);
+        octahedralEncode(vec3(normal[0], normal[1], normal[2]), normals + 2 * v);
+    }
+    if (position_bytes > 6 * count) {
+        positions[3 * count] = 0;
+    }
+
+    // Neighbouring triangles share vertices, so deltas are mostly one or two bytes
+    data.reserve(data.size() + 2 * indices.size());
+    long long previous = 0;
+    for (uint32_t index : indices) {
+        long long delta = (long long)index - previous;
+        uint64_t zigzag = delta < 0 ? ((uint64_t)(-delta) << 1) - 1 : (uint64_t)delta << 1;
+        previous = index;
+        do {
+            char byte = zigzag & 0x7f;
+            zigzag >>= 7;
+            data.append(zigzag ? (char)(byte | 0x80) : byte);
+        } while (zigzag);
+    }
+    encodeContours(mesh.contours_, encoded);
+    encoded.field_ = mesh.field_;
+    return encoded;
+}
+
+void encodeContours(const Contours& contours, EncodedMesh& encoded) {
+    encoded.contours_.clear();
+    encoded.contour_lines_ = contours.lengths_.size();
+    if (contours.empty()) return;
+    size_t count = contours.points_.size() / 3;
+    float offset[3] = {INFINITY, INFINITY, INFINITY};
+    float scale[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (size_t p = 0; p < count; p++) bound(&contours.points_[3 * p], offset, scale);
+    finishBounds(offset, scale);
+
+    size_t header_bytes = 6 * sizeof(float);
+    size_t length_bytes = contours.lengths_.size() * sizeof(uint32_t);
+    size_t position_bytes = (6 * count + 3) / 4 * 4;
+    QByteArray& data = encoded.contours_;
+    data.resize(header_bytes + length_bytes + position_bytes);
+    std::memcpy(data.data(), offset, sizeof(offset));
+    std::memcpy(data.data() + sizeof(offset), scale, sizeof(scale));
+    std::memcpy(data.data() + header_bytes, contours.lengths_.data(), length_bytes);
+    uint16_t* positions = reinterpret_cast<uint16_t*>(data.data() + header_bytes + length_bytes);
+    for (size_t p = 0; p < count; p++) {
+        for (int c = 0; c < 3; c++) positions[3 * p + c] = quantize(contours.points_[3 * p + c], offset[c], scale[c]);
+    }
+    if (position_bytes > 6 * count) {
+        positions[3 * count] = 0;
+    }
+}
+
+// Rounds to the nearest half float, finite heights beyond its range saturate instead of turning infinite
+static uint16_t toHalf(float value) {
+    if (std::isfinite(value)) value = std::clamp(value, -65504.0f, 65504.0f);
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t exponent = (bits >> 23) & 0xff;
+    uint32_t mantissa = bits & 0x7fffff;
+    if (exponent == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    int half_exponent = static_cast<int>(exponent) - 127 + 15;
+    if (half_exponent < -10) return sign;
+    // Subnormal halves shift the implicit leading bit into the mantissa
+    int shift = half_exponent > 0 ? 13 : 14 - half_exponent;
+    mantissa |= exponent ? 0x800000 : 0;
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+    if (half_exponent > 0) half = (static_cast<uint32_t>(half_exponent) << 10) | (half & 0x3ff);
+    // Round to nearest even, a carry into the exponent is still the right half
+    if (rest > halfway || (rest == halfway && (half & 1))) half++;
+    return sign | half;
+}
+
+EncodedMesh encodeHeightfield(const Mesh& mesh, bool compact) {
+    const Mesh::Grid& grid = mesh.grid_;
+    EncodedMesh encoded;
+    encoded.heightfield_ = true;
+    encoded.compact_ = compact;
+    encoded.vertex_count_ = 6 * (grid.rows_ - 1) * (grid.cols_ - 1);
+    size_t count = static_cast<size_t>(grid.rows_) * grid.cols_;
+    size_t header_bytes = 3 * sizeof(uint32_t) + (grid.rows_ + grid.cols_) * sizeof(float);
+    size_t height_bytes = compact ? (2 * count + 3) / 4 * 4 : 4 * count;
+    size_t row_bytes = (grid.cols_ - 1 + 3) / 4;
+    QByteArray& data = encoded.data_;
+    data.resize(header_bytes + height_bytes + row_bytes * (grid.rows_ - 1));
+    data.fill(0);
+    char* out = data.data();
+    uint32_t shape[3] = {static_cast<uint32_t>(grid.rows_), static_cast<uint32_t>(grid.cols_), grid.clip_};
+    std::memcpy(out, shape, sizeof(shape));
+    std::memcpy(out + sizeof(shape), grid.xs_.data(), grid.cols_ * sizeof(float));
+    std::memcpy(out + sizeof(shape) + grid.cols_ * sizeof(float), grid.ys_.data(), grid.rows_ * sizeof(float));
+    out += header_bytes;
+    if (compact) {
+        uint16_t* heights = reinterpret_cast<uint16_t*>(out);
+        for (size_t p = 0; p < count; p++) heights[p] = toHalf(grid.heights_[p]);
+    } else {
+        std::memcpy(out, grid.heights_.data(), 4 * count);
+    }
+    out += height_bytes;
+    if (!grid.rejected_.empty()) {
+        for (int r = 0; r < grid.rows_ - 1; r++) {
+            for (int c = 0; c < grid.cols_ - 1; c++) {
+                uint8_t bits = grid.rejected_[static_cast<size_t>(r) * (grid.cols_ - 1) + c] & 3;
+                out[r * row_bytes + c / 4] |= bits << (2 * (c % 4));
+            }
+        }
+    }
+    encodeContours(mesh.contours_, encoded);
+    encoded.field_ = mesh.field_;
+    return encoded;
+}
+
+EncodedMesh encodeMesh(Mesh&& mesh, bool compact) {
+    if (mesh.heightfield()) return encodeHeightfield(mesh, compact);
+    return compact ? encodeCompact(mesh) : encodeRaw(std::move(mesh));
+}
+
+bool diffBlocks(const EncodedMesh& previous, const EncodedMesh& mesh, std::vector<VertexRange>& ranges) {
+    ranges.clear();
+    if (!previous.raw_ || !mesh.raw_ || previous.compact_ || mesh.compact_ || previous.interleaved_ != mesh.interleaved_ ||
+        mesh.blocks_.empty() || previous.blocks_ != mesh.blocks_ ||
+        previous.vertex_count_ != mesh.vertex_count_ || previous.index_count_ != 0 || mesh.index_count_ != 0) {
+        return false;
+    }
+    const size_t stride = 3 * sizeof(float);
+    uint32_t changed = 0;
+    for (size_t b = 0; b < mesh.blocks_.size(); b++) {
+        uint32_t first = mesh.blocks_[b];
+        uint32_t last = b + 1 < mesh.blocks_.size() ? mesh.blocks_[b + 1] : mesh.vertex_count_;
+        if (first == last) continue;
+        size_t bytes = (last - first) * stride;
+        // Interleaved positions and normals of a block are one run of memory
+        bool same = mesh.interleaved_
+            ? std::memcmp(previous.raw_->position(first), mesh.raw_->position(first), 2 * bytes) == 0
+            : std::memcmp(previous.raw_->position(first), mesh.raw_->position(first), bytes) == 0 &&
+              std::memcmp(previous.raw_->normal(first), mesh.raw_->normal(first), bytes) == 0;
+        if (same) continue;
+        // Neighbouring changed blocks merge into one range
+        if (!ranges.empty() && ranges.back().first_ + ranges.back().count_ == first) {
+            ranges.back().count_ += last - first;
+        } else {
+            ranges.push_back({first, last - first});
+        }
+        changed += last - first;
+    }
+    return 2 * changed <= static_cast<uint32_t>(mesh.vertex_count_);
+}
+
+QByteArray encodePatch(const EncodedMesh& mesh, const std::vector<VertexRange>& ranges) {
+    const size_t stride = 3 * sizeof(float);
+    size_t bytes = 0;
+    for (const VertexRange& range : ranges) bytes += range.count_ * stride;
+    QByteArray patch;
+    patch.resize(2 * bytes);
+    size_t out = 0;
+    for (const VertexRange& range : ranges) {
+        if (mesh.interleaved_) {
+            std::memcpy(patch.data() + 2 * out, mesh.raw_->position(range.first_), 2 * range.count_ * stride);
+        } else {
+            std::memcpy(patch.data() + out, mesh.raw_->position(range.first_), range.count_ * stride);
+            std::memcpy(patch.data() + bytes + out, mesh.raw_->normal(range.first_), range.count_ * stride);
+        }
+        out += range.count_ * stride;
+    }
+    return patch;
+}
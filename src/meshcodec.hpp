@@ -0,0 +1,93 @@
+#pragma once
+#include <QByteArray>
+#include <memory>
+#include <vector>
+#include "mesh.hpp"
+
+/*
+    Mesh ready to be served to the renderer. Raw meshes keep the Mesh itself in
+    raw_ and are served straight from its buffers, compact meshes are encoded
+    into data_. Copies share the buffers, nothing is duplicated on the way from
+    the mesh job to the page. Meshes loaded from the MeshCache have data_ point
+    into a mapped file, in either layout, which owner_ keeps mapped.
+*/
+struct EncodedMesh {
+    std::shared_ptr<const Mesh> raw_;
+    QByteArray data_;
+    std::shared_ptr<const void> owner_;
+    int vertex_count_ = 0;
+    int index_count_ = 0;
+    bool compact_ = false;
+    // Raw layout, see Mesh::interleaved_
+    bool interleaved_ = false;
+    // Sampled grid of an explicit surface, see encodeHeightfield, compact_ for half float heights
+    bool heightfield_ = false;
+    // Grid blocks of raw triangle soups, see Mesh::blocks_
+    std::vector<uint32_t> blocks_;
+    // Contour lines in the layout of encodeContours, served apart from the mesh
+    QByteArray contours_;
+    int contour_lines_ = 0;
+    // Grid of explicit surfaces for Bridge::pick, never sent to the page or cached
+    std::shared_ptr<const HeightField> field_;
+
+    size_t bytes() const { return raw_ ? raw_->bytes() : data_.size(); }
+};
+
+// Vertices [first_, first_ + count_) of a mesh
+struct VertexRange {
+    uint32_t first_;
+    uint32_t count_;
+};
+
+// Vertices, normals and indices as 32 bit floats and integers, takes over the mesh
+EncodedMesh encodeRaw(Mesh&& mesh);
+
+/*
+    Compact layout, decoded by the renderer's vertex shaders:
+      float offset[3], float scale[3]  position = offset + q / 65535 * scale
+      uint16 q[3 * vertex_count]       padded to a multiple of 4 bytes
+      int16 normals[2 * vertex_count]  octahedral, snorm
+      uint8 indices[]                  zigzag varint deltas from the previous index
+    Triangle soups are welded into an indexed mesh first.
+*/
+EncodedMesh encodeCompact(const Mesh& mesh);
+
+/*
+    Heightfield layout of an explicit surface, the grid it was sampled on.
+    The renderer's vertex shaders rebuild the triangles from vertex ids, x and
+    y from the grid position and normals from the neighbouring heights:
+      uint32 rows, uint32 cols, uint32 clip
+      float xs[cols], float ys[rows]   view coordinates of the columns and rows
+      heights[rows * cols]             floats, or IEEE half floats when compact,
+                                       padded to a multiple of 4 bytes
+      uint8 rejected[]                 dropped triangles, see Mesh::Grid, bits 2k and
+                                       2k + 1 of byte c / 4 for cell c of a row,
+                                       k = c % 4, every row of cells on new bytes
+    Each of the (rows - 1) x (cols - 1) cells is two triangles, six vertices.
+    Heights are sent as sampled, clip is 1 when the renderer is to cut them
+    off at the view box.
+*/
+EncodedMesh encodeHeightfield(const Mesh& mesh, bool compact);
+
+// Heightfield meshes as encodeHeightfield, the others raw or compact
+EncodedMesh encodeMesh(Mesh&& mesh, bool compact);
+
+/*
+    Contour lines of a mesh into contours_, quantized like compact meshes so
+    the renderer's line shader draws them as they are:
+      float offset[3], float scale[3]  position = offset + q / 65535 * scale
+      uint32 lengths[line_count]       points of each line strip
+      uint16 q[3 * point_count]        padded to a multiple of 4 bytes
+    Both encoders call it.
+*/
+void encodeContours(const Contours& contours, EncodedMesh& encoded);
+
+/*
+    Vertex ranges of the grid blocks of mesh that differ from previous. Returns
+    false when only a full upload will do: the block layouts differ, or more
+    than half of the vertices changed so a patch would not save much.
+*/
+bool diffBlocks(const EncodedMesh& previous, const EncodedMesh& mesh, std::vector<VertexRange>& ranges);
+
+// Vertices of every range, then normals of every range, or the interleaved vertices of every range
+QByteArray encodePatch(const EncodedMesh& mesh, const std::vector<VertexRange>& ranges);
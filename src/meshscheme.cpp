@@ -0,0 +1,124 @@
+#include "meshscheme.hpp"
+#include <QIODevice>
+#include <QUrl>
+#include <QWebEngineUrlScheme>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+/*
+    Reads the raw layout of a mesh straight from its buffers, or a mapped cache
+    file in place, keeping them alive until the reply is done
+*/
+class RawMeshDevice : public QIODevice {
+private:
+    std::shared_ptr<const void> owner_;
+    struct Segment {
+        const char* data_;
+        qint64 size_;
+    };
+    Segment segments_[3] = {};
+public:
+    RawMeshDevice(std::shared_ptr<const Mesh> mesh, QObject* parent) : QIODevice(parent), owner_(mesh) {
+        segments_[0] = {reinterpret_cast<const char*>(mesh->vertices_.data()), qint64(mesh->vertices_.size() * sizeof(float))};
+        segments_[1] = {reinterpret_cast<const char*>(mesh->normals_.data()), qint64(mesh->normals_.size() * sizeof(float))};
+        segments_[2] = {reinterpret_cast<const char*>(mesh->indices_.data()), qint64(mesh->indices_.size() * sizeof(uint32_t))};
+    }
+    RawMeshDevice(std::shared_ptr<const void> owner, const char* data, qint64 size, QObject* parent)
+        : QIODevice(parent), owner_(std::move(owner)) {
+        segments_[0] = {data, size};
+    }
+    qint64 size() const override { return segments_[0].size_ + segments_[1].size_ + segments_[2].size_; }
+protected:
+    qint64 readData(char* data, qint64 max) override {
+        qint64 offset = pos(), read = 0;
+        for (const Segment& segment : segments_) {
+            if (offset >= segment.size_) {
+                offset -= segment.size_;
+                continue;
+            }
+            qint64 n = std::min(segment.size_ - offset, max - read);
+            std::memcpy(data + read, segment.data_ + offset, n);
+            read += n;
+            offset = 0;
+            if (read == max) break;
+        }
+        return read;
+    }
+    qint64 writeData(const char*, qint64) override { return -1; }
+};
+
+}
+
+void MeshSchemeHandler::registerScheme() {
+    QWebEngineUrlScheme scheme(SCHEME);
+    scheme.setSyntax(QWebEngineUrlScheme::Syntax::Path);
+    // The page is loaded from file:// so fetches to this scheme are cross origin
+    scheme.setFlags(QWebEngineUrlScheme::SecureScheme | QWebEngineUrlScheme::CorsEnabled |
+                    QWebEngineUrlScheme::FetchApiAllowed);
+    QWebEngineUrlScheme::registerScheme(scheme);
+}
+
+long long MeshSchemeHandler::publish(const QString& id, long long version, EncodedMesh&& mesh, std::vector<VertexRange>& patches) {
+    long long base = 0;
+    QByteArray patch;
+    auto it = meshes_.find(id);
+    if (it != meshes_.end() && diffBlocks(it->second.mesh_, mesh, patches)) {
+        base = it->second.version_;
+        patch = encodePatch(mesh, patches);
+    } else {
+        patches.clear();
+    }
+    meshes_[id] = {version, std::move(mesh), patch};
+    return base;
+}
+
+const EncodedMesh* MeshSchemeHandler::mesh(const QString& id) const {
+    auto it = meshes_.find(id);
+    return it == meshes_.end() ? nullptr : &it->second.mesh_;
+}
+
+void MeshSchemeHandler::remove(const QString& id) {
+    meshes_.erase(id);
+}
+
+void MeshSchemeHandler::requestStarted(QWebEngineUrlRequestJob* job) {
+    // Path is <id>/<version>, <id>/<version>/full or <id>/<version>/contours
+    QString path = job->requestUrl().path();
+    QString id = path.section('/', 0, 0);
+    bool ok = false;
+    long long version = path.section('/', 1, 1).toLongLong(&ok);
+    auto it = meshes_.find(id);
+    if (!ok || it == meshes_.end() || it->second.version_ != version) {
+        job->fail(QWebEngineUrlRequestJob::UrlNotFound);
+        return;
+    }
+    // Neither device copies the mesh, QByteArray is implicitly shared and raw meshes are read in place
+    QString part = path.section('/', 2, 2);
+    bool full = part == "full";
+    const EncodedMesh& mesh = it->second.mesh_;
+    QIODevice* device;
+    if (part == "contours" && mesh.owner_) {
+        // Cached contours point into the mapped file like the body
+        device = new RawMeshDevice(mesh.owner_, mesh.contours_.constData(), mesh.contours_.size(), job);
+    } else if (part == "contours") {
+        QBuffer* buffer = new QBuffer(job);
+        buffer->setData(mesh.contours_);
+        device = buffer;
+    } else if (!full && !it->second.patch_.isEmpty()) {
+        QBuffer* buffer = new QBuffer(job);
+        buffer->setData(it->second.patch_);
+        device = buffer;
+    } else if (mesh.raw_) {
+        device = new RawMeshDevice(mesh.raw_, job);
+    } else if (mesh.owner_) {
+        device = new RawMeshDevice(mesh.owner_, mesh.data_.constData(), mesh.data_.size(), job);
+    } else {
+        QBuffer* buffer = new QBuffer(job);
+        buffer->setData(mesh.data_);
+        device = buffer;
+    }
+    device->open(QIODevice::ReadOnly);
+    job->reply("application/octet-stream", device);
+}
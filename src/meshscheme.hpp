@@ -0,0 +1,46 @@
+#pragma once
+#include <QBuffer>
+#include <QByteArray>
+#include <QString>
+#include <QWebEngineUrlRequestJob>
+#include <QWebEngineUrlSchemeHandler>
+#include <unordered_map>
+#include <vector>
+#include "meshcodec.hpp"
+
+/*
+    Serves finished meshes to the page as raw bytes at mesh:<id>/<version>, so
+    the renderer can fetch them straight into an ArrayBuffer instead of decoding
+    base64 text sent over the web channel. The body is laid out by meshcodec,
+    with the counts and layout announced by Bridge::meshUpdated.
+    When only some grid blocks changed since the previous version the body is a
+    patch of those blocks, and the whole mesh stays available at
+    mesh:<id>/<version>/full for a renderer that missed the previous version.
+    Contour lines of the mesh, if any, are at mesh:<id>/<version>/contours.
+    Only the latest version of each mesh is kept, requests for older versions fail.
+*/
+class MeshSchemeHandler : public QWebEngineUrlSchemeHandler {
+private:
+    struct Entry {
+        long long version_;
+        EncodedMesh mesh_;
+        // Changed blocks relative to the previous version, empty for full updates
+        QByteArray patch_;
+    };
+    std::unordered_map<QString, Entry> meshes_;
+public:
+    static constexpr const char* SCHEME = "mesh";
+    explicit MeshSchemeHandler(QObject* parent = nullptr) : QWebEngineUrlSchemeHandler(parent) {}
+
+    // Must run before the QApplication is created
+    static void registerScheme();
+    void requestStarted(QWebEngineUrlRequestJob* job) override;
+    /*
+        Replaces the mesh of id. Returns the version the patch applies to with the
+        changed vertex ranges, or 0 when the renderer has to fetch the full mesh.
+    */
+    long long publish(const QString& id, long long version, EncodedMesh&& mesh, std::vector<VertexRange>& patches);
+    // Latest mesh of id, null if none was published
+    const EncodedMesh* mesh(const QString& id) const;
+    void remove(const QString& id);
+};
@@ -0,0 +1,158 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// Index of the highest set bit, value must not be 0
+static int highestBit(uint64_t value) {
+    int bit = 0;
+    for (int shift = 32; shift > 0; shift /= 2) {
+        if (value >> shift) {
+            value >>= shift;
+            bit += shift;
+        }
+    }
+    return bit;
+}
+
+int Histogram::bucket(uint64_t value) {
+    if (value < 2 * SUB) return static_cast<int>(value);
+    int exponent = highestBit(value);
+    int mantissa = static_cast<int>(value >> (exponent - SUB_BITS)) - SUB;
+    return 2 * SUB + (exponent - SUB_BITS - 1) * SUB + mantissa;
+}
+
+uint64_t Histogram::upper(int bucket) {
+    if (bucket < 2 * SUB) return bucket;
+    int exponent = (bucket - 2 * SUB) / SUB + SUB_BITS + 1;
+    int mantissa = (bucket - 2 * SUB) % SUB;
+    uint64_t next = static_cast<uint64_t>(SUB + mantissa + 1) << (exponent - SUB_BITS);
+    // The last bucket ends at the largest uint64_t, where next wraps to 0
+    return next - 1;
+}
+
+void Histogram::record(uint64_t value) {
+    buckets_[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+}
+
+namespace {
+
+enum class Kind { COUNTER, GAUGE, HISTOGRAM };
+
+struct Series {
+    std::unique_ptr<Counter> counter_;
+    std::unique_ptr<Gauge> gauge_;
+    std::unique_ptr<Histogram> histogram_;
+    double scale_ = 1.0;
+};
+
+struct Family {
+    Kind kind_;
+    std::string help_;
+    // Labels to series, ordered so the export is stable
+    std::map<std::string, Series> series_;
+};
+
+std::mutex mutex;
+std::map<std::string, Family> families;
+
+Series& find(const std::string& name, const std::string& help, const std::string& labels, Kind kind) {
+    Family& family = families.emplace(name, Family{kind, help, {}}).first->second;
+    return family.series_[labels];
+}
+
+std::string sample(const std::string& name, const std::string& labels, const std::string& extra) {
+    std::string joined = labels;
+    if (!extra.empty()) joined += (joined.empty() ? "" : ",") + extra;
+    return joined.empty() ? name : name + "{" + joined + "}";
+}
+
+std::string number(double value) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.9g", value);
+    return text;
+}
+
+}
+
+Counter& Metrics::counter(const std::string& name, const std::string& help, const std::string& labels) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Series& series = find(name, help, labels, Kind::COUNTER);
+    if (!series.counter_) series.counter_.reset(new Counter());
+    return *series.counter_;
+}
+
+Gauge& Metrics::gauge(const std::string& name, const std::string& help, const std::string& labels) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Series& series = find(name, help, labels, Kind::GAUGE);
+    if (!series.gauge_) series.gauge_.reset(new Gauge());
+    return *series.gauge_;
+}
+
+Histogram& Metrics::histogram(const std::string& name, const std::string& help, const std::string& labels, double scale) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Series& series = find(name, help, labels, Kind::HISTOGRAM);
+    if (!series.histogram_) {
+        series.histogram_.reset(new Histogram());
+        series.scale_ = scale;
+    }
+    return *series.histogram_;
+}
+
+Histogram& Metrics::stage(const std::string& name) {
+    return histogram("graphtex_stage_seconds", "Time spent in each pipeline stage", "stage=\"" + name + "\"", 1e-6);
+}
+
+/*
+    Histograms only list the buckets that hold values, cumulative as the
+    format requires, so the output stays short while keeping the full
+    resolution for histogram_quantile.
+*/
+std::string Metrics::prometheus() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string text;
+    for (const std::pair<const std::string, Family>& pair : families) {
+        const std::string& name = pair.first;
+        const Family& family = pair.second;
+        const char* type = family.kind_ == Kind::COUNTER ? "counter" : family.kind_ == Kind::GAUGE ? "gauge" : "histogram";
+        text += "# HELP " + name + " " + family.help_ + "\n";
+        text += "# TYPE " + name + " " + type + "\n";
+        for (const std::pair<const std::string, Series>& entry : family.series_) {
+            const std::string& labels = entry.first;
+            const Series& series = entry.second;
+            if (series.counter_) {
+                text += sample(name, labels, "") + " " + std::to_string(series.counter_->value()) + "\n";
+            } else if (series.gauge_) {
+                text += sample(name, labels, "") + " " + std::to_string(series.gauge_->value()) + "\n";
+            } else if (series.histogram_) {
+                const Histogram& histogram = *series.histogram_;
+                uint64_t cumulative = 0;
+                for (int b = 0; b < Histogram::BUCKETS; b++) {
+                    uint64_t count = histogram.count(b);
+                    if (count == 0) continue;
+                    cumulative += count;
+                    std::string le = "le=\"" + number(Histogram::upper(b) * series.scale_) + "\"";
+                    text += sample(name + "_bucket", labels, le) + " " + std::to_string(cumulative) + "\n";
+                }
+                // Read after the buckets so it is never below the last cumulative count
+                uint64_t count = std::max(histogram.count(), cumulative);
+                text += sample(name + "_bucket", labels, "le=\"+Inf\"") + " " + std::to_string(count) + "\n";
+                text += sample(name + "_sum", labels, "") + " " + number(histogram.sum() * series.scale_) + "\n";
+                text += sample(name + "_count", labels, "") + " " + std::to_string(count) + "\n";
+            }
+        }
+    }
+    return text;
+}
+
+bool Metrics::save(const std::string& path) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) return false;
+    file << prometheus();
+    return static_cast<bool>(file);
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Monotonic count, e.g. samples evaluated
+class Counter {
+private:
+    std::atomic<uint64_t> value_{0};
+public:
+    void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+};
+
+// Current level, e.g. jobs waiting to start
+class Gauge {
+private:
+    std::atomic<int64_t> value_{0};
+public:
+    void set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+};
+
+/*
+    Log-linear histogram of non-negative integers in the style of HdrHistogram.
+    Values below 16 get their own bucket, above that every power of two is split
+    into 8 buckets, so a bucket's bounds are within 12.5% of any value in it.
+    Recording is a few bit operations and relaxed atomic increments.
+*/
+class Histogram {
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB = 1 << SUB_BITS;
+    static constexpr int BUCKETS = 2 * SUB + (64 - SUB_BITS - 1) * SUB;
+
+    void record(uint64_t value);
+    static int bucket(uint64_t value);
+    // Largest value that falls into the bucket
+    static uint64_t upper(int bucket);
+    uint64_t count(int bucket) const { return buckets_[bucket].load(std::memory_order_relaxed); }
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+};
+
+/*
+    Process wide registry exported in the Prometheus text format. Metrics are
+    created on first use and live until exit, so callers can keep the returned
+    reference in a static and skip the lookup. labels is the text between the
+    braces of a sample, e.g. stage="clipTriangles", and may be empty. scale
+    converts recorded histogram values to the exported unit, e.g. 1e-6 for
+    microseconds recorded into a _seconds histogram.
+*/
+class Metrics {
+public:
+    static Counter& counter(const std::string& name, const std::string& help, const std::string& labels = "");
+    static Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+    static Histogram& histogram(const std::string& name, const std::string& help, const std::string& labels = "",
+                                double scale = 1.0);
+    // Latency of a pipeline stage, fed by every TraceSpan
+    static Histogram& stage(const std::string& name);
+    static std::string prometheus();
+    static bool save(const std::string& path);
+};
@@ -0,0 +1,38 @@
+#include "metricsserver.hpp"
+#include "metrics.hpp"
+#include <QDebug>
+#include <QTcpSocket>
+
+MetricsServer::MetricsServer(QObject* parent) : QTcpServer(parent) {
+    connect(this, &QTcpServer::newConnection, this, &MetricsServer::serve);
+}
+
+bool MetricsServer::start() {
+    bool ok = false;
+    int port = qEnvironmentVariableIntValue("GRAPHTEX_METRICS_PORT", &ok);
+    if (!ok || port <= 0 || port > 65535) return false;
+    if (!listen(QHostAddress::LocalHost, static_cast<quint16>(port))) {
+        qDebug() << "Metrics server could not listen on port" << port << ":" << errorString();
+        return false;
+    }
+    qDebug() << "Serving metrics at http://127.0.0.1:" << port << "/metrics";
+    return true;
+}
+
+void MetricsServer::serve() {
+    while (QTcpSocket* socket = nextPendingConnection()) {
+        connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+        // Answers once the request headers are in, the request itself is not inspected
+        connect(socket, &QTcpSocket::readyRead, socket, [socket]() {
+            if (!socket->peek(socket->bytesAvailable()).contains("\r\n\r\n")) return;
+            socket->readAll();
+            QByteArray body = QByteArray::fromStdString(Metrics::prometheus());
+            QByteArray response = "HTTP/1.1 200 OK\r\n"
+                                  "Content-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: " + QByteArray::number(body.size()) + "\r\n"
+                                  "Connection: close\r\n\r\n";
+            socket->write(response + body);
+            socket->disconnectFromHost();
+        });
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <QTcpServer>
+
+/*
+    Serves Metrics::prometheus() over plain HTTP on localhost, so a Prometheus
+    scraper or curl can watch a running session. Any request path gets the
+    metrics, the connection is closed after each response. Off unless
+    GRAPHTEX_METRICS_PORT is set.
+*/
+class MetricsServer : public QTcpServer {
+public:
+    explicit MetricsServer(QObject* parent = nullptr);
+
+    // Listens on the port from GRAPHTEX_METRICS_PORT, false if unset or taken
+    bool start();
+private:
+    void serve();
+};
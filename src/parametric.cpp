@@ -0,0 +1,129 @@
+#include "parametric.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+
+ParametricSurface::ParametricSurface(const Program* program, int step, int range, double center_x, double center_y,
+                                     const CancelToken* cancel, bool interleaved)
+    : mesh_(interleaved) {
+    program_ = program;
+    cancel_ = cancel;
+    n_ = step;
+    range_ = range;
+    center_x_ = center_x;
+    center_y_ = center_y;
+    if (n_ < 2) {
+        throw std::runtime_error("parametric error: mesh resolution must be at least 2");
+    }
+    if (program_->outputs() != 3) {
+        throw std::runtime_error("parametric error: surface needs exactly 3 components");
+    }
+    points_.resize(n_ * n_);
+    mesh_.resize(n_ * n_);
+
+    // Bands of rows per core, normals need the neighbouring rows so they wait for every band
+    int threads = std::max(1, std::min<int>(std::thread::hardware_concurrency(), n_ / 2));
+    std::vector<std::thread> workers;
+    {
+        TraceSpan span("evaluateRows");
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back(&ParametricSurface::evaluateRows, this, n_ * t / threads, n_ * (t + 1) / threads);
+        }
+        for (std::thread& worker : workers) worker.join();
+    }
+    // Bands stop early when cancelled, exceptions cannot leave the worker threads
+    if (cancel_ && cancel_->cancelled()) {
+        throw MeshCancelled();
+    }
+
+    TraceSpan span("normalsAndTriangles");
+    std::vector<std::vector<uint32_t>> bands(threads);
+    workers.clear();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([this, t, threads, &bands]() {
+            int row_lo = n_ * t / threads;
+            int row_hi = n_ * (t + 1) / threads;
+            computeNormals(row_lo, row_hi);
+            createTriangles(row_lo, std::min(row_hi, n_ - 1), bands[t]);
+        });
+    }
+    for (std::thread& worker : workers) worker.join();
+    size_t index_count = 0;
+    for (const std::vector<uint32_t>& band : bands) index_count += band.size();
+    BufferPool::reserve(mesh_.indices_, index_count);
+    for (const std::vector<uint32_t>& band : bands) {
+        mesh_.indices_.insert(mesh_.indices_.end(), band.begin(), band.end());
+    }
+}
+
+void ParametricSurface::evaluateRows(int row_lo, int row_hi) {
+    const double spacing = 2.0 * M_PI / (n_ - 1);
+    std::vector<float> us(n_), vs(n_), xs(n_), ys(n_), zs(n_), scratch;
+    static Counter& samples = Metrics::counter("graphtex_samples_total", "Expression samples evaluated", "surface=\"parametric\"");
+    static Counter& nan_samples = Metrics::counter("graphtex_nan_samples_total", "Samples that evaluated to NaN", "surface=\"parametric\"");
+    for (int i = 0; i < n_; i++) us[i] = i * spacing;
+    for (int j = row_lo; j < row_hi; j++) {
+        if (cancel_ && cancel_->cancelled()) return;
+        std::fill(vs.begin(), vs.end(), j * spacing);
+        program_->run({us.data(), vs.data()}, {xs.data(), ys.data(), zs.data()}, n_, scratch);
+        samples.add(n_);
+        int nans = 0;
+        for (int i = 0; i < n_; i++) {
+            nans += std::isnan(xs[i]) || std::isnan(ys[i]) || std::isnan(zs[i]);
+            int index = j * n_ + i;
+            points_[index] = vec3(xs[i], ys[i], zs[i]);
+            // Bound vertices in [-10, 10] WebGL coords
+            float* position = mesh_.position(index);
+            position[0] = 20*(xs[i] - center_x_ + range_)/(2*range_) - 10;
+            position[1] = 20*(ys[i] - center_y_ + range_)/(2*range_) - 10;
+            position[2] = 20*(zs[i] + range_)/(2*range_) - 10;
+        }
+        nan_samples.add(nans);
+    }
+}
+
+// Difference along (di, dj), central inside the grid and one sided on its border or next to undefined points
+vec3 ParametricSurface::partial(int i, int j, int di, int dj) {
+    auto at = [this](int i, int j) -> const vec3* {
+        if (i < 0 || j < 0 || i >= n_ || j >= n_ || !points_[j * n_ + i].isfinite()) return nullptr;
+        return &points_[j * n_ + i];
+    };
+    const vec3* next = at(i + di, j + dj);
+    const vec3* prev = at(i - di, j - dj);
+    const vec3* here = at(i, j);
+    if (next && prev) return *next - *prev;
+    if (next) return *next - *here;
+    if (prev) return *here - *prev;
+    return vec3();
+}
+
+void ParametricSurface::computeNormals(int row_lo, int row_hi) {
+    for (int j = row_lo; j < row_hi; j++) {
+        for (int i = 0; i < n_; i++) {
+            int index = j * n_ + i;
+            vec3 normal;
+            if (points_[index].isfinite()) {
+                normal = partial(i, j, 1, 0).cross(partial(i, j, 0, 1)).normalize();
+            }
+            float* out = mesh_.normal(index);
+            out[0] = normal.x;
+            out[1] = normal.y;
+            out[2] = normal.z;
+        }
+    }
+}
+
+// Two triangles per grid quad whose corners are all defined, wound like du x dv
+void ParametricSurface::createTriangles(int row_lo, int row_hi, std::vector<uint32_t>& indices) {
+    for (int j = row_lo; j < row_hi; j++) {
+        for (int i = 0; i < n_ - 1; i++) {
+            uint32_t a = j * n_ + i, b = a + 1, c = a + n_ + 1, d = a + n_;
+            if (!points_[a].isfinite() || !points_[b].isfinite() ||
+                !points_[c].isfinite() || !points_[d].isfinite()) {
+                continue;
+            }
+            indices.insert(indices.end(), {a, b, c, a, c, d});
+        }
+    }
+}
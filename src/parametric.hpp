@@ -0,0 +1,37 @@
+#pragma once
+#include "InTeX/compiler.hpp"
+#include "mesh.hpp"
+#include "cancel.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include "vec3.hpp"
+#include <vector>
+
+/*
+    Meshes a parametric surface (x(u, v), y(u, v), z(u, v)) over u, v in [0, 2pi].
+    All three components are produced by one fused program run per grid row, so
+    subexpressions they share are only evaluated once per sample. Normals are the
+    cross product of the partial derivatives, estimated from neighbouring grid
+    points, and the grid is emitted as an indexed mesh.
+*/
+class ParametricSurface {
+private:
+    const Program* program_;
+    const CancelToken* cancel_;
+    int n_;
+    int range_;
+    double center_x_;
+    double center_y_;
+    // World positions of the n x n grid, row v major
+    std::vector<vec3> points_;
+
+    void evaluateRows(int row_lo, int row_hi);
+    void computeNormals(int row_lo, int row_hi);
+    void createTriangles(int row_lo, int row_hi, std::vector<uint32_t>& indices);
+    vec3 partial(int i, int j, int di, int dj);
+public:
+    Mesh mesh_;
+    // program maps inputs (u, v) to the outputs (x, y, z)
+    explicit ParametricSurface(const Program* program, int step, int range, double center_x, double center_y,
+                               const CancelToken* cancel = nullptr, bool interleaved = false);
+};
@@ -0,0 +1,281 @@
+#include "picking.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Half the side of the view box
+constexpr float BOUND = 10.0f;
+// Slack on height and barycentric tests, so rays along block and cell edges are not lost
+constexpr float EPSILON = 1e-4f;
+// Ray samples when there is no HeightField to walk
+constexpr int MARCH_SAMPLES = 512;
+// Halvings of the interval around a hit, far past float precision on a cell
+constexpr int REFINE_STEPS = 32;
+// Largest gap, in view units, between the ray and the surface at a refined crossing
+constexpr float CROSSING_GAP = 1e-2f;
+// Step of the central differences, in view units
+constexpr double GRADIENT_STEP = 1e-3;
+
+// Narrows [t0, t1] to where origin + t direction has a coordinate in [lo, hi]
+bool slab(float origin, float direction, float lo, float hi, float& t0, float& t1) {
+    if (direction == 0.0f) return origin >= lo && origin <= hi && t0 <= t1;
+    float a = (lo - origin) / direction, b = (hi - origin) / direction;
+    if (a > b) std::swap(a, b);
+    t0 = std::max(t0, a);
+    t1 = std::min(t1, b);
+    return t0 <= t1;
+}
+
+// Möller-Trumbore, t of the crossing with triangle (a, b, c) if there is one
+bool triangle(const float* origin, const float* direction, const float* a, const float* b, const float* c, float& t) {
+    float e1[3], e2[3], s[3], p[3], q[3];
+    for (int k = 0; k < 3; k++) {
+        e1[k] = b[k] - a[k];
+        e2[k] = c[k] - a[k];
+        s[k] = origin[k] - a[k];
+    }
+    auto cross = [](const float* u, const float* v, float* out) {
+        out[0] = u[1] * v[2] - u[2] * v[1];
+        out[1] = u[2] * v[0] - u[0] * v[2];
+        out[2] = u[0] * v[1] - u[1] * v[0];
+    };
+    auto dot = [](const float* u, const float* v) { return u[0] * v[0] + u[1] * v[1] + u[2] * v[2]; };
+    cross(direction, e2, p);
+    float det = dot(e1, p);
+    if (!(std::abs(det) > 0.0f)) return false;
+    float u = dot(s, p) / det;
+    if (!(u >= -EPSILON && u <= 1.0f + EPSILON)) return false;
+    cross(s, e1, q);
+    float v = dot(direction, q) / det;
+    if (!(v >= -EPSILON && u + v <= 1.0f + EPSILON)) return false;
+    t = dot(e2, q) / det;
+    return std::isfinite(t);
+}
+
+} // namespace
+
+HeightField::HeightField(const float* grid, int rows, int cols, const PickView& view, const std::vector<uint8_t>& rejected)
+    : rows_(rows), cols_(cols), view_(view), rejected_(rejected) {
+    xs_.resize(cols);
+    ys_.resize(rows);
+    zs_.resize(static_cast<size_t>(rows) * cols);
+    for (int j = 0; j < cols; j++) xs_[j] = grid[3 * j];
+    for (int i = 0; i < rows; i++) ys_[i] = grid[3 * static_cast<size_t>(i) * cols + 1];
+    for (size_t p = 0; p < zs_.size(); p++) zs_[p] = grid[3 * p + 2];
+    if (rows < 2 || cols < 2) return;
+
+    // Cells hold the heights of their corners, empty when both triangles were dropped
+    heights_.push_back(rows - 1);
+    widths_.push_back(cols - 1);
+    levels_.emplace_back(static_cast<size_t>(rows - 1) * (cols - 1));
+    for (int i = 0; i < rows - 1; i++) {
+        for (int j = 0; j < cols - 1; j++) {
+            size_t c = static_cast<size_t>(i) * (cols - 1) + j;
+            Bounds bounds{INFINITY, -INFINITY};
+            if (rejected_.empty() || rejected_[c] != 3) {
+                for (float corner : {z(i, j), z(i, j + 1), z(i + 1, j), z(i + 1, j + 1)}) {
+                    if (!std::isfinite(corner)) continue;
+                    bounds.min_ = std::min(bounds.min_, corner);
+                    bounds.max_ = std::max(bounds.max_, corner);
+                }
+            }
+            levels_[0][c] = bounds;
+        }
+    }
+    while (heights_.back() > 1 || widths_.back() > 1) {
+        const std::vector<Bounds>& below = levels_.back();
+        int below_height = heights_.back(), below_width = widths_.back();
+        int height = (below_height + 1) / 2, width = (below_width + 1) / 2;
+        std::vector<Bounds> level(static_cast<size_t>(height) * width, Bounds{INFINITY, -INFINITY});
+        for (int i = 0; i < below_height; i++) {
+            for (int j = 0; j < below_width; j++) {
+                const Bounds& child = below[static_cast<size_t>(i) * below_width + j];
+                Bounds& parent = level[static_cast<size_t>(i / 2) * width + j / 2];
+                parent.min_ = std::min(parent.min_, child.min_);
+                parent.max_ = std::max(parent.max_, child.max_);
+            }
+        }
+        levels_.push_back(std::move(level));
+        heights_.push_back(height);
+        widths_.push_back(width);
+    }
+}
+
+size_t HeightField::bytes() const {
+    size_t bytes = (xs_.size() + ys_.size() + zs_.size()) * sizeof(float) + rejected_.size();
+    for (const std::vector<Bounds>& level : levels_) bytes += level.size() * sizeof(Bounds);
+    return bytes;
+}
+
+bool HeightField::intersect(const float* origin, const float* direction, RayHit& hit) const {
+    if (levels_.empty()) return false;
+    float t0 = 0.0f, t1 = INFINITY;
+    if (!slab(origin[0], direction[0], xs_.front(), xs_.back(), t0, t1) ||
+        !slab(origin[1], direction[1], ys_.front(), ys_.back(), t0, t1)) {
+        return false;
+    }
+    if (view_.clip_ && !slab(origin[2], direction[2], -BOUND, BOUND, t0, t1)) return false;
+    return node(static_cast<int>(levels_.size()) - 1, 0, 0, origin, direction, t0, t1, hit);
+}
+
+/*
+    Block (i, j) of a level, which the ray crosses for t in [t0, t1]. Skipped
+    when the ray's heights over that span miss the block's, otherwise its
+    children are walked in the order the ray enters them, so the first hit
+    found is the nearest.
+*/
+bool HeightField::node(int level, int i, int j, const float* origin, const float* direction, float t0, float t1,
+                       RayHit& hit) const {
+    const Bounds& bounds = levels_[level][static_cast<size_t>(i) * widths_[level] + j];
+    float za = origin[2] + t0 * direction[2], zb = origin[2] + t1 * direction[2];
+    if (!(std::max(za, zb) >= bounds.min_ - EPSILON && std::min(za, zb) <= bounds.max_ + EPSILON)) return false;
+    if (level == 0) return cell(i, j, origin, direction, t0, t1, hit);
+
+    struct Child {
+        float t0_;
+        float t1_;
+        int i_;
+        int j_;
+    };
+    Child children[4];
+    int count = 0;
+    int span = 1 << (level - 1);
+    for (int ci = 2 * i; ci < std::min(2 * i + 2, heights_[level - 1]); ci++) {
+        for (int cj = 2 * j; cj < std::min(2 * j + 2, widths_[level - 1]); cj++) {
+            float c0 = t0, c1 = t1;
+            if (slab(origin[0], direction[0], xs_[cj * span], xs_[std::min((cj + 1) * span, cols_ - 1)], c0, c1) &&
+                slab(origin[1], direction[1], ys_[ci * span], ys_[std::min((ci + 1) * span, rows_ - 1)], c0, c1)) {
+                // Kept in entry order by insertion, there are at most 4
+                int c = count++;
+                for (; c > 0 && children[c - 1].t0_ > c0; c--) children[c] = children[c - 1];
+                children[c] = Child{c0, c1, ci, cj};
+            }
+        }
+    }
+    for (int c = 0; c < count; c++) {
+        if (node(level - 1, children[c].i_, children[c].j_, origin, direction, children[c].t0_, children[c].t1_, hit)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The two triangles of a cell, split like Geometry::clipTriangles does
+bool HeightField::cell(int i, int j, const float* origin, const float* direction, float t0, float t1, RayHit& hit) const {
+    float corners[4][3] = {{xs_[j], ys_[i + 1], z(i + 1, j)}, {xs_[j], ys_[i], z(i, j)},
+                           {xs_[j + 1], ys_[i + 1], z(i + 1, j + 1)}, {xs_[j + 1], ys_[i], z(i, j + 1)}};
+    uint8_t dropped = rejected_.empty() ? 0 : rejected_[static_cast<size_t>(i) * (cols_ - 1) + j];
+    const int triangles[2][3] = {{0, 1, 2}, {2, 1, 3}};
+    float best = INFINITY;
+    for (int k = 0; k < 2; k++) {
+        if (dropped & (1 << k)) continue;
+        float t;
+        if (triangle(origin, direction, corners[triangles[k][0]], corners[triangles[k][1]], corners[triangles[k][2]], t) &&
+            t >= t0 - EPSILON && t <= t1 + EPSILON) {
+            best = std::min(best, t);
+        }
+    }
+    if (best == INFINITY) return false;
+    hit = RayHit{best, t0, t1};
+    return true;
+}
+
+bool pickSurface(const Program& program, const HeightField* field, const PickView& view, const float* origin,
+                 const float* direction, Pick& pick) {
+    const PickView& window = field ? field->view() : view;
+    static Counter& hits = Metrics::counter("graphtex_picks_total", "Surface picks", "result=\"hit\"");
+    static Counter& misses = Metrics::counter("graphtex_picks_total", "Surface picks", "result=\"miss\"");
+    // View units to world units
+    double scale = window.range_ / BOUND;
+    std::vector<float> xs, ys, zs, scratch;
+    // Evaluates the surface at world points (xs, ys) into zs
+    auto evaluate = [&]() {
+        zs.resize(xs.size());
+        program.run({xs.data(), ys.data()}, {zs.data()}, xs.size(), scratch);
+    };
+    // Height of the ray above the surface at each t, in view units
+    auto above = [&](const std::vector<float>& ts, std::vector<float>& out) {
+        xs.resize(ts.size());
+        ys.resize(ts.size());
+        for (size_t k = 0; k < ts.size(); k++) {
+            xs[k] = window.center_x_ + (origin[0] + ts[k] * direction[0]) * scale;
+            ys[k] = window.center_y_ + (origin[1] + ts[k] * direction[1]) * scale;
+        }
+        evaluate();
+        out.resize(ts.size());
+        for (size_t k = 0; k < ts.size(); k++) out[k] = origin[2] + ts[k] * direction[2] - zs[k] / scale;
+    };
+
+    /*
+        Halves [lo, hi] while the ray crosses the surface in it. Returns false
+        when it does not, or when the crossing is a jump, like at a pole, rather
+        than the surface itself.
+    */
+    std::vector<float> ends(2), heights;
+    auto refine = [&](float lo, float hi, float& t) {
+        ends = {lo, hi};
+        above(ends, heights);
+        if (!std::isfinite(heights[0]) || !std::isfinite(heights[1]) || (heights[0] > 0) == (heights[1] > 0)) return false;
+        bool lo_above = heights[0] > 0;
+        ends.resize(1);
+        for (int step = 0; step < REFINE_STEPS && lo < hi; step++) {
+            ends[0] = 0.5f * (lo + hi);
+            above(ends, heights);
+            if (!std::isfinite(heights[0])) return false;
+            ((heights[0] > 0) == lo_above ? lo : hi) = ends[0];
+        }
+        t = 0.5f * (lo + hi);
+        ends[0] = t;
+        above(ends, heights);
+        return std::abs(heights[0]) <= CROSSING_GAP;
+    };
+
+    float t = 0.0f;
+    if (field) {
+        // Keep the mesh's hit where the expression does not cross the ray within the cell
+        RayHit hit;
+        if (!field->intersect(origin, direction, hit)) {
+            misses.add();
+            return false;
+        }
+        if (!refine(hit.t_enter_, hit.t_exit_, t)) t = hit.t_;
+    } else {
+        float t0 = 0.0f, t1 = INFINITY;
+        if (!slab(origin[0], direction[0], -BOUND, BOUND, t0, t1) || !slab(origin[1], direction[1], -BOUND, BOUND, t0, t1) ||
+            (window.clip_ && !slab(origin[2], direction[2], -BOUND, BOUND, t0, t1))) {
+            misses.add();
+            return false;
+        }
+        std::vector<float> ts(MARCH_SAMPLES), samples;
+        for (int k = 0; k < MARCH_SAMPLES; k++) ts[k] = t0 + (t1 - t0) * k / (MARCH_SAMPLES - 1);
+        above(ts, samples);
+        int k = 0;
+        for (; k + 1 < MARCH_SAMPLES; k++) {
+            if (std::isfinite(samples[k]) && std::isfinite(samples[k + 1]) && (samples[k] > 0) != (samples[k + 1] > 0) &&
+                refine(ts[k], ts[k + 1], t)) {
+                break;
+            }
+        }
+        if (k + 1 == MARCH_SAMPLES) {
+            misses.add();
+            return false;
+        }
+    }
+
+    // The point and its neighbours for central differences
+    double x = window.center_x_ + (origin[0] + t * direction[0]) * scale;
+    double y = window.center_y_ + (origin[1] + t * direction[1]) * scale;
+    double h = GRADIENT_STEP * scale;
+    xs = {static_cast<float>(x), static_cast<float>(x + h), static_cast<float>(x - h), static_cast<float>(x), static_cast<float>(x)};
+    ys = {static_cast<float>(y), static_cast<float>(y), static_cast<float>(y), static_cast<float>(y + h), static_cast<float>(y - h)};
+    evaluate();
+    if (!std::isfinite(zs[0])) {
+        misses.add();
+        return false;
+    }
+    pick = Pick{x, y, zs[0], (zs[1] - zs[2]) / (xs[1] - xs[2]), (zs[3] - zs[4]) / (ys[3] - ys[4]), t};
+    hits.add();
+    return true;
+}
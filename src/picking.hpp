@@ -0,0 +1,85 @@
+#pragma once
+#include "InTeX/compiler.hpp"
+#include <cstdint>
+#include <vector>
+
+// Window a view maps from, see Geometry::setVertex: view coordinates are world ones scaled by 10 / range_
+struct PickView {
+    double range_;
+    double center_x_;
+    double center_y_;
+    bool clip_;
+};
+
+// Crossing of a ray with a HeightField, t along the ray and the span of t over the cell it hit
+struct RayHit {
+    float t_;
+    float t_enter_;
+    float t_exit_;
+};
+
+/*
+    Heights of an explicit surface on its sampling grid, in view coordinates,
+    with a pyramid of the lowest and highest height over every 2^k x 2^k block
+    of cells. A ray walks down the pyramid through the blocks it crosses, in
+    the order it crosses them, and skips every block it passes over or under,
+    so only the few cells near the hit are ever tested.
+*/
+class HeightField {
+private:
+    struct Bounds {
+        float min_;
+        float max_;
+    };
+    int rows_;
+    int cols_;
+    PickView view_;
+    std::vector<float> xs_;
+    std::vector<float> ys_;
+    std::vector<float> zs_;
+    // Triangles crossDiscontinuity dropped, bit i for triangle i of each cell
+    std::vector<uint8_t> rejected_;
+    // Level k has a Bounds for every 2^k x 2^k block of cells, row by row, widths_[k] to a row
+    std::vector<std::vector<Bounds>> levels_;
+    std::vector<int> widths_;
+    std::vector<int> heights_;
+
+    float z(int i, int j) const { return zs_[static_cast<size_t>(i) * cols_ + j]; }
+    bool node(int level, int i, int j, const float* origin, const float* direction, float t0, float t1, RayHit& hit) const;
+    bool cell(int i, int j, const float* origin, const float* direction, float t0, float t1, RayHit& hit) const;
+public:
+    /*
+        grid holds rows x cols points, 3 floats each, as Geometry samples them.
+        Cell (i, j) is split into triangles like Geometry::clipTriangles does,
+        rejected has bit i of rejected[i * (cols - 1) + j] set for a triangle
+        it dropped, or is empty. Clipped views only answer inside the view box.
+    */
+    HeightField(const float* grid, int rows, int cols, const PickView& view, const std::vector<uint8_t>& rejected);
+
+    // First crossing of origin + t direction, t >= 0, with the triangles of the grid
+    bool intersect(const float* origin, const float* direction, RayHit& hit) const;
+    size_t bytes() const;
+    const PickView& view() const { return view_; }
+};
+
+// Point of a surface under a ray, in world coordinates, with the gradient of z there
+struct Pick {
+    double x_;
+    double y_;
+    double z_;
+    double dzdx_;
+    double dzdy_;
+    // Ray parameter of the hit, to find the nearest of several surfaces
+    float t_;
+};
+
+/*
+    Where a ray in view coordinates first meets z = f(x, y), program's only
+    output over inputs x and y. The hit on field's triangles is refined by
+    evaluating program along the ray within the cell it hit, so z and its
+    derivatives are the expression's own rather than the mesh's. Without a
+    field the ray is sampled at a fixed step over view instead, a field
+    brings the view it was sampled in.
+*/
+bool pickSurface(const Program& program, const HeightField* field, const PickView& view, const float* origin,
+                 const float* direction, Pick& pick);
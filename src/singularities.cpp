@@ -0,0 +1,194 @@
+#include "singularities.hpp"
+#include <cmath>
+#include <memory>
+
+namespace {
+
+// True if expr reads x or y
+bool varies(const Expr* expr) {
+    switch (expr->type_) {
+        case Type::VAR: {
+            const std::string& name = ((const Var*)expr)->value_;
+            return name == "x" || name == "y";
+        }
+        case Type::OP: return varies(((const Op*)expr)->e1_) || varies(((const Op*)expr)->e2_);
+        case Type::FRAC: return varies(((const Frac*)expr)->numerator_) || varies(((const Frac*)expr)->denominator_);
+        case Type::SQRT: return varies(((const Sqrt*)expr)->root_) || varies(((const Sqrt*)expr)->e_);
+        case Type::LOG: return varies(((const Log*)expr)->base_) || varies(((const Log*)expr)->e_);
+        case Type::LN: return varies(((const Ln*)expr)->e_);
+        case Type::LG: return varies(((const Lg*)expr)->e_);
+        case Type::ABS: return varies(((const Abs*)expr)->e_);
+        case Type::TRIG: return varies(((const Trig*)expr)->e_);
+        default: return false;
+    }
+}
+
+// True if expr reads no variable at all, not even a parameter
+bool constant(const Expr* expr) {
+    switch (expr->type_) {
+        case Type::NUM: return true;
+        case Type::OP: return constant(((const Op*)expr)->e1_) && constant(((const Op*)expr)->e2_);
+        case Type::FRAC: return constant(((const Frac*)expr)->numerator_) && constant(((const Frac*)expr)->denominator_);
+        case Type::SQRT: return constant(((const Sqrt*)expr)->root_) && constant(((const Sqrt*)expr)->e_);
+        case Type::LOG: return constant(((const Log*)expr)->base_) && constant(((const Log*)expr)->e_);
+        case Type::LN: return constant(((const Ln*)expr)->e_);
+        case Type::LG: return constant(((const Lg*)expr)->e_);
+        case Type::ABS: return constant(((const Abs*)expr)->e_);
+        case Type::TRIG: return constant(((const Trig*)expr)->e_);
+        default: return false;
+    }
+}
+
+// Value of a constant expression, folded by the compiler
+float value(const Expr* expr) {
+    Program program({expr}, {});
+    float out;
+    std::vector<float> scratch;
+    program.run({}, {&out}, 1, scratch);
+    return out;
+}
+
+// Indicators found so far, the ones built here are owned until compiled
+struct Found {
+    std::vector<const Expr*> indicators_;
+    std::vector<Singularities::Kind> kinds_;
+    std::vector<std::unique_ptr<Expr>> owned_;
+
+    void add(const Expr* g, Singularities::Kind kind) {
+        if (!varies(g) || indicators_.size() == MAX_SINGULAR_SETS) return;
+        indicators_.push_back(g);
+        kinds_.push_back(kind);
+    }
+    // Takes ownership of a new tree
+    void add(Expr* g, Singularities::Kind kind) {
+        owned_.emplace_back(g);
+        add(static_cast<const Expr*>(g), kind);
+    }
+};
+
+Expr* copy(const Expr* expr) {
+    return ((Expr*)expr)->copy();
+}
+
+void find(const Expr* expr, Found& found) {
+    using Kind = Singularities::Kind;
+    switch (expr->type_) {
+        case Type::OP: {
+            const Op* op = (const Op*)expr;
+            if (op->op_ == '/') found.add(op->e2_, Kind::POLE);
+            if (op->op_ == '^') {
+                // Negative integer powers blow up at zero, other powers of negative numbers are NaN
+                if (!constant(op->e2_)) {
+                    found.add(op->e1_, Kind::DOMAIN);
+                } else {
+                    float power = value(op->e2_);
+                    if (power != std::floor(power)) found.add(op->e1_, Kind::DOMAIN);
+                    else if (power < 0) found.add(op->e1_, Kind::POLE);
+                }
+            }
+            find(op->e1_, found);
+            find(op->e2_, found);
+            break;
+        }
+        case Type::FRAC: {
+            const Frac* frac = (const Frac*)expr;
+            found.add(frac->denominator_, Kind::POLE);
+            find(frac->numerator_, found);
+            find(frac->denominator_, found);
+            break;
+        }
+        case Type::SQRT: {
+            // Program::ROOT is a power, so odd roots of negative numbers are NaN too
+            const Sqrt* sqrt = (const Sqrt*)expr;
+            found.add(sqrt->e_, Kind::DOMAIN);
+            find(sqrt->root_, found);
+            find(sqrt->e_, found);
+            break;
+        }
+        case Type::LOG: {
+            const Log* log = (const Log*)expr;
+            found.add(log->e_, Kind::DOMAIN);
+            found.add(log->base_, Kind::DOMAIN);
+            find(log->base_, found);
+            find(log->e_, found);
+            break;
+        }
+        case Type::LN:
+            found.add(((const Ln*)expr)->e_, Kind::DOMAIN);
+            find(((const Ln*)expr)->e_, found);
+            break;
+        case Type::LG:
+            found.add(((const Lg*)expr)->e_, Kind::DOMAIN);
+            find(((const Lg*)expr)->e_, found);
+            break;
+        case Type::ABS:
+            find(((const Abs*)expr)->e_, found);
+            break;
+        case Type::TRIG: {
+            const Trig* trig = (const Trig*)expr;
+            const std::string& func = trig->func_;
+            const Expr* u = trig->e_;
+            if (func == "tan" || func == "sec") {
+                found.add(new Trig("cos", copy(u)), Kind::POLE);
+            } else if (func == "csc" || func == "cot") {
+                found.add(new Trig("sin", copy(u)), Kind::POLE);
+            } else if (func == "arcsin" || func == "arccos") {
+                found.add(new Op('-', new Num(1), new Op('*', copy(u), copy(u))), Kind::DOMAIN);
+            } else if (func == "arcsec" || func == "arccsc") {
+                found.add(new Op('-', new Op('*', copy(u), copy(u)), new Num(1)), Kind::DOMAIN);
+            } else if (func == "arccot") {
+                found.add(u, Kind::POLE);
+            }
+            find(u, found);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+}
+
+Singularities::Singularities(const Expr* expr, const std::vector<std::string>& parameters)
+    : surface_({expr}, {"x", "y"}, parameters), indicators_({}, {"x", "y"}, parameters) {
+    Found found;
+    find(expr, found);
+    kinds_ = found.kinds_;
+    indicators_ = Program(found.indicators_, {"x", "y"}, parameters);
+    for (const Expr* g : found.indicators_) {
+        indicator_.emplace_back(std::vector<const Expr*>{g}, std::vector<std::string>{"x", "y"}, parameters);
+    }
+}
+
+Singularities Singularities::bind(const std::vector<float>& values) const {
+    Singularities bound(*this);
+    bound.surface_ = surface_.bind(values);
+    bound.indicators_ = indicators_.bind(values);
+    for (size_t i = 0; i < indicator_.size(); i++) bound.indicator_[i] = indicator_[i].bind(values);
+    return bound;
+}
+
+void Singularities::signs(const float* xs, const float* ys, uint64_t* out, size_t count, std::vector<float>& scratch) const {
+    std::vector<float> values(kinds_.size() * count);
+    std::vector<float*> outputs;
+    for (size_t i = 0; i < kinds_.size(); i++) outputs.push_back(values.data() + i * count);
+    indicators_.run({xs, ys}, outputs, count, scratch);
+    for (size_t k = 0; k < count; k++) {
+        uint64_t bits = 0;
+        for (size_t i = 0; i < kinds_.size(); i++) {
+            float g = values[i * count + k];
+            bits |= static_cast<uint64_t>(g > 0) << i | static_cast<uint64_t>(g < 0) << (32 + i);
+        }
+        out[k] = bits;
+    }
+}
+
+float Singularities::indicator(size_t set, float x, float y, std::vector<float>& scratch) const {
+    float out;
+    indicator_[set].run({&x, &y}, {&out}, 1, scratch);
+    return out;
+}
+
+void Singularities::surface(const float* xs, const float* ys, float* out, size_t count, std::vector<float>& scratch) const {
+    surface_.run({xs, ys}, {out}, count, scratch);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "InTeX/ast.hpp"
+#include "InTeX/compiler.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Singular sets tracked per surface, one sign bit each
+constexpr size_t MAX_SINGULAR_SETS = 32;
+
+/*
+    Where an explicit surface z = f(x, y) can break, read off its tree rather
+    than guessed from its samples. Each singular set is where an indicator
+    g(x, y) changes sign:
+      POLE    denominators of fractions and divisions, bases of negative
+              powers, \cos of the argument of \tan and \sec, \sin of the
+              argument of \csc and \cot, and the argument of \arccot.
+              f jumps or blows up across the set.
+      DOMAIN  arguments of roots, logarithms and non-integer powers,
+              1 - u^2 for \arcsin(u) and \arccos(u), u^2 - 1 for \arcsec(u)
+              and \arccsc(u). f is only defined where g > 0.
+    Sets g only touches without changing sign, such as the pole of 1 / x^2,
+    are not found and are left to Geometry::crossDiscontinuity.
+*/
+class Singularities {
+public:
+    enum class Kind { POLE, DOMAIN };
+private:
+    std::vector<Kind> kinds_;
+    // f, every g at once for the grid, and each g alone for root finding
+    Program surface_;
+    Program indicators_;
+    std::vector<Program> indicator_;
+public:
+    // expr has inputs x and y, parameters keep one value per mesh like Program's
+    explicit Singularities(const Expr* expr, const std::vector<std::string>& parameters = {});
+    // Copy with values[i] as the i-th parameter, see Program::bind
+    Singularities bind(const std::vector<float>& values) const;
+
+    size_t count() const { return kinds_.size(); }
+    Kind kind(size_t set) const { return kinds_[set]; }
+    // Bit i of out[k] is set where g_i > 0 at (xs[k], ys[k]), bit 32 + i where g_i < 0
+    void signs(const float* xs, const float* ys, uint64_t* out, size_t count, std::vector<float>& scratch) const;
+    float indicator(size_t set, float x, float y, std::vector<float>& scratch) const;
+    // f at count points
+    void surface(const float* xs, const float* ys, float* out, size_t count, std::vector<float>& scratch) const;
+};
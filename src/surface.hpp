@@ -0,0 +1,31 @@
+#pragma once
+#include "InTeX/ast.hpp"
+#include "InTeX/evaluator.hpp"
+#include "InTeX/compiler.hpp"
+#include "tilecache.hpp"
+#include "singularities.hpp"
+#include <memory>
+
+/*
+    Immutable state of one equation as of one edit. Every edit publishes a new
+    snapshot instead of changing the old one, and mesh jobs hold a shared_ptr to
+    the snapshot they started from, so a job never sees an expression change
+    underneath it. An old snapshot, with its tiles, is freed when the last job
+    holding it finishes.
+*/
+struct Surface {
+    // Bumped on every edit of the equation
+    long long revision_;
+    // Type::IMPL for implicit equations, Type::PARA for parametric surfaces, Type::UNDEF for explicit z = f(x, y)
+    Type type_;
+    // Explicit surfaces only, copied by every Geometry worker and never evaluated itself
+    std::unique_ptr<const Evaluator> evaluator_;
+    // Compiled surface, inputs (x, y), (x, y, z) or (u, v) depending on the type, and the parameter t
+    std::shared_ptr<const Program> program_;
+    // Uses the animation time t, meshed from program_ bound to a value of t
+    bool animated_;
+    // Explicit surfaces only, poles and domain edges of the expression with the parameter t
+    std::shared_ptr<const Singularities> singularities_;
+    // Tiles of this expression, shared by the jobs meshing it at different views
+    std::shared_ptr<TileCache> cache_;
+};
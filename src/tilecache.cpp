@@ -0,0 +1,32 @@
+#include "tilecache.hpp"
+
+std::shared_ptr<const Tile> TileCache::find(const TileKey& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = tiles_.find(key);
+    if (it == tiles_.end()) return nullptr;
+    // Move to front of the LRU list
+    lru_.splice(lru_.begin(), lru_, it->second.second);
+    return it->second.first;
+}
+
+void TileCache::insert(const TileKey& key, std::shared_ptr<const Tile> tile) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = tiles_.find(key);
+    if (it != tiles_.end()) {
+        it->second.first = tile;
+        lru_.splice(lru_.begin(), lru_, it->second.second);
+        return;
+    }
+    lru_.push_front(key);
+    tiles_[key] = {tile, lru_.begin()};
+    // Evict least recently used tiles
+    while (tiles_.size() > capacity_) {
+        tiles_.erase(lru_.back());
+        lru_.pop_back();
+    }
+}
+
+size_t TileCache::size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return tiles_.size();
+}
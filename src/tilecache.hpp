@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Lattice samples per tile edge
+constexpr int TILE_SIZE = 32;
+
+// World position of lattice index (0, 0) and the spacing at level 0
+struct Lattice {
+    double origin_x_;
+    double origin_y_;
+    double unit_;
+
+    bool operator==(const Lattice& other) const {
+        return origin_x_ == other.origin_x_ && origin_y_ == other.origin_y_ && unit_ == other.unit_;
+    }
+};
+
+// Identifies a tile of lattice samples, spacing is unit_ * 2^level_ world units
+struct TileKey {
+    Lattice lattice_;
+    int level_;
+    long long tx_;
+    long long ty_;
+
+    bool operator==(const TileKey& other) const {
+        return lattice_ == other.lattice_ && level_ == other.level_ && tx_ == other.tx_ && ty_ == other.ty_;
+    }
+
+    struct TileKeyHash {
+        std::size_t operator()(const TileKey& key) const {
+            std::size_t seed = std::hash<double>{}(key.lattice_.origin_x_);
+            seed ^= std::hash<double>{}(key.lattice_.origin_y_) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            seed ^= std::hash<double>{}(key.lattice_.unit_) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            seed ^= std::hash<int>{}(key.level_) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            seed ^= std::hash<long long>{}(key.tx_) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            seed ^= std::hash<long long>{}(key.ty_) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            return seed;
+        }
+    };
+};
+
+// Evaluated z values of one tile, row major. Only samples flagged in valid_ hold results
+struct Tile {
+    std::vector<float> z_;
+    std::vector<uint8_t> valid_;
+
+    Tile() : z_(TILE_SIZE * TILE_SIZE, 0.0f), valid_(TILE_SIZE * TILE_SIZE, 0) {}
+};
+
+/*
+    Per equation store of evaluated world space tiles. Tiles are immutable once
+    inserted so mesh jobs can read them without holding the lock; filling in
+    more samples replaces the tile with a completed copy.
+    Each Surface snapshot owns its cache, and a job only writes to the cache of
+    the snapshot it pinned, so a job still running on an old expression can
+    never mix its tiles into the new one's.
+*/
+class TileCache {
+private:
+    using Entry = std::pair<std::shared_ptr<const Tile>, std::list<TileKey>::iterator>;
+
+    std::mutex mutex_;
+    std::unordered_map<TileKey, Entry, TileKey::TileKeyHash> tiles_;
+    std::list<TileKey> lru_;
+    size_t capacity_;
+public:
+    explicit TileCache(size_t capacity = 2048) : capacity_(capacity) {}
+
+    std::shared_ptr<const Tile> find(const TileKey& key);
+    void insert(const TileKey& key, std::shared_ptr<const Tile> tile);
+    size_t size();
+};
@@ -0,0 +1,106 @@
+#include "trace.hpp"
+#include "metrics.hpp"
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+std::atomic<bool> Trace::enabled_(false);
+
+static std::mutex mutex;
+static std::deque<TraceEvent> events;
+// Small stable numbers for the tid field
+static std::map<std::thread::id, int> threads;
+
+static thread_local std::string current_id;
+static thread_local long long current_job = 0;
+
+void Trace::setEnabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+long long Trace::now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::record(TraceEvent event) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = threads.emplace(std::this_thread::get_id(), threads.size() + 1).first;
+    event.thread_ = it->second;
+    events.push_back(std::move(event));
+    if (events.size() > MAX_EVENTS) events.pop_front();
+}
+
+std::vector<TraceEvent> Trace::find(const std::string& id, long long job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<TraceEvent> found;
+    for (const TraceEvent& event : events) {
+        if (event.job_ == job && event.id_ == id) found.push_back(event);
+    }
+    return found;
+}
+
+static std::string escape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+std::string Trace::toJson() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string json = "{\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); i++) {
+        const TraceEvent& event = events[i];
+        char times[96];
+        std::snprintf(times, sizeof(times), "\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%d",
+                      event.start_us_, event.duration_us_, event.thread_);
+        if (i > 0) json += ',';
+        json += "{\"name\":\"" + escape(event.name_) + "\",\"cat\":\"graphtex\",\"ph\":\"X\"," + times +
+                ",\"args\":{\"id\":\"" + escape(event.id_) + "\",\"job\":" + std::to_string(event.job_) + "}}";
+    }
+    json += "],\"displayTimeUnit\":\"ms\"}";
+    return json;
+}
+
+bool Trace::save(const std::string& path) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) return false;
+    file << toJson();
+    return static_cast<bool>(file);
+}
+
+void Trace::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    events.clear();
+}
+
+TraceJob::TraceJob(const std::string& id, long long job) : previous_id_(current_id), previous_job_(current_job) {
+    current_id = id;
+    current_job = job;
+}
+
+TraceJob::~TraceJob() {
+    current_id = previous_id_;
+    current_job = previous_job_;
+}
+
+TraceSpan::~TraceSpan() {
+    long long end = Trace::now();
+    Metrics::stage(name_).record(end - start_us_);
+    if (!Trace::enabled()) return;
+    Trace::record(TraceEvent{name_, current_id, current_job, start_us_, end - start_us_, 0});
+}
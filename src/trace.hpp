@@ -0,0 +1,70 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// One finished span, times in microseconds of the steady clock
+struct TraceEvent {
+    std::string name_;
+    std::string id_;
+    long long job_;
+    long long start_us_;
+    long long duration_us_;
+    int thread_;
+};
+
+/*
+    Process wide record of pipeline stages, written out in the Chrome trace
+    event format that chrome://tracing and Perfetto load. Spans are only
+    recorded while tracing is enabled, the oldest events are dropped past
+    MAX_EVENTS.
+*/
+class Trace {
+private:
+    static std::atomic<bool> enabled_;
+public:
+    static constexpr size_t MAX_EVENTS = 1 << 18;
+
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+    static void setEnabled(bool enabled);
+    static long long now();
+    static void record(TraceEvent event);
+    // Events of one equation and job in the order they finished
+    static std::vector<TraceEvent> find(const std::string& id, long long job);
+    static std::string toJson();
+    static bool save(const std::string& path);
+    static void clear();
+};
+
+/*
+    Sets the equation and job that spans on this thread belong to, for as long
+    as it is alive. Mesh jobs open one so the stages below them need no ids.
+*/
+class TraceJob {
+private:
+    std::string previous_id_;
+    long long previous_job_;
+public:
+    TraceJob(const std::string& id, long long job);
+    ~TraceJob();
+    TraceJob(const TraceJob&) = delete;
+    TraceJob& operator=(const TraceJob&) = delete;
+};
+
+/*
+    Times a stage from construction to destruction. The duration always goes
+    to the stage's latency histogram in Metrics, and to the trace of the
+    current job while tracing is enabled.
+*/
+class TraceSpan {
+private:
+    const char* name_;
+    long long start_us_;
+public:
+    explicit TraceSpan(const char* name) : name_(name), start_us_(Trace::now()) {}
+    ~TraceSpan();
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
@@ -1,4 +1,6 @@
+#pragma once
 #include <cmath>
+#include <functional>
 struct vec3 {
     float x, y, z;
 
@@ -68,15 +70,16 @@ struct vec3 {
         );
     }
 
-    bool isfinite() {
+    bool isfinite() const {
         return std::isfinite(x) && std::isfinite(y) && std::isfinite(z);
     }
 
+    // Hashes the exact components, truncating them put every vertex of a unit cell in one bucket
     struct Vec3Hash {
         std::size_t operator()(const vec3& v) const {
-            std::size_t h1 = std::hash<int>{}(static_cast<int>(v.x));
-            std::size_t h2 = std::hash<int>{}(static_cast<int>(v.y));
-            std::size_t h3 = std::hash<int>{}(static_cast<int>(v.z));
+            std::size_t h1 = std::hash<float>{}(v.x);
+            std::size_t h2 = std::hash<float>{}(v.y);
+            std::size_t h3 = std::hash<float>{}(v.z);
             std::size_t seed = h1;
             seed ^= h2 + 0x9e3779b9 + (seed << 6) + (seed >> 2);
             seed ^= h3 + 0x9e3779b9 + (seed << 6) + (seed >> 2);
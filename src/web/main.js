@@ -22,16 +22,57 @@ function throttle(func, delay) {
     };
 }
 
-function base64toFloat32(base64) {
-    const binary = atob(base64);
-    const len = binary.length;
-    const bytes = new Uint8Array(len);
-
-    for (let i = 0; i < len; i++) {
-        bytes[i] = binary.charCodeAt(i);
+// Inverse of the zigzag varint delta coding in meshcodec.cpp
+function decodeIndices(bytes, count) {
+    const indices = new Uint32Array(count);
+    let previous = 0;
+    let offset = 0;
+    for (let i = 0; i < count; i++) {
+        let zigzag = 0;
+        let shift = 0;
+        let byte;
+        do {
+            byte = bytes[offset++];
+            zigzag += (byte & 0x7f) * 2 ** shift;
+            shift += 7;
+        } while (byte & 0x80);
+        previous += zigzag % 2 ? -(zigzag + 1) / 2 : zigzag / 2;
+        indices[i] = previous;
     }
+    return indices;
+}
+
+// Views into a compact mesh, positions and normals stay quantized for the vertex shaders
+function decodeCompact(buffer, vertexCount, indexCount) {
+    const header = new Float32Array(buffer, 0, 6);
+    const positionBytes = Math.ceil(vertexCount * 6 / 4) * 4;
+    const vertices = new Uint16Array(buffer, 24, vertexCount * 3);
+    const normals = new Int16Array(buffer, 24 + positionBytes, vertexCount * 2);
+    const indices = decodeIndices(new Uint8Array(buffer, 24 + positionBytes + vertexCount * 4), indexCount);
+    const encoding = {offset: Array.from(header.subarray(0, 3)), scale: Array.from(header.subarray(3, 6))};
+    return {vertices, normals, indices, encoding};
+}
+
+// Views into contour lines, see encodeContours in meshcodec.cpp, positions stay quantized for the line shader
+function decodeContours(buffer, lineCount) {
+    const header = new Float32Array(buffer, 0, 6);
+    const lengths = new Uint32Array(buffer, 24, lineCount);
+    const pointCount = lengths.reduce((sum, length) => sum + length, 0);
+    const positions = new Uint16Array(buffer, 24 + lineCount * 4, pointCount * 3);
+    const encoding = {offset: Array.from(header.subarray(0, 3)), scale: Array.from(header.subarray(3, 6))};
+    return {positions, lengths, encoding};
+}
 
-    return new Float32Array(bytes.buffer);
+// Views into a heightfield, see encodeHeightfield in meshcodec.cpp, the vertex shaders rebuild its triangles
+function decodeHeightfield(buffer, half) {
+    const [rows, cols, clip] = new Uint32Array(buffer, 0, 3);
+    const xs = new Float32Array(buffer, 12, cols);
+    const ys = new Float32Array(buffer, 12 + cols * 4, rows);
+    let offset = 12 + (rows + cols) * 4;
+    const heights = half ? new Uint16Array(buffer, offset, rows * cols) : new Float32Array(buffer, offset, rows * cols);
+    offset += Math.ceil(rows * cols * (half ? 2 : 4) / 4) * 4;
+    const rejected = new Uint8Array(buffer, offset, Math.ceil((cols - 1) / 4) * (rows - 1));
+    return {rows, cols, clip: clip !== 0, half, xs, ys, heights, rejected};
 }
 
 function hexToRgb(hex) {
@@ -56,15 +97,101 @@ async function main() {
     Renderer.init(canvas);
     UI.init(throttleUpdateMesh);
 
-    bridge.meshUpdated.connect(function(id, verticesBase64, normalsBase64) {
-        const vertices = base64toFloat32(verticesBase64);
-        const normals = base64toFloat32(normalsBase64);
-        if (id in Renderer.getMeshes()) {
-            Renderer.updateMesh(id, vertices, normals);
+    // Latest mesh version applied per equation
+    const versions = {};
+    bridge.jobTraced.connect((id, job, stages) => UI.showTrace(id, job, stages));
+    bridge.animationTime.connect((time) => UI.showTime(time));
+    bridge.meshUpdated.connect(async function(id, version, vertexCount, indexCount, compact, interleaved, heightfield, baseVersion, patches, contourLines) {
+        const spans = [];
+        const span = (name, start) => spans.push([name, start, performance.now() - start]);
+        let start = performance.now();
+        // Patches only apply on top of the version they were computed against
+        const meshes = Renderer.getMeshes();
+        const patch = baseVersion !== 0 && versions[id] === baseVersion && id in meshes &&
+                      meshes[id].vertexCount === vertexCount && meshes[id].interleaved === interleaved;
+        if (patch && patches.length === 0) {
+            versions[id] = version;
+            // The surface is unchanged but its contour levels may not be
+            let contours = null;
+            if (contourLines) {
+                const contourResponse = await fetch(`mesh:${id}/${version}/contours`);
+                if (!contourResponse.ok) return;
+                contours = decodeContours(await contourResponse.arrayBuffer(), contourLines);
+            }
+            if (versions[id] !== version) return;
+            Renderer.updateContours(id, contours);
+            Renderer.render();
+            return;
+        }
+        // Contours always come whole, a patch does not cover them
+        const contourFetch = contourLines ? fetch(`mesh:${id}/${version}/contours`) : null;
+        const response = await fetch(`mesh:${id}/${version}` + (baseVersion !== 0 && !patch ? '/full' : ''));
+        const contourResponse = contourFetch && await contourFetch;
+        // A newer version replaced this one before it was fetched
+        if (!response.ok || (contourResponse && !contourResponse.ok)) return;
+        const buffer = await response.arrayBuffer();
+        const contours = contourResponse ? decodeContours(await contourResponse.arrayBuffer(), contourLines) : null;
+        span('fetch', start);
+        if (version < (versions[id] ?? 0)) return;
+        if (patch && versions[id] !== baseVersion) return;
+        versions[id] = version;
+
+        if (patch) {
+            const changed = patches.reduce((sum, [first, count]) => sum + count, 0);
+            start = performance.now();
+            if (interleaved) {
+                Renderer.patchMesh(id, new Float32Array(buffer, 0, changed * 6), null, patches);
+            } else {
+                Renderer.patchMesh(id, new Float32Array(buffer, 0, changed * 3),
+                                   new Float32Array(buffer, changed * 12, changed * 3), patches);
+            }
+            Renderer.updateContours(id, contours);
+            span('upload', start);
+            start = performance.now();
+            Renderer.render();
+            span('render', start);
+            UI.traceRenderer(id, version, spans);
+            return;
+        }
+
+        let mesh;
+        start = performance.now();
+        if (heightfield) {
+            mesh = {grid: decodeHeightfield(buffer, compact)};
+        } else if (compact) {
+            mesh = decodeCompact(buffer, vertexCount, indexCount);
+        } else if (interleaved) {
+            // Position and normal of each vertex go to the GPU as one buffer, then indices
+            mesh = {vertices: new Float32Array(buffer, 0, vertexCount * 6),
+                    normals: null,
+                    indices: new Uint32Array(buffer, vertexCount * 24, indexCount),
+                    encoding: null};
+        } else {
+            // Views into the fetched buffer: vertices, normals, then indices
+            mesh = {vertices: new Float32Array(buffer, 0, vertexCount * 3),
+                    normals: new Float32Array(buffer, vertexCount * 12, vertexCount * 3),
+                    indices: new Uint32Array(buffer, vertexCount * 24, indexCount),
+                    encoding: null};
+        }
+        span('decode', start);
+        start = performance.now();
+        if (mesh.grid && id in Renderer.getMeshes()) {
+            Renderer.updateHeightfield(id, mesh.grid);
+        } else if (mesh.grid) {
+            Renderer.addHeightfield(id, mesh.grid);
+            UI.styleMesh(id);
+        } else if (id in Renderer.getMeshes()) {
+            Renderer.updateMesh(id, mesh.vertices, mesh.normals, mesh.indices, mesh.encoding);
         } else {
-            Renderer.addMesh(id, vertices, normals);
+            Renderer.addMesh(id, mesh.vertices, mesh.normals, mesh.indices, mesh.encoding);
+            UI.styleMesh(id);
         }
+        Renderer.updateContours(id, contours);
+        span('upload', start);
+        start = performance.now();
         Renderer.render();
+        span('render', start);
+        UI.traceRenderer(id, version, spans);
     })
 }
 
@@ -1,3 +1,57 @@
+/*
+    Heightfield meshes, see updateHeightfield. Vertex gl_VertexID is corner
+    gl_VertexID % 3 of triangle gl_VertexID % 6 / 3 of cell gl_VertexID / 6,
+    split like Geometry::clipTriangles does. Textures are indexed by column in
+    x and row in y: heights, the x of each column and y of each row in two
+    rows, and 2 bits per cell for the triangles Geometry dropped.
+*/
+const GRID_GLSL = `
+        uniform bool u_grid;
+        uniform highp sampler2D u_heights;
+        uniform highp sampler2D u_axes;
+        uniform highp usampler2D u_rejected;
+
+        bool gridDropped(ivec2 cell, int triangle) {
+            ivec2 cells = textureSize(u_heights, 0) - 1;
+            if (any(lessThan(cell, ivec2(0))) || any(greaterThanEqual(cell, cells))) return true;
+            uint bits = texelFetch(u_rejected, ivec2(cell.x / 4, cell.y), 0).r;
+            return ((bits >> uint(2 * (cell.x % 4) + triangle)) & 1u) != 0u;
+        }
+
+        vec3 gridPoint(ivec2 p) {
+            return vec3(texelFetch(u_axes, ivec2(p.x, 0), 0).r, texelFetch(u_axes, ivec2(p.y, 1), 0).r,
+                        texelFetch(u_heights, p, 0).r);
+        }
+
+        ivec2 gridCorner(ivec2 cell, int triangle, int k) {
+            if (triangle == 0) return cell + (k == 0 ? ivec2(0, 1) : k == 1 ? ivec2(0, 0) : ivec2(1, 1));
+            return cell + (k == 0 ? ivec2(1, 1) : k == 1 ? ivec2(0, 0) : ivec2(1, 0));
+        }
+
+        // Grid point of this vertex, false when its triangle was dropped
+        bool gridVertex(out ivec2 point) {
+            int cols = textureSize(u_heights, 0).x - 1;
+            int triangle = gl_VertexID % 6 / 3;
+            ivec2 cell = ivec2(gl_VertexID / 6 % cols, gl_VertexID / 6 / cols);
+            point = gridCorner(cell, triangle, gl_VertexID % 3);
+            return !gridDropped(cell, triangle);
+        }
+
+        // Unnormalized like Geometry::pushNormal, so larger triangles weigh more
+        vec3 gridFace(ivec2 cell, int triangle) {
+            if (gridDropped(cell, triangle)) return vec3(0.0);
+            vec3 v0 = gridPoint(gridCorner(cell, triangle, 0));
+            vec3 v1 = gridPoint(gridCorner(cell, triangle, 1));
+            vec3 v2 = gridPoint(gridCorner(cell, triangle, 2));
+            return cross(v2 - v1, v0 - v1);
+        }
+
+        // Sum of the six triangles around a grid point that were kept
+        vec3 gridNormal(ivec2 p) {
+            return gridFace(p, 0) + gridFace(p, 1) + gridFace(p - ivec2(1, 0), 1) + gridFace(p - ivec2(0, 1), 0) +
+                   gridFace(p - ivec2(1, 1), 0) + gridFace(p - ivec2(1, 1), 1);
+        }`;
+
 class Renderer {
     // general webgl properties
     static #gl;
@@ -6,6 +60,8 @@ class Renderer {
     static isUpdating = null;
     static pendingUpdate = null;
     static activeShader = 'diffuse';
+    // Called with the pointer's ray in mesh coordinates and its position on the canvas, or null once it leaves
+    static onHover = null;
     static lightPos = [20 * Math.cos(Math.PI/2) * Math.sin(3 * Math.PI/2),
                        20 * Math.sin(Math.PI/2),
                        20 * Math.cos(Math.PI/2) * Math.cos(3 * Math.PI/2)];
@@ -28,6 +84,17 @@ class Renderer {
         camLocation: undefined,
         colorLocation: undefined,
         wireframeColorLocation: undefined,
+        wireframeOffsetLocation: undefined,
+        wireframeScaleLocation: undefined,
+        lineOffsetLocation: undefined,
+        lineScaleLocation: undefined,
+        phongOffsetLocation: undefined,
+        phongScaleLocation: undefined,
+        octahedralLocation: undefined,
+        // u_grid and u_clip of each program, see #gridLocations
+        wireframeGridLocations: undefined,
+        lineGridLocations: undefined,
+        phongGridLocations: undefined,
         worldMatrixLocation: undefined,
         phongProjectionMatrixLocation: undefined,
         specularLocation: undefined
@@ -43,21 +110,38 @@ class Renderer {
         precision highp float;
         in vec3 a_position;
         uniform mat4 u_matrix;
+        uniform vec3 u_offset;
+        uniform vec3 u_scale;
         out vec3 bary;
+        out float v_z;
+        ${GRID_GLSL}
         void main() {
             int id = gl_VertexID % 3;
             if (id == 0) bary = vec3(1, 0, 0);
             else if (id == 1) bary = vec3(0, 1, 0);
             else bary = vec3(0, 0, 1);
-            gl_Position = u_matrix * vec4(a_position, 1);
+            vec3 position = u_offset + a_position * u_scale;
+            ivec2 point;
+            if (u_grid && !gridVertex(point)) {
+                // Every corner of a dropped triangle lands on the same point outside the view
+                gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+                return;
+            }
+            if (u_grid) position = gridPoint(point);
+            v_z = position.z;
+            gl_Position = u_matrix * vec4(position, 1);
         }`,
         wireframefs: `#version 300 es
         precision highp float;
         in vec3 bary;
+        in float v_z;
         out vec4 fragColor;
         
         uniform vec3 u_color;
+        // Heightfields are cut off at the view box here, other meshes come clipped
+        uniform bool u_clip;
         void main() {
+            if (u_clip && abs(v_z) > 10.0) discard;
             float minCoord = min(bary.x, min(bary.y, bary.z));
             fragColor = vec4((u_color * smoothstep(0.0, .05, minCoord)), 1.0);
         }`,
@@ -66,9 +150,24 @@ class Renderer {
         in vec3 a_position;
 
         uniform mat4 u_matrix;
+        uniform vec3 u_offset;
+        uniform vec3 u_scale;
+        uniform bool u_clip;
+        ${GRID_GLSL}
          
         void main() {
-            gl_Position = u_matrix * vec4(a_position, 1);
+            vec3 position = u_offset + a_position * u_scale;
+            if (u_grid) {
+                ivec2 point;
+                bool kept = gridVertex(point);
+                position = gridPoint(point);
+                // Points of dropped triangles, or cut off by the view box, land outside the view
+                if (!kept || (u_clip && abs(position.z) > 10.0)) {
+                    gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+                    return;
+                }
+            }
+            gl_Position = u_matrix * vec4(position, 1);
         }`,
         linefs: `#version 300 es
         precision highp float;
@@ -93,14 +192,38 @@ class Renderer {
         uniform mat4 u_world;
         uniform vec3 u_light_pos;
         uniform vec3 u_cam_pos;
+        // Compact meshes store positions as normalized offsets and normals octahedrally in xy
+        uniform vec3 u_offset;
+        uniform vec3 u_scale;
+        uniform bool u_octahedral;
+        ${GRID_GLSL}
+
+        vec3 octahedralDecode(vec2 e) {
+            vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+            float t = max(-n.z, 0.0);
+            n.x += n.x >= 0.0 ? -t : t;
+            n.y += n.y >= 0.0 ? -t : t;
+            return normalize(n);
+        }
 
         void main() {
-            v_normal = mat3(u_world) * a_normal;
-            v_position = (u_world * vec4(a_position, 1.0)).xyz;
-            v_raw = a_position;
+            vec3 position = u_offset + a_position * u_scale;
+            vec3 normal = u_octahedral ? octahedralDecode(a_normal.xy) : a_normal;
+            ivec2 point;
+            if (u_grid && !gridVertex(point)) {
+                gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+                return;
+            }
+            if (u_grid) {
+                position = gridPoint(point);
+                normal = normalize(gridNormal(point));
+            }
+            v_normal = mat3(u_world) * normal;
+            v_position = (u_world * vec4(position, 1.0)).xyz;
+            v_raw = position;
             v_to_light = u_light_pos - v_position;
             v_to_cam = u_cam_pos - v_position;
-            gl_Position = u_matrix * vec4(a_position, 1);
+            gl_Position = u_matrix * vec4(position, 1);
         }`,
         phongfs: `#version 300 es
         precision highp float;
@@ -115,8 +238,10 @@ class Renderer {
         
         uniform vec3 u_color;
         uniform int u_specular;
+        uniform bool u_clip;
 
         void main() {
+            if (u_clip && abs(v_raw.z) > 10.0) discard;
             vec3 norm = gl_FrontFacing ? normalize(v_normal) : -normalize(v_normal);
             vec3 light_dir = normalize(v_to_light);
             vec3 cam_dir = normalize(v_to_cam);
@@ -133,6 +258,8 @@ class Renderer {
     static #wireframeProgram;
     static #lineProgram;
     static #phongProgram;
+    // Heightfields take every vertex from textures, so they are drawn without attributes
+    static #gridVao;
     static #displayWidth;
     static #displayHeight;
     static #range = 10;
@@ -176,11 +303,17 @@ class Renderer {
         Renderer.#varLocations.wireframePositionLocation = Renderer.#gl.getAttribLocation(Renderer.#wireframeProgram, "a_position");
         Renderer.#varLocations.wireframeProjectionMatrixLocation = Renderer.#gl.getUniformLocation(Renderer.#wireframeProgram, "u_matrix");
         Renderer.#varLocations.wireframeColorLocation = Renderer.#gl.getUniformLocation(Renderer.#wireframeProgram, "u_color")
+        Renderer.#varLocations.wireframeOffsetLocation = Renderer.#gl.getUniformLocation(Renderer.#wireframeProgram, "u_offset");
+        Renderer.#varLocations.wireframeScaleLocation = Renderer.#gl.getUniformLocation(Renderer.#wireframeProgram, "u_scale");
+        Renderer.#varLocations.wireframeGridLocations = Renderer.#gridLocations(Renderer.#wireframeProgram);
         // set up line shaders
         Renderer.#lineProgram = webglUtils.createProgramFromSources(Renderer.#gl, [Renderer.#shaders.linevs, Renderer.#shaders.linefs]);
         Renderer.#gl.useProgram(Renderer.#lineProgram);
         Renderer.#varLocations.linePositionLocation = Renderer.#gl.getAttribLocation(Renderer.#lineProgram, "a_position");
         Renderer.#varLocations.lineProjectionMatrixLocation = Renderer.#gl.getUniformLocation(Renderer.#lineProgram, "u_matrix");
+        Renderer.#varLocations.lineOffsetLocation = Renderer.#gl.getUniformLocation(Renderer.#lineProgram, "u_offset");
+        Renderer.#varLocations.lineScaleLocation = Renderer.#gl.getUniformLocation(Renderer.#lineProgram, "u_scale");
+        Renderer.#varLocations.lineGridLocations = Renderer.#gridLocations(Renderer.#lineProgram);
 
         // set up axes vao
         Renderer.#gl.bindVertexArray(Renderer.#meshes.axes.vao);
@@ -203,6 +336,11 @@ class Renderer {
         Renderer.#varLocations.camLocation = Renderer.#gl.getUniformLocation(Renderer.#phongProgram, "u_cam_pos");
         Renderer.#varLocations.colorLocation = Renderer.#gl.getUniformLocation(Renderer.#phongProgram, "u_color");
         Renderer.#varLocations.specularLocation = Renderer.#gl.getUniformLocation(Renderer.#phongProgram, "u_specular");
+        Renderer.#varLocations.phongOffsetLocation = Renderer.#gl.getUniformLocation(Renderer.#phongProgram, "u_offset");
+        Renderer.#varLocations.phongScaleLocation = Renderer.#gl.getUniformLocation(Renderer.#phongProgram, "u_scale");
+        Renderer.#varLocations.octahedralLocation = Renderer.#gl.getUniformLocation(Renderer.#phongProgram, "u_octahedral");
+        Renderer.#varLocations.phongGridLocations = Renderer.#gridLocations(Renderer.#phongProgram);
+        Renderer.#gridVao = Renderer.#gl.createVertexArray();
 
         const fov = Math.PI / 4;
         const aspect = Renderer.#canvas.clientWidth / Renderer.#canvas.clientHeight;
@@ -238,9 +376,15 @@ class Renderer {
                 Renderer.#cameraConfig.yaw = (Renderer.#cameraConfig.yaw % (2 * Math.PI) + (2 * Math.PI)) % (2 * Math.PI)
                 Renderer.#cameraConfig.pitch = Math.max(-Math.PI / 2 + .1, Math.min(Math.PI/2 - .1, Renderer.#cameraConfig.pitch % (2 * Math.PI) + (2 * Math.PI) % (2 * Math.PI)))
                 Renderer.updateCameraMatrix();
+            } else if (Renderer.onHover) {
+                Renderer.onHover(Renderer.#pointerRay(e), e.offsetX, e.offsetY);
             }
         });
 
+        Renderer.#canvas.addEventListener('pointerleave', () => {
+            if (Renderer.onHover) Renderer.onHover(null);
+        });
+
         window.addEventListener('resize', () => {
             Renderer.#canvas.width = Renderer.#canvas.clientWidth;
             Renderer.#canvas.height = Renderer.#canvas.clientHeight;
@@ -257,6 +401,26 @@ class Renderer {
         });
     }
 
+    // Unprojects the pointer through the near and far planes, back into the coordinates meshes are drawn in
+    static #pointerRay(e) {
+        const rect = Renderer.#canvas.getBoundingClientRect();
+        const x = (e.clientX - rect.left) / rect.width * 2 - 1;
+        const y = 1 - (e.clientY - rect.top) / rect.height * 2;
+        const inverse = m4.inverse(Renderer.#matrices.worldViewProjectionMatrix);
+        const near = m4.transformPoint(inverse, [x, y, -1]);
+        const far = m4.transformPoint(inverse, [x, y, 1]);
+        return {origin: Array.from(near), direction: [far[0] - near[0], far[1] - near[1], far[2] - near[2]]};
+    }
+
+    // u_grid and u_clip of the program in use, whose samplers are pointed at the texture units #bindGrid fills
+    static #gridLocations(program) {
+        Renderer.#gl.uniform1i(Renderer.#gl.getUniformLocation(program, "u_heights"), 0);
+        Renderer.#gl.uniform1i(Renderer.#gl.getUniformLocation(program, "u_axes"), 1);
+        Renderer.#gl.uniform1i(Renderer.#gl.getUniformLocation(program, "u_rejected"), 2);
+        return {grid: Renderer.#gl.getUniformLocation(program, "u_grid"),
+                clip: Renderer.#gl.getUniformLocation(program, "u_clip")};
+    }
+
     static getMeshes() {
         return Renderer.#meshes;
     }
@@ -326,86 +490,293 @@ class Renderer {
     static updateColor(name, color) {
         const rgb = hexToRgb(color).map(c => c/255);
         Renderer.#meshes[name].color = rgb;
+        Renderer.#drawOverview();
         Renderer.render();
     }
 
-    static addMesh(name, vertices, normals) {
+    // Hidden meshes keep their buffers but are skipped when drawing
+    static setVisible(name, visible) {
+        if (!(name in Renderer.#meshes)) return;
+        Renderer.#meshes[name].visible = visible;
+        Renderer.#drawOverview();
+        Renderer.render();
+    }
+
+    static addMesh(name, vertices, normals, indices = null, encoding = null) {
+        Renderer.#createMesh(name);
+        Renderer.updateMesh(name, vertices, normals, indices, encoding);
+    }
+
+    static addHeightfield(name, grid) {
+        Renderer.#createMesh(name);
+        Renderer.updateHeightfield(name, grid);
+    }
+
+    static #createMesh(name) {
         Renderer.#meshes[name] = {};
-        Renderer.#meshes[name].vertices = vertices;
-        Renderer.#meshes[name].normals = normals;
         Renderer.#meshes[name].color = [1, 0, 0];
+        Renderer.#meshes[name].visible = true;
         Renderer.#meshes[name].vaos = [Renderer.#gl.createVertexArray(),
                                        Renderer.#gl.createVertexArray(), 
                                        Renderer.#gl.createVertexArray()];
+        // positions, normals, triangle indices, unindexed positions for the wireframe.
+        // Interleaved meshes keep their normals in the position buffer and leave the second one empty
         Renderer.#meshes[name].buffers = [Renderer.#gl.createBuffer(), 
-                                          Renderer.#gl.createBuffer()];
-        Renderer.#gl.bindVertexArray(Renderer.#meshes[name].vaos[0]);
-        // Binding position buffer
-        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, Renderer.#meshes[name].buffers[0]);
-        Renderer.#gl.bufferData(Renderer.#gl.ARRAY_BUFFER, vertices, Renderer.#gl.STATIC_DRAW);
-        Renderer.#gl.enableVertexAttribArray(Renderer.#varLocations.phongPositionLocation);
-        Renderer.#gl.vertexAttribPointer(Renderer.#varLocations.phongPositionLocation, 3, Renderer.#gl.FLOAT, false, 0, 0);
-        // Binding normal buffer
-        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, Renderer.#meshes[name].buffers[1]);
-        Renderer.#gl.bufferData(Renderer.#gl.ARRAY_BUFFER, normals, Renderer.#gl.STATIC_DRAW);
-        Renderer.#gl.enableVertexAttribArray(Renderer.#varLocations.normalLocation);
-        Renderer.#gl.vertexAttribPointer(Renderer.#varLocations.normalLocation, 3, Renderer.#gl.FLOAT, false, 0, 0);
-        // Setting up wireframe vao
-        Renderer.#gl.bindVertexArray(Renderer.#meshes[name].vaos[1]);
-        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, Renderer.#meshes[name].buffers[0]);
-        Renderer.#gl.enableVertexAttribArray(Renderer.#varLocations.wireframePositionLocation);
-        Renderer.#gl.vertexAttribPointer(Renderer.#varLocations.wireframePositionLocation, 3, Renderer.#gl.FLOAT, false, 0, 0);
-        // Setting up points vao
-        Renderer.#gl.bindVertexArray(Renderer.#meshes[name].vaos[2]);
-        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, Renderer.#meshes[name].buffers[0]);
-        Renderer.#gl.enableVertexAttribArray(Renderer.#varLocations.linePositionLocation);
-        Renderer.#gl.vertexAttribPointer(Renderer.#varLocations.linePositionLocation, 3, Renderer.#gl.FLOAT, false, 0, 0);
+                                          Renderer.#gl.createBuffer(),
+                                          null,
+                                          null];
+        Renderer.#meshes[name].grid = null;
     }
 
-    static updateMesh(name, vertices, normals) {
-        Renderer.#meshes[name].vertices = vertices;
-        Renderer.#meshes[name].normals = normals;
+    // encoding holds the offset and scale of compact meshes, whose positions are
+    // Uint16Array and normals octahedral Int16Array pairs. Without normals, vertices
+    // is interleaved: the position and normal of each vertex as 6 floats
+    static updateMesh(name, vertices, normals, indices = null, encoding = null) {
+        const mesh = Renderer.#meshes[name];
+        Renderer.#deleteGrid(mesh);
+        mesh.vertices = vertices;
+        mesh.normals = normals;
+        mesh.encoding = encoding;
+        mesh.interleaved = !normals;
+        // Bytes from one vertex to the next in the position buffer, 0 when tightly packed
+        mesh.stride = mesh.interleaved ? 24 : 0;
+        mesh.vertexCount = vertices.length / (mesh.interleaved ? 6 : 3);
+        // Indexed meshes share vertices between triangles, soups list three per triangle
+        mesh.indices = indices && indices.length ? indices : null;
         // phong/normal vao
-        Renderer.#gl.bindVertexArray(Renderer.#meshes[name].vaos[0]);
-        Renderer.#gl.deleteBuffer(Renderer.#meshes[name].buffers[0]);
-        Renderer.#meshes[name].buffers[0] = Renderer.#gl.createBuffer();
-        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, Renderer.#meshes[name].buffers[0]);
+        Renderer.#gl.bindVertexArray(mesh.vaos[0]);
+        Renderer.#gl.deleteBuffer(mesh.buffers[0]);
+        mesh.buffers[0] = Renderer.#gl.createBuffer();
+        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, mesh.buffers[0]);
         Renderer.#gl.bufferData(Renderer.#gl.ARRAY_BUFFER, vertices, Renderer.#gl.STATIC_DRAW);
         Renderer.#gl.enableVertexAttribArray(Renderer.#varLocations.phongPositionLocation);
-        Renderer.#gl.vertexAttribPointer(Renderer.#varLocations.phongPositionLocation, 3, Renderer.#gl.FLOAT, false, 0, 0);
+        Renderer.#positionPointer(mesh, Renderer.#varLocations.phongPositionLocation);
         
-        Renderer.#gl.deleteBuffer(Renderer.#meshes[name].buffers[1]);
-        Renderer.#meshes[name].buffers[1] = Renderer.#gl.createBuffer();
-        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, Renderer.#meshes[name].buffers[1]);
-        Renderer.#gl.bufferData(Renderer.#gl.ARRAY_BUFFER, normals, Renderer.#gl.STATIC_DRAW);
+        Renderer.#gl.deleteBuffer(mesh.buffers[1]);
+        mesh.buffers[1] = null;
+        if (!mesh.interleaved) {
+            mesh.buffers[1] = Renderer.#gl.createBuffer();
+            Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, mesh.buffers[1]);
+            Renderer.#gl.bufferData(Renderer.#gl.ARRAY_BUFFER, normals, Renderer.#gl.STATIC_DRAW);
+        }
         Renderer.#gl.enableVertexAttribArray(Renderer.#varLocations.normalLocation);
-        Renderer.#gl.vertexAttribPointer(Renderer.#varLocations.normalLocation, 3, Renderer.#gl.FLOAT, false, 0, 0);
-        // wireframe vao
-        Renderer.#gl.bindVertexArray(Renderer.#meshes[name].vaos[1]);
-        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, Renderer.#meshes[name].buffers[0]);
-        Renderer.#gl.enableVertexAttribArray(Renderer.#varLocations.wireframePositionLocation);
-        Renderer.#gl.vertexAttribPointer(Renderer.#varLocations.wireframePositionLocation, 3, Renderer.#gl.FLOAT, false, 0, 0);
+        if (mesh.interleaved) {
+            // Same buffer as the positions, 12 bytes into each vertex
+            Renderer.#gl.vertexAttribPointer(Renderer.#varLocations.normalLocation, 3, Renderer.#gl.FLOAT, false, 24, 12);
+        } else if (encoding) {
+            Renderer.#gl.vertexAttribPointer(Renderer.#varLocations.normalLocation, 2, Renderer.#gl.SHORT, true, 0, 0);
+        } else {
+            Renderer.#gl.vertexAttribPointer(Renderer.#varLocations.normalLocation, 3, Renderer.#gl.FLOAT, false, 0, 0);
+        }
+
+        Renderer.#gl.deleteBuffer(mesh.buffers[2]);
+        mesh.buffers[2] = null;
+        if (mesh.indices) {
+            mesh.buffers[2] = Renderer.#gl.createBuffer();
+            Renderer.#gl.bindBuffer(Renderer.#gl.ELEMENT_ARRAY_BUFFER, mesh.buffers[2]);
+            Renderer.#gl.bufferData(Renderer.#gl.ELEMENT_ARRAY_BUFFER, mesh.indices, Renderer.#gl.STATIC_DRAW);
+        }
+        // wireframe vao, indexed meshes are unrolled on first use
+        Renderer.#gl.deleteBuffer(mesh.buffers[3]);
+        mesh.buffers[3] = null;
+        if (!mesh.indices) {
+            Renderer.#bindWireframe(mesh, mesh.buffers[0]);
+        }
         // points vao
-        Renderer.#gl.bindVertexArray(Renderer.#meshes[name].vaos[2]);
-        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, Renderer.#meshes[name].buffers[0]);
+        Renderer.#gl.bindVertexArray(mesh.vaos[2]);
+        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, mesh.buffers[0]);
         Renderer.#gl.enableVertexAttribArray(Renderer.#varLocations.linePositionLocation);
-        Renderer.#gl.vertexAttribPointer(Renderer.#varLocations.linePositionLocation, 3, Renderer.#gl.FLOAT, false, 0, 0);
+        Renderer.#positionPointer(mesh, Renderer.#varLocations.linePositionLocation);
+        Renderer.#gl.bindVertexArray(null);
+    }
+
+    /*
+        Sampled grid of an explicit surface, see decodeHeightfield. It goes to
+        textures as it is and the vertex shaders rebuild every triangle from
+        them, see GRID_GLSL, so the mesh has no vertex buffers.
+    */
+    static updateHeightfield(name, grid) {
+        const mesh = Renderer.#meshes[name];
+        Renderer.#deleteGrid(mesh);
+        mesh.buffers.forEach(buffer => Renderer.#gl.deleteBuffer(buffer));
+        mesh.buffers = [null, null, null, null];
+        mesh.vertices = null;
+        mesh.normals = null;
+        mesh.encoding = null;
+        mesh.interleaved = false;
+        mesh.stride = 0;
+        mesh.indices = null;
+        mesh.vertexCount = 6 * (grid.rows - 1) * (grid.cols - 1);
+
+        const width = Math.max(grid.rows, grid.cols);
+        const axes = new Float32Array(2 * width);
+        axes.set(grid.xs, 0);
+        axes.set(grid.ys, width);
+        // Rows of half floats and of rejected bits are not padded to 4 bytes
+        Renderer.#gl.pixelStorei(Renderer.#gl.UNPACK_ALIGNMENT, 1);
+        mesh.grid = {clip: grid.clip, textures: [
+            Renderer.#gridTexture(grid.half ? Renderer.#gl.R16F : Renderer.#gl.R32F, grid.cols, grid.rows, Renderer.#gl.RED,
+                                  grid.half ? Renderer.#gl.HALF_FLOAT : Renderer.#gl.FLOAT, grid.heights),
+            Renderer.#gridTexture(Renderer.#gl.R32F, width, 2, Renderer.#gl.RED, Renderer.#gl.FLOAT, axes),
+            Renderer.#gridTexture(Renderer.#gl.R8UI, Math.ceil((grid.cols - 1) / 4), grid.rows - 1, Renderer.#gl.RED_INTEGER,
+                                  Renderer.#gl.UNSIGNED_BYTE, grid.rejected)]};
+        Renderer.#gl.pixelStorei(Renderer.#gl.UNPACK_ALIGNMENT, 4);
+    }
+
+    // Only read with texelFetch, so never filtered
+    static #gridTexture(internalFormat, width, height, format, type, data) {
+        const texture = Renderer.#gl.createTexture();
+        Renderer.#gl.bindTexture(Renderer.#gl.TEXTURE_2D, texture);
+        Renderer.#gl.texImage2D(Renderer.#gl.TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, data);
+        Renderer.#gl.texParameteri(Renderer.#gl.TEXTURE_2D, Renderer.#gl.TEXTURE_MIN_FILTER, Renderer.#gl.NEAREST);
+        Renderer.#gl.texParameteri(Renderer.#gl.TEXTURE_2D, Renderer.#gl.TEXTURE_MAG_FILTER, Renderer.#gl.NEAREST);
+        // A sampler of the wrong type must never find it on unit 0, see #bindGrid
+        Renderer.#gl.bindTexture(Renderer.#gl.TEXTURE_2D, null);
+        return texture;
+    }
+
+    // Textures of a heightfield to the units its samplers read, see #gridLocations
+    static #bindGrid(mesh) {
+        mesh.grid.textures.forEach((texture, unit) => {
+            Renderer.#gl.activeTexture(Renderer.#gl.TEXTURE0 + unit);
+            Renderer.#gl.bindTexture(Renderer.#gl.TEXTURE_2D, texture);
+        });
+        Renderer.#gl.activeTexture(Renderer.#gl.TEXTURE0);
+    }
+
+    static #deleteGrid(mesh) {
+        if (!mesh.grid) return;
+        mesh.grid.textures.forEach(texture => Renderer.#gl.deleteTexture(texture));
+        mesh.grid = null;
+    }
+
+    // Overwrites the vertex ranges [first, count] of a mesh with the same layout in place,
+    // normals is null for interleaved meshes
+    static patchMesh(name, vertices, normals, ranges) {
+        const mesh = Renderer.#meshes[name];
+        let offset = 0;
+        for (const [first, count] of ranges) {
+            Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, mesh.buffers[0]);
+            if (mesh.interleaved) {
+                Renderer.#gl.bufferSubData(Renderer.#gl.ARRAY_BUFFER, first * 24, vertices, offset * 6, count * 6);
+                mesh.vertices.set(vertices.subarray(offset * 6, (offset + count) * 6), first * 6);
+                offset += count;
+                continue;
+            }
+            Renderer.#gl.bufferSubData(Renderer.#gl.ARRAY_BUFFER, first * 12, vertices, offset * 3, count * 3);
+            Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, mesh.buffers[1]);
+            Renderer.#gl.bufferSubData(Renderer.#gl.ARRAY_BUFFER, first * 12, normals, offset * 3, count * 3);
+            mesh.vertices.set(vertices.subarray(offset * 3, (offset + count) * 3), first * 3);
+            mesh.normals.set(normals.subarray(offset * 3, (offset + count) * 3), first * 3);
+            offset += count;
+        }
+    }
+
+    static #bindWireframe(mesh, buffer, stride = mesh.stride) {
+        Renderer.#gl.bindVertexArray(mesh.vaos[1]);
+        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, buffer);
+        Renderer.#gl.enableVertexAttribArray(Renderer.#varLocations.wireframePositionLocation);
+        Renderer.#positionPointer(mesh, Renderer.#varLocations.wireframePositionLocation, stride);
+    }
+
+    static #positionPointer(mesh, location, stride = mesh.stride) {
+        if (mesh.encoding) {
+            Renderer.#gl.vertexAttribPointer(location, 3, Renderer.#gl.UNSIGNED_SHORT, true, 0, 0);
+        } else {
+            Renderer.#gl.vertexAttribPointer(location, 3, Renderer.#gl.FLOAT, false, stride, 0);
+        }
+    }
+
+    // The wireframe shader takes barycentric coordinates from gl_VertexID so it needs three vertices per triangle
+    static #unrollWireframe(mesh) {
+        const unrolled = new mesh.vertices.constructor(mesh.indices.length * 3);
+        const components = mesh.interleaved ? 6 : 3;
+        for (let i = 0; i < mesh.indices.length; i++) {
+            const v = mesh.indices[i] * components;
+            unrolled[i * 3] = mesh.vertices[v];
+            unrolled[i * 3 + 1] = mesh.vertices[v + 1];
+            unrolled[i * 3 + 2] = mesh.vertices[v + 2];
+        }
+        mesh.buffers[3] = Renderer.#gl.createBuffer();
+        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, mesh.buffers[3]);
+        Renderer.#gl.bufferData(Renderer.#gl.ARRAY_BUFFER, unrolled, Renderer.#gl.STATIC_DRAW);
+        Renderer.#bindWireframe(mesh, mesh.buffers[3], 0);
     }
 
     static removeMesh(name) {
-        Renderer.#gl.deleteBuffer(Renderer.#meshes[name].buffers[0]);
-        Renderer.#gl.deleteBuffer(Renderer.#meshes[name].buffers[1]);
+        Renderer.#meshes[name].buffers.forEach(buffer => Renderer.#gl.deleteBuffer(buffer));
         Renderer.#meshes[name].vaos.forEach(vao => Renderer.#gl.deleteVertexArray(vao));
+        Renderer.#deleteContours(Renderer.#meshes[name]);
+        Renderer.#deleteGrid(Renderer.#meshes[name]);
         delete Renderer.#meshes[name];
+        Renderer.#drawOverview();
     }
 
     static clearMesh(name) {
-        Renderer.#meshes[name].vertices = new Float32Array([]);
-        Renderer.#meshes[name].normals = new Float32Array([]);
-        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, Renderer.#meshes[name].buffers[0]);
-        Renderer.#gl.bufferData(Renderer.#gl.ARRAY_BUFFER, Renderer.#meshes[name].vertices, Renderer.#gl.STATIC_DRAW);
-        Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, Renderer.#meshes[name].buffers[1]);
-        Renderer.#gl.bufferData(Renderer.#gl.ARRAY_BUFFER, Renderer.#meshes[name].normals, Renderer.#gl.STATIC_DRAW);
+        Renderer.updateMesh(name, new Float32Array([]), new Float32Array([]));
+        Renderer.updateContours(name, null);
+    }
+
+    // Contour lines of a mesh as quantized line strips, see decodeContours, or null for none
+    static updateContours(name, contours) {
+        const mesh = Renderer.#meshes[name];
+        Renderer.#deleteContours(mesh);
+        if (contours) {
+            // One strip per line, split by the primitive restart index WebGL2 always enables
+            const indices = new Uint32Array(contours.positions.length / 3 + contours.lengths.length - 1);
+            let point = 0;
+            let i = 0;
+            for (const length of contours.lengths) {
+                if (i > 0) indices[i++] = 0xFFFFFFFF;
+                for (let k = 0; k < length; k++) indices[i++] = point++;
+            }
+            const vao = Renderer.#gl.createVertexArray();
+            const buffers = [Renderer.#gl.createBuffer(), Renderer.#gl.createBuffer()];
+            Renderer.#gl.bindVertexArray(vao);
+            Renderer.#gl.bindBuffer(Renderer.#gl.ARRAY_BUFFER, buffers[0]);
+            Renderer.#gl.bufferData(Renderer.#gl.ARRAY_BUFFER, contours.positions, Renderer.#gl.STATIC_DRAW);
+            Renderer.#gl.enableVertexAttribArray(Renderer.#varLocations.linePositionLocation);
+            Renderer.#gl.vertexAttribPointer(Renderer.#varLocations.linePositionLocation, 3, Renderer.#gl.UNSIGNED_SHORT, true, 0, 0);
+            Renderer.#gl.bindBuffer(Renderer.#gl.ELEMENT_ARRAY_BUFFER, buffers[1]);
+            Renderer.#gl.bufferData(Renderer.#gl.ELEMENT_ARRAY_BUFFER, indices, Renderer.#gl.STATIC_DRAW);
+            Renderer.#gl.bindVertexArray(null);
+            mesh.contours = {...contours, vao, buffers, count: indices.length};
+        }
+        Renderer.#drawOverview();
+    }
+
+    static #deleteContours(mesh) {
+        if (!mesh.contours) return;
+        mesh.contours.buffers.forEach(buffer => Renderer.#gl.deleteBuffer(buffer));
+        Renderer.#gl.deleteVertexArray(mesh.contours.vao);
+        mesh.contours = null;
+    }
+
+    // Top-down view of the contour lines of every visible equation, in its color
+    static #drawOverview() {
+        const canvas = document.getElementById('contourOverview');
+        const context = canvas.getContext('2d');
+        context.clearRect(0, 0, canvas.width, canvas.height);
+        let shown = false;
+        for (const name in Renderer.#meshes) {
+            const mesh = Renderer.#meshes[name];
+            if (name === 'axes' || !mesh.visible || !mesh.contours) continue;
+            shown = true;
+            const {positions, lengths, encoding} = mesh.contours;
+            // The view spans [-10, 10] on both axes, y grows upwards
+            const x = (q) => (encoding.offset[0] + q / 65535 * encoding.scale[0] + 10) / 20 * canvas.width;
+            const y = (q) => (10 - encoding.offset[1] - q / 65535 * encoding.scale[1]) / 20 * canvas.height;
+            context.strokeStyle = `rgb(${mesh.color.map(c => Math.round(c * 255)).join(', ')})`;
+            context.beginPath();
+            let p = 0;
+            for (const length of lengths) {
+                context.moveTo(x(positions[3 * p]), y(positions[3 * p + 1]));
+                for (let k = 1; k < length; k++) context.lineTo(x(positions[3 * (p + k)]), y(positions[3 * (p + k) + 1]));
+                p += length;
+            }
+            context.stroke();
+        }
+        canvas.style.display = shown ? 'block' : 'none';
     }
 
     static render() {
@@ -422,15 +793,21 @@ class Renderer {
         Renderer.#gl.useProgram(Renderer.#lineProgram);
         Renderer.#gl.bindVertexArray(axesVAO);
         Renderer.#gl.uniformMatrix4fv(Renderer.#varLocations.lineProjectionMatrixLocation, false, Renderer.#matrices.worldViewProjectionMatrix);
+        Renderer.#gl.uniform3fv(Renderer.#varLocations.lineOffsetLocation, [0, 0, 0]);
+        Renderer.#gl.uniform3fv(Renderer.#varLocations.lineScaleLocation, [1, 1, 1]);
+        Renderer.#gl.uniform1i(Renderer.#varLocations.lineGridLocations.grid, 0);
         Renderer.#gl.lineWidth(1);
         Renderer.#gl.drawElements(Renderer.#gl.LINES, 6, Renderer.#gl.UNSIGNED_SHORT, 0);
         Renderer.updateAxesDivs();
 
+        let gridLocations = Renderer.#varLocations.phongGridLocations;
         if (Renderer.activeShader === 'wireframe') {
             Renderer.#gl.useProgram(Renderer.#wireframeProgram);
             Renderer.#gl.uniformMatrix4fv(Renderer.#varLocations.wireframeProjectionMatrixLocation, false, Renderer.#matrices.worldViewProjectionMatrix);
+            gridLocations = Renderer.#varLocations.wireframeGridLocations;
         } else if (Renderer.activeShader === 'points') {
             Renderer.#gl.useProgram(Renderer.#lineProgram);
+            gridLocations = Renderer.#varLocations.lineGridLocations;
         } else {
             Renderer.#gl.useProgram(Renderer.#phongProgram);
             Renderer.#gl.uniformMatrix4fv(Renderer.#varLocations.phongProjectionMatrixLocation, false, Renderer.#matrices.worldViewProjectionMatrix);
@@ -444,26 +821,64 @@ class Renderer {
             }
         }
 
+        // Surfaces sit a little behind their contour lines so the lines win the depth test
+        Renderer.#gl.enable(Renderer.#gl.POLYGON_OFFSET_FILL);
+        Renderer.#gl.polygonOffset(1, 1);
         for (const name in Renderer.#meshes) {
             if (name === 'axes') continue;
             const mesh = Renderer.#meshes[name];
+            if (!mesh.visible) continue;
             const color = Renderer.#meshes[name].color;
+            const offset = mesh.encoding ? mesh.encoding.offset : [0, 0, 0];
+            const scale = mesh.encoding ? mesh.encoding.scale : [1, 1, 1];
 
             if (Renderer.activeShader === 'phong' || Renderer.activeShader === 'diffuse') {
                 Renderer.#gl.bindVertexArray(mesh.vaos[0]);
                 Renderer.#gl.uniform3fv(Renderer.#varLocations.colorLocation, color);
+                Renderer.#gl.uniform3fv(Renderer.#varLocations.phongOffsetLocation, offset);
+                Renderer.#gl.uniform3fv(Renderer.#varLocations.phongScaleLocation, scale);
+                Renderer.#gl.uniform1i(Renderer.#varLocations.octahedralLocation, mesh.encoding ? 1 : 0);
             } else if (Renderer.activeShader === 'wireframe') {
+                if (mesh.indices && !mesh.buffers[3]) {
+                    Renderer.#unrollWireframe(mesh);
+                }
                 Renderer.#gl.bindVertexArray(mesh.vaos[1]);
                 Renderer.#gl.uniform3fv(Renderer.#varLocations.wireframeColorLocation, color);
+                Renderer.#gl.uniform3fv(Renderer.#varLocations.wireframeOffsetLocation, offset);
+                Renderer.#gl.uniform3fv(Renderer.#varLocations.wireframeScaleLocation, scale);
             } else if (Renderer.activeShader === 'points') {
                 Renderer.#gl.bindVertexArray(mesh.vaos[2]);
+                Renderer.#gl.uniform3fv(Renderer.#varLocations.lineOffsetLocation, offset);
+                Renderer.#gl.uniform3fv(Renderer.#varLocations.lineScaleLocation, scale);
+            }
+            Renderer.#gl.uniform1i(gridLocations.grid, mesh.grid ? 1 : 0);
+            Renderer.#gl.uniform1i(gridLocations.clip, mesh.grid?.clip ? 1 : 0);
+            if (mesh.grid) {
+                Renderer.#gl.bindVertexArray(Renderer.#gridVao);
+                Renderer.#bindGrid(mesh);
             }
             
             if (Renderer.activeShader == 'points') {
-                Renderer.#gl.drawArrays(Renderer.#gl.POINTS, 0, mesh.vertices.length / 3);
+                Renderer.#gl.drawArrays(Renderer.#gl.POINTS, 0, mesh.vertexCount);
+            } else if (mesh.indices && Renderer.activeShader === 'wireframe') {
+                Renderer.#gl.drawArrays(Renderer.#gl.TRIANGLES, 0, mesh.indices.length);
+            } else if (mesh.indices) {
+                Renderer.#gl.drawElements(Renderer.#gl.TRIANGLES, mesh.indices.length, Renderer.#gl.UNSIGNED_INT, 0);
             } else {
-                Renderer.#gl.drawArrays(Renderer.#gl.TRIANGLES, 0, mesh.vertices.length / 3);
+                Renderer.#gl.drawArrays(Renderer.#gl.TRIANGLES, 0, mesh.vertexCount);
             }
         }
+        Renderer.#gl.disable(Renderer.#gl.POLYGON_OFFSET_FILL);
+
+        Renderer.#gl.useProgram(Renderer.#lineProgram);
+        Renderer.#gl.uniform1i(Renderer.#varLocations.lineGridLocations.grid, 0);
+        for (const name in Renderer.#meshes) {
+            const mesh = Renderer.#meshes[name];
+            if (name === 'axes' || !mesh.visible || !mesh.contours) continue;
+            Renderer.#gl.bindVertexArray(mesh.contours.vao);
+            Renderer.#gl.uniform3fv(Renderer.#varLocations.lineOffsetLocation, mesh.contours.encoding.offset);
+            Renderer.#gl.uniform3fv(Renderer.#varLocations.lineScaleLocation, mesh.contours.encoding.scale);
+            Renderer.#gl.drawElements(Renderer.#gl.LINE_STRIP, mesh.contours.count, Renderer.#gl.UNSIGNED_INT, 0);
+        }
     }
 }
\ No newline at end of file
@@ -2,9 +2,31 @@ class UI {
     static table;
     static range;
     static step;
+    static centerX = 0;
+    static centerY = 0;
     static latest = 0;
     static clipZ = true;
+    static nested = false;
+    static compact = false;
+    // Explicit equations sent as their sampled heights, the renderer builds the triangles
+    static heightfield = false;
+    // Decimation of the meshes, 0 turns the budget or the tolerance off
+    static budget = 0;
+    static tolerance = 0;
+    // Contour lines per explicit equation, 0 for none
+    static contours = 0;
+    static tracing = false;
+    // Animation of the variable t
+    static playing = false;
+    static speed = 1;
+    // Stages of the last traced job, [name, start, duration] in milliseconds
+    static trace = null;
+    // Latest pointer ray to pick, only one pick is asked of the bridge at a time
+    static pendingPick = null;
+    static picking = false;
+    static hovering = false;
     static throttleUpdateMesh;
+    static saveSession;
 
     static init(throttle) {
         // Initialize event listeners for first 2 rows of the table
@@ -14,19 +36,123 @@ class UI {
         UI.throttleUpdateMesh = throttle;
         document.querySelector('#display1 button').onclick = () => UI.deleteEquation(1);
         document.querySelector('#label1 button').onclick = () => UI.viewLatex(1);
-        document.querySelector('#display1 input').onchange = (e) => Renderer.updateColor('equation1', e.target.value);
+        document.querySelector('#display1 .color').onchange = (e) => Renderer.updateColor('equation1', e.target.value);
         document.getElementById('equation1').addEventListener('input', () => UI.updateDisplay(1));
+        UI.watchPriority(1);
         document.getElementById('addEquation').onclick = () => UI.addEquation();
         document.getElementById('range').oninput = (e) => UI.updateRange(e.target.value);
         document.getElementById('meshResolution').oninput = (e) => UI.updateMeshResolution(e.target.value);
+        document.getElementById('centerX').oninput = (e) => UI.updateCenter(e.target.value, UI.centerY);
+        document.getElementById('centerY').oninput = (e) => UI.updateCenter(UI.centerX, e.target.value);
         document.getElementById('shaderType').onchange = (e) => { Renderer.activeShader = e.target.value; Renderer.render(); }
         document.getElementById('lightXRotation').oninput = (e) => { Renderer.lightXRotation = e.target.value; Renderer.updateLightPos(); }
         document.getElementById('lightYRotation').oninput = (e) => { Renderer.lightYRotation = e.target.value; Renderer.updateLightPos(); }
         document.getElementById('clipZ').onchange = (e) => { UI.clipZ = e.target.checked; UI.updateDisplay(1) }
+        document.getElementById('nestedGrid').onchange = (e) => UI.updateNested(e.target.checked);
+        document.getElementById('compactMesh').onchange = (e) => UI.updateCompact(e.target.checked);
+        document.getElementById('heightfieldMesh').onchange = (e) => UI.updateHeightfield(e.target.checked);
+        document.getElementById('tracing').onchange = (e) => UI.updateTracing(e.target.checked);
+        document.getElementById('playAnimation').onclick = () => UI.updateAnimation(!UI.playing, UI.speed);
+        document.getElementById('animationSpeed').oninput = (e) => UI.updateAnimation(UI.playing, e.target.value);
+        document.getElementById('triangleBudget').onchange = (e) => UI.updateDecimation(e.target.value, UI.tolerance);
+        document.getElementById('decimationTolerance').onchange = (e) => UI.updateDecimation(UI.budget, e.target.value);
+        document.getElementById('contourLevels').onchange = (e) => UI.updateContours(e.target.value);
+        document.querySelector('#traceOverlay button').onclick = () => UI.saveTrace();
+        Renderer.onHover = (ray, left, top) => UI.hover(ray, left, top);
 
-        bridge.createEvaluator('\\sin(x)', 'equation1', {'x': 0, 'y': 0}, 150, 10, true).then(res => {
-            if (!res) Renderer.clear();
-        })
+        // Any edit, setting or button press in the panel may change the session
+        UI.saveSession = throttle(() => bridge.saveSession(JSON.stringify(UI.session())), 500);
+        for (const type of ['input', 'change', 'click']) {
+            document.getElementById('latexEquations').addEventListener(type, () => UI.saveSession());
+        }
+        bridge.loadSession().then(json => UI.restoreSession(json));
+    }
+
+    // Equations and settings to bring back on the next launch
+    static session() {
+        const equations = [];
+        for (let num = 1; num <= UI.table.rows.length / 2; num++) {
+            equations.push({latex: document.getElementById(`equation${num}`).value,
+                            color: document.querySelector(`#display${num} .color`).value,
+                            visible: document.querySelector(`#display${num} .visible`).checked});
+        }
+        return {version: 1, range: UI.range, step: UI.step, clipZ: UI.clipZ, nested: UI.nested, compact: UI.compact,
+                heightfield: UI.heightfield, budget: UI.budget, tolerance: UI.tolerance, contours: UI.contours, centerX: UI.centerX, centerY: UI.centerY, speed: UI.speed, variables: {'x': 0, 'y': 0}, equations};
+    }
+
+    /*
+        Rebuilds the last session, or starts with \sin(x). Settings reach the bridge
+        before the equations, so meshes it cached for them are shown right away.
+    */
+    static restoreSession(json) {
+        let session = null;
+        try {
+            session = JSON.parse(json);
+        } catch (e) {}
+        if (!session || session.version !== 1 || !session.equations?.length) {
+            bridge.createEvaluator('\\sin(x)', 'equation1', {'x': 0, 'y': 0}, 150, 10, true).then(res => {
+                if (!res) Renderer.clear();
+            });
+            return;
+        }
+        UI.range = session.range;
+        UI.step = session.step;
+        UI.clipZ = session.clipZ;
+        UI.nested = session.nested;
+        UI.compact = session.compact;
+        UI.centerX = session.centerX;
+        UI.centerY = session.centerY;
+        UI.speed = session.speed;
+        UI.budget = session.budget ?? 0;
+        UI.tolerance = session.tolerance ?? 0;
+        UI.contours = session.contours ?? 0;
+        UI.heightfield = session.heightfield ?? false;
+        document.getElementById('range').value = UI.range;
+        document.getElementById('meshResolution').value = UI.step;
+        document.getElementById('clipZ').checked = UI.clipZ;
+        document.getElementById('nestedGrid').checked = UI.nested;
+        document.getElementById('compactMesh').checked = UI.compact;
+        document.getElementById('heightfieldMesh').checked = UI.heightfield;
+        document.getElementById('centerX').value = UI.centerX;
+        document.getElementById('centerY').value = UI.centerY;
+        document.getElementById('animationSpeed').value = UI.speed;
+        document.getElementById('triangleBudget').value = UI.budget;
+        document.getElementById('decimationTolerance').value = UI.tolerance;
+        document.getElementById('contourLevels').value = UI.contours;
+        UI.updateAxisLabels();
+        bridge.setDecimation(UI.budget, UI.tolerance);
+        bridge.setContours(UI.contours);
+        bridge.setHeightfield(UI.heightfield);
+        bridge.updateMesh(UI.range, UI.step, UI.clipZ, UI.centerX, UI.centerY, UI.nested, UI.compact);
+
+        session.equations.forEach(({latex, color, visible}, i) => {
+            const num = i + 1;
+            if (num > 1) {
+                UI.addEquation(latex, session.variables);
+            } else {
+                UI.showEquation(1, latex);
+                bridge.createEvaluator(latex, 'equation1', session.variables, UI.step, UI.range, UI.clipZ).then(res => {
+                    if (!res) Renderer.clear();
+                });
+            }
+            document.querySelector(`#display${num} .color`).value = color;
+            document.querySelector(`#display${num} .visible`).checked = visible;
+            UI.updatePriority(num);
+        });
+    }
+
+    static showEquation(num, latex) {
+        document.getElementById(`equation${num}`).value = latex;
+        document.getElementById(`display${num}`).querySelector('div').textContent = '\\[\\displaystyle{' + latex + '}\\]';
+        MathJax.typesetPromise();
+    }
+
+    // Colour and visibility of a row apply to its mesh once the first one arrives
+    static styleMesh(id) {
+        const display = document.getElementById(id.replace('equation', 'display'));
+        if (!display) return;
+        Renderer.updateColor(id, display.querySelector('.color').value);
+        Renderer.setVisible(id, display.querySelector('.visible').checked);
     }
 
     // Update the display with the current equation
@@ -63,7 +189,7 @@ class UI {
     }
 
     // Initialize a new equation
-    static addEquation() {
+    static addEquation(latex = '\\sin(x)', variables = {'x': 0, 'y': 0}) {
         const num = UI.table.rows.length / 2 + 1;
 
         // Create first row
@@ -76,6 +202,7 @@ class UI {
             </td>
             <td id='display${num}'>
                 <div>\\[\\displaystyle{\\displaylines{\\sin(x)}}\\]</div>
+                <input type='checkbox' class='visible' checked>
                 <input type='color' class='color' value='#ff0000'>
                 <button class='deleteEquation'>✖</button>
             </td>`;
@@ -92,17 +219,18 @@ class UI {
         // Append rows, update MathJaX
         UI.table.appendChild(row1);
         UI.table.appendChild(row2);
-        MathJax.typesetPromise();
+        UI.showEquation(num, latex);
 
         // Set event listeners
         document.getElementById(`equation${num}`).addEventListener('input', () => UI.updateDisplay(num));
         document.getElementById('clipZ').addEventListener('change', (e) => {UI.clipZ = e.target.checked; UI.updateDisplay(num) });
         document.querySelector(`#label${num} button`).onclick = () => UI.viewLatex(num);
-        document.querySelector(`#display${num} input`).onchange = (e) => Renderer.updateColor(`equation${num}`, e.target.value);
+        document.querySelector(`#display${num} .color`).onchange = (e) => Renderer.updateColor(`equation${num}`, e.target.value);
         document.querySelector(`#display${num} button`).onclick = () => UI.deleteEquation(num);
+        UI.watchPriority(num);
 
         // Create C++ evaluator, generate mesh, and render
-        bridge.createEvaluator('\\sin(x)', `equation${num}`, {'x': 0, 'y': 0}, UI.step, UI.range, UI.clipZ).then(res => {
+        bridge.createEvaluator(latex, `equation${num}`, variables, UI.step, UI.range, UI.clipZ).then(res => {
             if (!res) Renderer.clear();
         });
     }
@@ -146,12 +274,14 @@ class UI {
 
                 // Reattach clean event listeners
                 newLabel.querySelector('button').onclick = () => UI.viewLatex(i - 1);
-                newDisplay.querySelector('input').onchange = (e) => Renderer.updateColor(`equation${i - 1}`, e.target.value);
+                newDisplay.querySelector('.color').onchange = (e) => Renderer.updateColor(`equation${i - 1}`, e.target.value);
                 newDisplay.querySelector('button').onclick = () => UI.deleteEquation(i - 1);
                 newTextarea.addEventListener('input', () => UI.updateDisplay(i - 1));
+                UI.watchPriority(i - 1);
                 document.getElementById('clipZ').addEventListener('change', (e) => { UI.clipZ = e.target.checked; UI.updateDisplay(i - 1) });
 
                 // Update the C++ evaluator and generate new mesh
+                UI.updatePriority(i - 1);
                 bridge.updateEvaluator(newTextarea.value, `equation${i - 1}`, {'x': 0, 'y': 0}, UI.step, UI.range, UI.clipZ).then(res => {
                     if (!res) Renderer.clear();
                 });
@@ -162,6 +292,21 @@ class UI {
         MathJax.typesetPromise();
     }
 
+    // Report focus and visibility changes of an equation to the mesh scheduler
+    static watchPriority(num) {
+        const textarea = document.getElementById(`equation${num}`);
+        textarea.addEventListener('focus', () => UI.updatePriority(num));
+        textarea.addEventListener('blur', () => UI.updatePriority(num));
+        document.querySelector(`#display${num} .visible`).onchange = () => UI.updatePriority(num);
+    }
+
+    static updatePriority(num) {
+        const focused = document.activeElement === document.getElementById(`equation${num}`);
+        const visible = document.querySelector(`#display${num} .visible`).checked;
+        bridge.updatePriority(`equation${num}`, focused, visible);
+        Renderer.setVisible(`equation${num}`, visible);
+    }
+
     static updateRange(value) {
         if (value > 100) {
             document.getElementById('range').value = 100;
@@ -173,13 +318,156 @@ class UI {
 
         UI.range = value;
         UI.step = document.getElementById('meshResolution').value;
-        const x = document.getElementById('xAxis');
-        const y = document.getElementById('yAxis');
-        const z = document.getElementById('zAxis');
-        x.innerHTML = `<strong>X = ${value}`;
-        y.innerHTML = `<strong>Y = ${value}`;
-        z.innerHTML = `<strong>Z = ${value}`;
-        UI.throttleUpdateMesh(value, UI.step, UI.clipZ);
+        UI.updateAxisLabels();
+        UI.throttleUpdateMesh(value, UI.step, UI.clipZ, UI.centerX, UI.centerY, UI.nested, UI.compact);
+    }
+
+    // Move the centre of the view window, only newly exposed tiles are evaluated
+    static updateCenter(x, y) {
+        UI.centerX = Number(x) || 0;
+        UI.centerY = Number(y) || 0;
+        UI.updateAxisLabels();
+        UI.throttleUpdateMesh(UI.range, UI.step, UI.clipZ, UI.centerX, UI.centerY, UI.nested, UI.compact);
+    }
+
+    // Toggle 2^k + 1 nested sampling, raising resolution then reuses every existing sample
+    static updateNested(checked) {
+        UI.nested = checked;
+        UI.throttleUpdateMesh(UI.range, UI.step, UI.clipZ, UI.centerX, UI.centerY, UI.nested, UI.compact);
+    }
+
+    // Toggle quantized mesh transfer, smaller buffers at a small loss of precision
+    static updateCompact(checked) {
+        UI.compact = checked;
+        UI.throttleUpdateMesh(UI.range, UI.step, UI.clipZ, UI.centerX, UI.centerY, UI.nested, UI.compact);
+    }
+
+    // Toggle heightfield transfer, explicit equations then only send their heights and the renderer triangulates them
+    static updateHeightfield(checked) {
+        UI.heightfield = checked;
+        bridge.setHeightfield(UI.heightfield);
+    }
+
+    // Collapse triangles on flat regions, the budget caps the count and the tolerance how far the surface may move
+    static updateDecimation(budget, tolerance) {
+        UI.budget = Math.max(0, Math.round(Number(budget) || 0));
+        UI.tolerance = Math.max(0, Number(tolerance) || 0);
+        bridge.setDecimation(UI.budget, UI.tolerance);
+    }
+
+    // Reads the surface under the pointer, rays arriving while a pick runs replace each other
+    static hover(ray, left, top) {
+        UI.hovering = ray !== null;
+        UI.pendingPick = ray ? {ray, left, top} : null;
+        if (!ray) document.getElementById('probe').style.display = 'none';
+        if (!UI.picking) UI.nextPick();
+    }
+
+    static nextPick() {
+        const next = UI.pendingPick;
+        UI.pendingPick = null;
+        if (!next) return;
+        UI.picking = true;
+        bridge.pick(next.ray.origin, next.ray.direction).then(hit => {
+            UI.picking = false;
+            UI.showProbe(hit, next.left, next.top);
+            UI.nextPick();
+        });
+    }
+
+    static showProbe(hit, left, top) {
+        const probe = document.getElementById('probe');
+        if (!UI.hovering || !hit || !hit.id) {
+            probe.style.display = 'none';
+            return;
+        }
+        const format = (value) => Number(value).toPrecision(5);
+        probe.textContent = `x ${format(hit.x)}\ny ${format(hit.y)}\nz ${format(hit.z)}\n` +
+                            `∂z/∂x ${format(hit.dzdx)}\n∂z/∂y ${format(hit.dzdy)}`;
+        probe.style.left = `${left + 12}px`;
+        probe.style.top = `${top + 12}px`;
+        probe.style.display = 'block';
+    }
+
+    // Lines of constant height over explicit surfaces, evenly spaced between their lowest and highest point
+    static updateContours(levels) {
+        UI.contours = Math.max(0, Math.min(100, Math.round(Number(levels) || 0)));
+        bridge.setContours(UI.contours);
+    }
+
+    // Play or pause t, frames are meshed ahead while playing so equations using t animate smoothly
+    static updateAnimation(playing, speed) {
+        UI.playing = playing;
+        UI.speed = Math.max(0, Number(speed) || 0);
+        document.getElementById('playAnimation').textContent = playing ? '❚❚' : '▶';
+        bridge.setAnimation(UI.playing, UI.speed);
+    }
+
+    static showTime(time) {
+        document.getElementById('animationTime').textContent = time.toFixed(2);
+    }
+
+    // Record pipeline stages and show the last job's breakdown over the canvas
+    static updateTracing(checked) {
+        UI.tracing = checked;
+        UI.trace = null;
+        bridge.setTracing(checked);
+        document.getElementById('traceOverlay').style.display = checked ? 'block' : 'none';
+        UI.drawTrace();
+    }
+
+    static saveTrace() {
+        bridge.saveTrace().then(path => {
+            document.querySelector('#traceOverlay .status').textContent = path ? `Saved ${path}` : 'Could not save the trace';
+        });
+    }
+
+    static showTrace(id, job, stages) {
+        UI.trace = {id, job, stages};
+        UI.drawTrace();
+    }
+
+    // Renderer stages arrive after the C++ ones of the same job, relative to when fetching started
+    static traceRenderer(id, job, spans) {
+        if (!UI.tracing) return;
+        const now = performance.now();
+        bridge.recordSpans(id, job, spans.map(([name, start, duration]) => [name, now - start, duration]));
+        if (!UI.trace || UI.trace.id !== id || UI.trace.job !== job) return;
+        const last = UI.trace.stages.reduce((end, [name, start, duration]) => Math.max(end, start + duration), 0);
+        const first = spans.length ? spans[0][1] : now;
+        for (const [name, start, duration] of spans) {
+            UI.trace.stages.push([name, last + start - first, duration]);
+        }
+        UI.drawTrace();
+    }
+
+    static drawTrace() {
+        const list = document.querySelector('#traceOverlay .stages');
+        list.textContent = '';
+        if (!UI.trace) return;
+        const total = UI.trace.stages.reduce((end, [name, start, duration]) => Math.max(end, start + duration), 0);
+        const title = document.createElement('div');
+        title.textContent = `${UI.trace.id} job ${UI.trace.job}: ${total.toFixed(1)} ms`;
+        list.appendChild(title);
+        for (const [name, start, duration] of UI.trace.stages) {
+            const row = document.createElement('div');
+            row.className = 'stage';
+            const bar = document.createElement('span');
+            bar.className = 'bar';
+            bar.style.marginLeft = `${total ? 100 * start / total : 0}%`;
+            bar.style.width = `${total ? Math.max(100 * duration / total, 0.5) : 0}%`;
+            row.textContent = `${name} ${duration.toFixed(2)} ms`;
+            row.appendChild(bar);
+            list.appendChild(row);
+        }
+    }
+
+    // Label the positive end of each axis with the world coordinate it reaches
+    static updateAxisLabels() {
+        const range = Number(UI.range);
+        document.getElementById('xAxis').innerHTML = `<strong>X = ${UI.centerX + range}`;
+        document.getElementById('yAxis').innerHTML = `<strong>Y = ${UI.centerY + range}`;
+        document.getElementById('zAxis').innerHTML = `<strong>Z = ${range}`;
     }
 
     static updateMeshResolution(value) {
@@ -197,6 +485,6 @@ class UI {
 
         UI.step = value;
         UI.range = document.getElementById('range').value;
-        UI.throttleUpdateMesh(UI.range, value, UI.clipZ);
+        UI.throttleUpdateMesh(UI.range, value, UI.clipZ, UI.centerX, UI.centerY, UI.nested, UI.compact);
     }
 }